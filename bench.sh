@@ -0,0 +1,26 @@
+#!/bin/sh
+# Streams a fast text station through the client into a pipe, once spliced (the default when
+# STDOUT is a pipe) and once copied with writev() (-n), and prints the client's syscalls and
+# CPU time per megabyte for each.
+#
+# usage: ./bench.sh   (PORT, UDPPORT, RATE in bytes per second and SECS can be set in the environment)
+
+PORT=${PORT:-12399}
+UDPPORT=${UDPPORT:-12400}
+RATE=${RATE:-200000000}
+SECS=${SECS:-5}
+
+# the server quits when its STDIN closes, so keep it open for the whole run
+sleep $((SECS * 2 + 5)) | server_src/main $PORT media/hamlet.txt@$RATE > /dev/null 2>&1 &
+SERVER=$!
+sleep 0.5
+
+# a short run first, so neither measured run pays for the server and caches warming up
+(echo 0; sleep 1; echo q) | ./client 127.0.0.1 $PORT $UDPPORT > /dev/null 2>&1
+
+for MODE in "" -n; do
+    if [ -z "$MODE" ]; then printf "vmsplice: "; else printf "writev:   "; fi
+    { (echo 0; sleep $SECS; echo q) | ./client -c $MODE 127.0.0.1 $PORT $UDPPORT | cat > /dev/null; } 2>&1 | tail -n 1
+done
+
+kill $SERVER 2> /dev/null
@@ -13,10 +13,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 
@@ -26,17 +31,181 @@
 // for response/command codes
 #define HELLO ((uint8_t) 0)
 #define SET_STATION ((uint8_t) 1)
+#define HELLO_EXT ((uint8_t) 2)
 
 #define WELCOME ((uint8_t) 0)
 #define ANNOUNCE ((uint8_t) 1)
 #define INVALID ((uint8_t) 2)
+#define MULTICAST ((uint8_t) 3)
+#define FEATURES ((uint8_t) 4)
 
-//to get the max of two numbers
+// feature bits offered in HELLO_EXT
+#define FEATURE_MULTICAST ((uint16_t) 1)
+#define FEATURE_FRAMING ((uint16_t) 2)
+#define FEATURE_FEC ((uint16_t) 4)
+
+// framed datagrams start with: u16 station, u8 flags, u8 reserved, u32 sequence number, u64 send time in us
+#define FRAME_HEADER_SIZE 16
+
+// FEC parity datagrams have this flag set, k in the reserved byte, and for the sequence number that of the first datagram
+// they cover; in place of the send time they carry u8 p, u8 zero, u16 the XOR of the covered lengths and u32 zero. Parity
+// j of a group of k datagrams starting at a multiple of k is the XOR of its datagrams j, j+p, j+2p, ...
+#define FRAME_FLAG_PARITY 2
+
+// the largest FEC groups the client can rebuild from, how many it collects at once, and how long a missing datagram
+// is held for a parity datagram that could rebuild it
+#define FEC_MAX_GROUP 64
+#define FEC_MAX_PARITY 8
+#define FEC_GROUPS 4
+#define FEC_WAIT_MS 2000
+
+// how many datagrams can be held back waiting for a late one, and for how long; with FEC, up to two groups'
+// worth are held (RX_WINDOW), for as long as the missing one could still be rebuilt
+#define REORDER_WINDOW 8
+#define REORDER_WAIT_MS 50
+#define RX_WINDOW (2 * FEC_MAX_GROUP)
+
+// seconds between loss/reorder/delay reports
+#define STATS_INTERVAL 5
+
+//to get the max or min of two numbers
 #define MAX(a, b) (a > b ? a : b)
+#define MIN(a, b) (a < b ? a : b)
 
 // for maximum Buffer size
 #define BUFSIZE 1024
 
+// datagrams taken per recvmmsg(), and the payload each ring slot holds (the server's chunk size);
+// frame headers are received apart from the payload, so full chunks land back to back
+#define RX_BATCH 64
+#define RX_SLOT BUFSIZE
+
+// pipe size asked for when splicing into STDOUT (the unprivileged limit, /proc/sys/fs/pipe-max-size)
+#define PIPE_SIZE (1 << 20)
+
+// smallest batch worth vmsplice()ing; pinning a page costs more than copying a datagram or two
+#define SPLICE_MIN 16384
+
+// pieces of output gathered for one writev() to STDOUT
+#define OUT_MAX (2 * RX_BATCH)
+
+// room for replies read from the server but not yet handled; the longest reply is 257 bytes
+#define REPLY_BUFSIZE 4096
+
+// bytes a player typically buffers before it starts playing (about a second of 128 kbit/s MP3)
+#define AUDIBLE_BYTES 16384
+
+/*======================
+ TUNING STATS
+ =======================*/
+// how quickly the station we last tuned to got going, reported to stderr
+struct tune_stats {
+    struct timespec start;  // when SET_STATION was sent
+    size_t bytes;           // received since then
+    int first_reported;     // time to first byte printed?
+    int audible_reported;   // time to audible start printed?
+    size_t audible_bytes;   // threshold for audible start
+};
+static struct tune_stats tune = { .audible_bytes = AUDIBLE_BYTES, .first_reported = 1, .audible_reported = 1 };
+
+/*======================
+ FRAMED RECEIVE STATE
+ =======================*/
+// datagrams are written out in sequence order; ones arriving early wait in a small window
+struct rx_window {
+    int framed;                         // did the server grant FEATURE_FRAMING?
+    int fec;                            // and FEATURE_FEC?
+    int fec_k, fec_p;                   // group size and parity count, from the last parity datagram
+    int started;                        // is next_seq known yet?
+    uint16_t station;                   // station the sequence numbers belong to
+    uint32_t next_seq;                  // next sequence number to write out
+    uint32_t max_seq;                   // highest sequence number seen
+    int held;                           // datagrams waiting in the window
+    struct timespec gap_since;          // when next_seq was first found missing
+    int slot_len[RX_WINDOW];            // -1 if the slot is empty
+    uint32_t slot_seq[RX_WINDOW];
+    char slot[RX_WINDOW][BUFSIZE];
+    
+    // since the last report; with FEC, lost counts only what couldn't be recovered
+    unsigned long received, lost, reordered, duplicate, parity, recovered;
+    double delay_min, delay_max, delay_sum;
+    struct timespec last_report;
+    int interval;                       // seconds between reports, 0 for none
+};
+static struct rx_window rx = { .interval = STATS_INTERVAL, .delay_min = 1e9 };
+
+/*======================
+ FEC GROUPS
+ =======================*/
+// the running XOR of what has arrived of a group, so the one datagram of a share that went missing is the XOR of this
+// and the share's parity; the datagrams themselves may long have been written out
+struct fec_group {
+    int used;
+    uint32_t start;                         // sequence number of its first datagram
+    uint64_t have;                          // bit i set once datagram start+i is in the XOR
+    int done;                               // bit j set once parity j has arrived
+    uint16_t len_xor[FEC_MAX_PARITY];
+    char data_xor[FEC_MAX_PARITY][BUFSIZE];
+};
+static struct fec_group fec_groups[FEC_GROUPS];
+
+/*======================
+ SIMULATED LOSS
+ =======================*/
+// with -l, datagrams are dropped on arrival, in runs of burst, so that percent of them never reach the client
+struct sim_loss {
+    double percent;
+    int burst;
+    int run;                            // still to drop in the current run
+    unsigned long dropped;
+};
+static struct sim_loss sim = { .burst = 1 };
+
+/*======================
+ REPLY BUFFER
+ =======================*/
+// what has been read from the TCP socket, which may hold several replies and the start of another
+struct reply_buf {
+    uint8_t data[REPLY_BUFSIZE];
+    size_t len;
+};
+static struct reply_buf replies;
+
+/*======================
+ RECEIVE POOL
+ =======================*/
+// a page-aligned ring of datagram buffers that batches are received into in turn, and the output
+// gathered from them. When STDOUT is a pipe the output is vmsplice()d: the pipe then refers to the
+// ring's pages rather than holding a copy, so a slot is only reused once the reader has read past it.
+struct rx_pool {
+    char *ring;                         // num_slots payload buffers of RX_SLOT bytes
+    uint64_t *slot_end;                 // stream position just past what was spliced from each slot
+    int num_slots;
+    int next;                           // slot the next batch starts at
+    char hdr[RX_BATCH][FRAME_HEADER_SIZE];
+    struct iovec iov[RX_BATCH][2];      // frame header, then payload
+    struct mmsghdr msg[RX_BATCH];
+    struct iovec out[OUT_MAX];          // what the next writev() or vmsplice() writes to STDOUT
+    int num_out;
+    size_t out_len;                     // bytes queued in out
+    int out_holds_slots;                // does out point into rx.slot[]?
+    int splice;                         // is STDOUT a pipe we vmsplice() into?
+    uint64_t out_pos;                   // bytes written to STDOUT so far
+    uint64_t consumed;                  // bytes the reader is known to have taken out of the pipe
+};
+static struct rx_pool pool;
+
+// syscalls made moving the stream from the sockets to STDOUT, reported with -c
+struct io_counts {
+    int report;
+    unsigned long epoll_waits, recvmmsgs, writevs, vmsplices;
+    unsigned long long bytes;
+};
+static struct io_counts io;
+
+// set by SIGINT/SIGTERM when -c is given, so the counts are still printed
+static volatile sig_atomic_t stop_requested = 0;
+
 
 /*======================
  PRIMARY FUNCTIONS
@@ -44,11 +213,20 @@
 // Send a "HELLO" message to the server through TCP
 void send_hello(int tcp_socket, int udpport);
 
+// Send a HELLO_EXT message, offering the given features, to the server through TCP
+void send_hello_ext(int tcp_socket, int udpport, uint16_t features);
+
 // Send a SET_STATION command to the server through TCP
 void send_set_station(int tcp_socket, int station);
 
-// Read from UDP socket and echo upto BUFSIZE-1 characters back to STDOUT
-void read_and_echo(int udp_socket);
+// Drain a UDP socket a batch at a time, writing each batch to STDOUT in one writev(); returns the payload byte count
+int read_batch(int udp_socket, int framed);
+
+// Account for bytes received since the last SET_STATION and report the tuning times
+void tune_received(int bytes);
+
+// Account for a framed datagram, put it in order and queue what is ready; returns the payload byte count
+int handle_frame(const char *hdr, char *payload, int len);
 
 /*======================
  HELPER/SETUP FUNCTIONS
@@ -59,25 +237,91 @@ void init_udp_socket(struct addrinfo udp_hints, struct addrinfo *result, char *u
 // Initialize Connect the TCP Port
 void init_tcp_port(struct addrinfo tcp_hints, char *hostname, char *serverport, struct addrinfo *result, int tcp_socket);
 
+// Set up the receive ring, choosing vmsplice() output if STDOUT is a pipe and zero_copy is set
+void init_rx_pool(int zero_copy);
+
+// Add a descriptor to the epoll set; returns -1 if it can't be watched
+int watch_fd(int epfd, int fd);
+
+// Queue bytes for the next write to STDOUT, and write out everything queued
+void out_append(char *buf, int len);
+void out_flush(void);
+
+// Print the syscalls made per megabyte streamed
+void report_io(void);
+
+// Ask the event loop to stop
+void request_stop(int sig);
+
 // Handle input from the user
 int handle_input(char *buf, int tcp_socket, int channels);
 
-// Handle WELCOME message
-int handle_welcome(int tcp_socket, int channels);
+// Read whatever the server has sent into the reply buffer without blocking; returns 0 once it has closed
+int read_replies(int tcp_socket);
+
+// Length of the complete reply at the start of buf; 0 if it hasn't all arrived, -1 if its type is unknown
+int reply_length(const uint8_t *buf, size_t len);
+
+// Handle WELCOME message; returns the station count
+int handle_welcome(const uint8_t *body);
 
 // Handle ANNOUNCE message
-void handle_announce(int tcp_socket);
+void handle_announce(const uint8_t *body);
 
 // Handle INVALID command
-void handle_invalid_comm(int tcp_socket);
+void handle_invalid_comm(const uint8_t *body);
+
+// Handle MULTICAST message by joining the group; returns the socket to read the station from
+int handle_multicast(const uint8_t *body, int mcast_socket, struct in_addr mcast_if);
+
+// Handle FEATURES message; returns the features the server granted
+uint16_t handle_features(const uint8_t *body);
 
 //-----------------------------------------------------------------------------------//
 // This is where most of the logic comes into play and a majority of the functions are called
 int main(int argc, char **argv) {
-    if(argc != 4) {
-        fprintf(stderr, "Usage: ./client <hostname> <serverport> <udpport>\n");
+    //-m asks the server for multicast, joining groups on the -i interface; -f asks for framed datagrams,
+    //reporting every -s seconds; -e asks for FEC parity on top; -l drops a share of what arrives, for
+    //trying it out; -a sets the audible start threshold; -c counts syscalls and CPU time per megabyte;
+    //-n copies the stream into STDOUT even when it is a pipe
+    uint16_t features = 0;
+    int zero_copy = 1;
+    struct in_addr mcast_if;
+    mcast_if.s_addr = htonl(INADDR_ANY);
+    int opt;
+    while((opt = getopt(argc, argv, "mi:fes:l:a:cn")) != -1) {
+        if(opt == 'm') {
+            features |= FEATURE_MULTICAST;
+        } else if(opt == 'i' && inet_aton(optarg, &mcast_if)) {
+            features |= FEATURE_MULTICAST;
+        } else if(opt == 'f') {
+            features |= FEATURE_FRAMING;
+        } else if(opt == 'e') {
+            features |= FEATURE_FRAMING | FEATURE_FEC;
+        } else if(opt == 's' && atoi(optarg) >= 0) {
+            rx.interval = atoi(optarg);
+        } else if(opt == 'l' && atof(optarg) >= 0 && atof(optarg) < 100) {
+            //percent[:burst]
+            sim.percent = atof(optarg);
+            char *burst = strchr(optarg, ':');
+            if(burst != NULL) sim.burst = MAX(atoi(burst + 1), 1);
+            srand48(time(NULL) ^ getpid());
+        } else if(opt == 'a' && atoi(optarg) > 0) {
+            tune.audible_bytes = atoi(optarg);
+        } else if(opt == 'c') {
+            io.report = 1;
+        } else if(opt == 'n') {
+            zero_copy = 0;
+        } else {
+            argc = 0; //print usage
+            break;
+        }
+    }
+    if(argc - optind != 3) {
+        fprintf(stderr, "Usage: ./client [-m] [-i interface_addr] [-f] [-e] [-s stats_interval] [-l loss_percent[:burst]] [-a audible_bytes] [-c] [-n] <hostname> <serverport> <udpport>\n");
         exit(1);
     }
+    argv += optind - 1;
     
     //Set up two sockets
     int tcp_socket = socket(AF_INET, SOCK_STREAM, 0);
@@ -92,89 +336,163 @@ int main(int argc, char **argv) {
     struct addrinfo tcp_hints;
     init_tcp_port(tcp_hints, argv[1], argv[2], result, tcp_socket);
     
-    //Set up a file descriptor set for the select() loop
-    fd_set sockets;
+    //Set up the epoll set for the event loop, and the buffers datagrams are received into
+    int epfd = epoll_create1(0);
+    if(epfd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    watch_fd(epfd, tcp_socket);
+    watch_fd(epfd, udp_socket);
+    init_rx_pool(zero_copy);
+    
+    //with -c, interrupting the client still prints the counts
+    if(io.report) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = request_stop;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+    }
     
-    //Num_fds needs to be one more than the maximum file number
-    int num_fds = MAX(tcp_socket,MAX(STDIN_FILENO, udp_socket)) +1;
+    //Socket joined to the current station's multicast group, if any
+    int mcast_socket = -1;
     
     //Indicates whether the WELCOME response has been recieved yet
     int station_ready = 0;
     
-    //Start the connection by sending a hello
-    send_hello(tcp_socket, atoi(argv[3]));
+    //Start the connection by sending a hello; the unicast port stays bound so a station without a group still plays
+    if(features) {
+        send_hello_ext(tcp_socket, atoi(argv[3]), features);
+    } else {
+        send_hello(tcp_socket, atoi(argv[3]));
+    }
     
     // station count
     int channels = 0;
     
-    //The select() loop
-    while(1) {
-        //Set up the fd_set
-        FD_ZERO(&sockets);
-        FD_SET(tcp_socket, &sockets);
-        FD_SET(udp_socket, &sockets);
-        FD_SET(STDIN_FILENO, &sockets);
-        // check select
-        if(select(num_fds, &sockets, NULL, NULL, NULL) == -1) {
-            perror("select"); //if error, break
+    //The epoll() loop
+    int running = 1;
+    while(running && !stop_requested) {
+        struct epoll_event events[4];
+        int num_events = epoll_wait(epfd, events, 4, -1);
+        io.epoll_waits++;
+        if(num_events == -1) {
+            if(errno == EINTR) continue;
+            perror("epoll_wait"); //if error, break
             break;
         }
-        //If TCP socket recieved something
-        if(FD_ISSET(tcp_socket, &sockets)) {
-            uint8_t reply_type = 0;
-            if((read(tcp_socket, &reply_type, sizeof(uint8_t))) < 0) {
-                perror("read");
-                exit(1);
-            }
+        
+        for(int i = 0; i < num_events && running; i++) {
+            int fd = events[i].data.fd;
             
-            //if WELCOME
-            if(reply_type == WELCOME) {
-                //handle WELCOME
-                channels = handle_welcome(tcp_socket, channels);
-                fprintf(stderr, "There are %d stations (0-%d).\n", channels, channels-1);
-                station_ready = 1;
+            //If TCP socket recieved something: any number of replies, the last maybe only in part
+            if(fd == tcp_socket) {
+                if(!read_replies(tcp_socket)) {
+                    fprintf(stderr, "Server closed the connection\n");
+                    running = 0;
+                    break;
+                }
                 
-                //if ANNOUNCE
-            } else if(reply_type == ANNOUNCE) {
-                //handle ANNOUNCE
-                handle_announce(tcp_socket);
+                //handle every reply that has fully arrived
+                size_t pos = 0;
+                int reply_len;
+                while(running && (reply_len = reply_length(&replies.data[pos], replies.len - pos)) > 0) {
+                    uint8_t reply_type = replies.data[pos];
+                    const uint8_t *body = &replies.data[pos + 1];
+                    pos += reply_len;
+                    
+                    //if WELCOME
+                    if(reply_type == WELCOME) {
+                        //handle WELCOME
+                        channels = handle_welcome(body);
+                        fprintf(stderr, "There are %d stations (0-%d).\n", channels, channels-1);
+                        
+                        //only now is there anything to do with what the user types; if STDIN is a
+                        //regular file it can't be watched, and the client plays until it is stopped
+                        if(!station_ready) {
+                            watch_fd(epfd, STDIN_FILENO);
+                        }
+                        station_ready = 1;
+                        
+                        //if ANNOUNCE
+                    } else if(reply_type == ANNOUNCE) {
+                        //handle ANNOUNCE
+                        handle_announce(body);
+                        
+                        //if we got an INVALID COMMAND message
+                    } else if(reply_type == INVALID) {
+                        // handle invalid command
+                        handle_invalid_comm(body);
+                        //An invalid command message means the connection was closed, so stop
+                        running = 0;
+                        
+                        //if MULTICAST, the next ANNOUNCE's station is on this group
+                    } else if(reply_type == MULTICAST) {
+                        //closing the old group's socket also takes it out of the epoll set
+                        mcast_socket = handle_multicast(body, mcast_socket, mcast_if);
+                        if(mcast_socket != -1) {
+                            watch_fd(epfd, mcast_socket);
+                        }
+                        
+                        //if FEATURES, the server told us what it agreed to after the WELCOME
+                    } else if(reply_type == FEATURES) {
+                        uint16_t granted = handle_features(body);
+                        rx.framed = (granted & FEATURE_FRAMING) != 0;
+                        rx.fec = (granted & FEATURE_FEC) != 0;
+                    }
+                }
+                if(reply_len < 0) {
+                    fprintf(stderr, "Unknown reply type %d from server\n", replies.data[pos]);
+                    running = 0;
+                }
                 
-                //if we got an INVALID COMMAND message
-            } else if(reply_type == INVALID) {
-                // handle invalid command
-                handle_invalid_comm(tcp_socket);
-                //An invalid command message means the connection was closed, so break
-                break;
-            }
-        }
-        
-        //if the UDP socket is ready (it will be nearly all the time)
-        if(FD_ISSET(udp_socket, &sockets)) {
-            //read and echo for each iteration
-            read_and_echo(udp_socket);
-        }
-        
-        //If the user entered something
-        if(FD_ISSET(STDIN_FILENO, &sockets) && station_ready) {
-            //load whatever the user typed into a buffer
-            char buf[BUFSIZE];
-            int bytes_read;
-            if((bytes_read = read(STDIN_FILENO, buf, BUFSIZE)) < 0) {
-                perror("read");
-                exit(1);
+                //keep the start of a reply split across segments for next time
+                replies.len -= pos;
+                memmove(replies.data, &replies.data[pos], replies.len);
+                
+                //the station's group, when we have joined one; group datagrams are never framed
+            } else if(fd == mcast_socket) {
+                tune_received(read_batch(mcast_socket, 0));
+                
+                //if the UDP socket is ready (it will be nearly all the time)
+            } else if(fd == udp_socket) {
+                //drain it, taking off the frame headers if there are any
+                tune_received(read_batch(udp_socket, rx.framed));
+                
+                //If the user entered something
+            } else if(fd == STDIN_FILENO) {
+                //load whatever the user typed into a buffer
+                char buf[BUFSIZE];
+                int bytes_read;
+                if((bytes_read = read(STDIN_FILENO, buf, BUFSIZE - 1)) < 0) {
+                    perror("read");
+                    exit(1);
+                }
+                // account for what the user input could be
+                if(bytes_read == 0) {   //control-D
+                    running = 0;
+                    break;
+                }
+                buf[bytes_read] = 0;   //null-terminate
+                
+                //then handle user input
+                if(handle_input(buf, tcp_socket, channels)) running = 0;
             }
-            // account for what the user input could be
-            if(bytes_read == 0) break;   //control-D
-            buf[bytes_read] = 0;   //null-terminate
-            
-            //then handle user input
-            if(handle_input(buf, tcp_socket, channels)) break;
         }
     }
     
+    if(io.report) {
+        report_io();
+    }
+    
     //Close both the file descriptors before exiting
     close(tcp_socket);
     close(udp_socket);
+    close(epfd);
+    if(mcast_socket != -1) {
+        close(mcast_socket);
+    }
     return 0;
 }
 
@@ -239,6 +557,95 @@ void init_tcp_port(struct addrinfo tcp_hints, char *hostname, char *serverport,
     }
 }
 
+/*
+ Given whether zero-copy output is wanted, this function sets up the receive ring and its headers.
+ Output is vmsplice()d when STDOUT is a pipe, and written with writev() when it is a file or
+ terminal. Full chunks are received back to back, so a batch is spliced a page at a time, and a
+ ring of more pages than the pipe has buffers, plus a batch, is rarely still referenced by the time
+ it comes round again.
+ 
+ Returns: nothing
+ */
+void init_rx_pool(int zero_copy) {
+    struct stat st;
+    pool.splice = zero_copy && fstat(STDOUT_FILENO, &st) == 0 && S_ISFIFO(st.st_mode);
+    
+    long page = sysconf(_SC_PAGESIZE);
+    int pipe_bufs = 16;
+    if(pool.splice) {
+        //every spliced page (or part of one) takes a pipe buffer, so ask for more than the default 16
+        fcntl(STDOUT_FILENO, F_SETPIPE_SZ, PIPE_SIZE);
+        int pipe_size = fcntl(STDOUT_FILENO, F_GETPIPE_SZ);
+        if(pipe_size > 0) pipe_bufs = pipe_size / page;
+    }
+    pool.num_slots = MAX(2 * RX_BATCH, pipe_bufs * (page / RX_SLOT) + RX_BATCH);
+    if(posix_memalign((void **)&pool.ring, page, (size_t)pool.num_slots * RX_SLOT) != 0) {
+        fprintf(stderr, "posix_memalign failed\n");
+        exit(1);
+    }
+    pool.slot_end = calloc(pool.num_slots, sizeof(uint64_t));
+    if(pool.slot_end == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    
+    memset(pool.msg, 0, sizeof(pool.msg));
+    for(int i = 0; i < RX_BATCH; i++) {
+        pool.iov[i][0].iov_base = pool.hdr[i];
+        pool.iov[i][0].iov_len = FRAME_HEADER_SIZE;
+        pool.iov[i][1].iov_len = RX_SLOT;
+    }
+    pool.next = 0;
+    pool.num_out = 0;
+    pool.out_len = 0;
+    pool.out_holds_slots = 0;
+    pool.out_pos = 0;
+    pool.consumed = 0;
+}
+
+/*
+ Given the epoll descriptor and a descriptor to read from, this function adds it to the epoll set.
+ 
+ Returns: 0, or -1 if it can't be watched (e.g. STDIN redirected from a regular file)
+ */
+int watch_fd(int epfd, int fd) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        if(errno != EPERM) perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ Given the signal number, this function makes the event loop stop at its next wakeup.
+ 
+ Returns: nothing
+ */
+void request_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+/*
+ This function prints how many syscalls it took to move the stream from the sockets to STDOUT.
+ 
+ Returns: nothing
+ */
+void report_io(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    double cpu_ms = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e3 + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e3;
+    double mb = io.bytes / 1e6;
+    unsigned long calls = io.epoll_waits + io.recvmmsgs + io.writevs + io.vmsplices;
+    fprintf(stderr, "%lu epoll_wait, %lu recvmmsg, %lu writev, %lu vmsplice for %.2f MB: %.1f syscalls and %.2f ms CPU per MB\n",
+            io.epoll_waits, io.recvmmsgs, io.writevs, io.vmsplices, mb, mb > 0 ? calls / mb : 0.0,
+            mb > 0 ? cpu_ms / mb : 0.0);
+}
+
 /*
  Given the TCP socket and the UDP port, this function sends
  a "HELLO" message to server through TCP.
@@ -264,6 +671,30 @@ void send_hello(int tcp_socket, int udpport) {
 }
 
 
+/*
+ Given the TCP socket, the UDP port and a set of FEATURE_ bits, this function sends
+ a "HELLO_EXT" message to the server through TCP.
+ A HELLO_EXT message contains 5 bytes: the command indicator, the UDP port, and the features.
+ A station without a multicast group keeps streaming to the UDP port as usual.
+ 
+ Returns: nothing
+ */
+void send_hello_ext(int tcp_socket, int udpport, uint16_t features) {
+    uint8_t msg[5];
+    uint16_t port_n = htons(udpport);
+    uint16_t features_n = htons(features);
+    
+    // build the whole message so it goes out in one write
+    msg[0] = HELLO_EXT;
+    memcpy(&msg[1], &port_n, sizeof(uint16_t));
+    memcpy(&msg[3], &features_n, sizeof(uint16_t));
+    if(write(tcp_socket, msg, sizeof(msg)) < 0) {
+        perror("write");
+        exit(1);
+    }
+}
+
+
 /*
  Sends a SET_STATION command to the server through TCP for the selected station
  A Set Station command contains 3 bytes.
@@ -272,20 +703,24 @@ void send_hello(int tcp_socket, int udpport) {
  Returns: nothing
  */
 void send_set_station(int tcp_socket, int station) {
-    uint8_t command = SET_STATION;
+    uint8_t msg[3];
     uint16_t station_n = htons(station);
     
-    //write the command
-    if(write(tcp_socket, &command, sizeof(uint8_t)) < 0) {
+    //build the command and the station number into one write, so Nagle's algorithm
+    //doesn't hold the second half back until the first is acknowledged
+    msg[0] = SET_STATION;
+    memcpy(&msg[1], &station_n, sizeof(uint16_t));
+    if(write(tcp_socket, msg, sizeof(msg)) < 0) {
         perror("write");
         exit(1);
     }
     
-    //then write the station number
-    if(write(tcp_socket, &station_n, sizeof(uint16_t)) < 0) {
-        perror("write");
-        exit(1);
-    }
+    //and start timing how long the station takes to get going, with sequence numbers starting afresh
+    clock_gettime(CLOCK_MONOTONIC, &tune.start);
+    rx.started = 0;
+    tune.bytes = 0;
+    tune.first_reported = 0;
+    tune.audible_reported = 0;
 }
 
 /*
@@ -306,15 +741,15 @@ int handle_input(char *buf, int tcp_socket, int channels) {
     
     //A valid command is a single sequence of non-space characters w/some quantity of whitespace and then a newline
     int y = 0;
-    while(isalnum(buf[y])) y++; {
-        //skip the word part and fill the rest with null characters
-        while(buf[y] != '\n' && buf[y] != 0) {
-            if(isalnum(buf[y])) {
-                fprintf(stderr, "Invalid command.\n");
-                return 0;
-            }
-            buf[y++] = 0;
+    while(isalnum(buf[y])) y++;
+    
+    //skip the word part and fill the rest with null characters
+    while(buf[y] != '\n' && buf[y] != 0) {
+        if(isalnum(buf[y])) {
+            fprintf(stderr, "Invalid command.\n");
+            return 0;
         }
+        buf[y++] = 0;
     }
     
     // 'q' or 'quit' will indicate that the program should quit (sent to server program)
@@ -350,95 +785,641 @@ int handle_input(char *buf, int tcp_socket, int channels) {
 }
 
 /*
- Given the TCP socket and the number of channels, when the WELCOME type is received
- this function is called to notify of connection and retrieve the up to date count of
- the streaming channels.
+ Given the TCP socket, this function takes whatever the server has sent so far into the reply
+ buffer, without waiting for more. Replies are decoded from there, so one read can carry several
+ of them, and one reply can arrive over several reads.
+ 
+ Returns: 0 if the server has closed the connection, 1 otherwise
+ */
+int read_replies(int tcp_socket) {
+    ssize_t bytes_read = recv(tcp_socket, &replies.data[replies.len], REPLY_BUFSIZE - replies.len, MSG_DONTWAIT);
+    if(bytes_read < 0) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 1;
+        if(errno == ECONNRESET) return 0;
+        perror("recv");
+        exit(1);
+    }
+    if(bytes_read == 0) return 0;
+    replies.len += bytes_read;
+    return 1;
+}
+
+/*
+ Given the start of the reply buffer and how many bytes are in it, this function works out
+ whether the first reply has fully arrived, from its type and, for strings, its length byte.
+ 
+ Returns: the length of the reply, 0 if more of it is still to come, -1 if the type is unknown
+ */
+int reply_length(const uint8_t *buf, size_t len) {
+    if(len < 1) return 0;
+    size_t need;
+    switch(buf[0]) {
+        case WELCOME:
+        case FEATURES:
+            need = 1 + sizeof(uint16_t);
+            break;
+        case MULTICAST:
+            need = 1 + sizeof(uint32_t) + sizeof(uint16_t);
+            break;
+        case ANNOUNCE:
+        case INVALID:
+            //a length byte, then the string
+            if(len < 2) return 0;
+            need = 2 + buf[1];
+            break;
+        default:
+            return -1;
+    }
+    return len < need ? 0 : (int)need;
+}
+
+/*
+ Given the body of a WELCOME reply, this function is called to notify of connection and
+ retrieve the up to date count of the streaming channels.
  
  Returns: a properly converted count of the channels
  */
-int handle_welcome(int tcp_socket, int channels){
+int handle_welcome(const uint8_t *body){
     //indicate the station is ready
     fprintf(stderr, "Connected to server\n");
     
-    //get the number of channels
-    if(read(tcp_socket, &channels, sizeof(uint16_t)) < 0) {
-        perror("read");
-        exit(1);
-    }
-    
-    //convert to a host short
+    //get the number of channels and convert to a host short
+    uint16_t channels;
+    memcpy(&channels, body, sizeof(uint16_t));
     return ntohs(channels);
 }
 
 /*
- Given the TCP socket, this function is called when an ANNOUNCE message is received. This
- function prints the messages to standard out.
+ Given the body of an ANNOUNCE reply, this function prints the song name to stderr.
  
  Returns: nothing
  */
-void handle_announce(int tcp_socket){
-    //the first byte is its length
-    uint8_t len;
-    if(read(tcp_socket, &len, sizeof(uint8_t)) < 0) {
-        perror("read");
-        exit(1);
+void handle_announce(const uint8_t *body){
+    //the first byte is its length, then the name, which isn't null-terminated
+    fprintf(stderr, "Now playing: %.*s\n", body[0], (const char *)&body[1]);
+}
+
+/*
+ Given the body of an INVALID_COMMAND reply, this function prints out the message the server
+ sent in response to some invalid command. Like ANNOUNCE, its length is a single byte.
+ 
+ Returns: nothing
+ */
+void handle_invalid_comm(const uint8_t *body){
+    fprintf(stderr, "%.*s\n", body[0], (const char *)&body[1]);
+}
+
+/*
+ Given the body of a FEATURES reply, which comes right after the WELCOME that answered our
+ HELLO_EXT, this function reports what the server agreed to.
+ 
+ Returns: the FEATURE_ bits the server granted
+ */
+uint16_t handle_features(const uint8_t *body){
+    uint16_t features;
+    memcpy(&features, body, sizeof(uint16_t));
+    features = ntohs(features);
+    fprintf(stderr, "Server granted%s%s%s\n", features & FEATURE_MULTICAST ? " multicast" : "",
+            features & FEATURE_FRAMING ? " framing" : (features ? "" : " no extra features"),
+            features & FEATURE_FEC ? " FEC" : "");
+    return features;
+}
+
+/*
+ Given the body of a MULTICAST reply, the socket of the group we are in (or -1) and the interface
+ to join on, this function is called when a MULTICAST message is received. It leaves the old group and
+ joins the new one, binding the group address itself so only this station's datagrams arrive.
+ 
+ Returns: the socket joined to the new group, or -1 if joining failed
+ */
+int handle_multicast(const uint8_t *body, int mcast_socket, struct in_addr mcast_if){
+    //the group address and port, both in network order
+    struct sockaddr_in group;
+    memset(&group, 0, sizeof(group));
+    group.sin_family = AF_INET;
+    memcpy(&group.sin_addr.s_addr, &body[0], sizeof(uint32_t));
+    memcpy(&group.sin_port, &body[4], sizeof(uint16_t));
+    
+    //closing the old socket drops its membership
+    if(mcast_socket != -1) {
+        close(mcast_socket);
     }
     
-    //buffer for the message to be read into
-    char message[len];
-    if(read(tcp_socket, message, len) < 0) {
-        perror("read");
+    //several clients on one host can all listen to the same group
+    mcast_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    int reuse = 1;
+    if(setsockopt(mcast_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
+        perror("setsockopt");
         exit(1);
     }
-    //null-terminate it
-    message[len] = 0;
+    if(bind(mcast_socket, (struct sockaddr *)&group, sizeof(group)) < 0) {
+        perror("bind");
+        close(mcast_socket);
+        return -1;
+    }
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr = group.sin_addr;
+    mreq.imr_interface = mcast_if;
+    if(setsockopt(mcast_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        perror("setsockopt");
+        close(mcast_socket);
+        return -1;
+    }
+    fprintf(stderr, "Listening on multicast group %s:%d\n", inet_ntoa(group.sin_addr), ntohs(group.sin_port));
+    return mcast_socket;
+}
+
+/*
+ Given the number of bytes just received, this function reports the time to the first byte
+ after the last SET_STATION, and the time until a player would have its start-up buffer
+ (tune.audible_bytes) and begin to sound.
+ 
+ Returns: nothing
+ */
+void tune_received(int bytes) {
+    if(tune.first_reported && tune.audible_reported) return;
     
-    //and print it out to stderr
-    fprintf(stderr, "Now playing: %s\n", message);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double ms = (now.tv_sec - tune.start.tv_sec) * 1e3 + (now.tv_nsec - tune.start.tv_nsec) / 1e6;
+    tune.bytes += bytes;
+    
+    if(!tune.first_reported) {
+        fprintf(stderr, "First byte after %.1f ms\n", ms);
+        tune.first_reported = 1;
+    }
+    if(!tune.audible_reported && tune.bytes >= tune.audible_bytes) {
+        fprintf(stderr, "Audible start (%zu bytes buffered) after %.1f ms\n", tune.bytes, ms);
+        tune.audible_reported = 1;
+    }
 }
 
 /*
- Given the TCP socket, this function is called upon when and Invalid command message is returned and so
- this prints out the message that is being sent in response to some invalid command.
+ Given a time, this function returns the milliseconds since then.
+ 
+ Returns: elapsed milliseconds
+ */
+static double ms_since(const struct timespec *then) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - then->tv_sec) * 1e3 + (now.tv_nsec - then->tv_nsec) / 1e6;
+}
+
+/*
+ Given the first sequence number of a FEC group, this function finds the group's running XOR, starting
+ it afresh if its slot still holds an older group.
+ 
+ Returns: the group, or NULL if its slot has moved on to a newer one
+ */
+static struct fec_group *fec_group(uint32_t start) {
+    struct fec_group *g = &fec_groups[start / rx.fec_k % FEC_GROUPS];
+    if(g->used && g->start == start) return g;
+    if(g->used && (int32_t)(start - g->start) < 0) return NULL;
+    g->used = 1;
+    g->start = start;
+    g->have = 0;
+    g->done = 0;
+    memset(g->len_xor, 0, sizeof(g->len_xor));
+    memset(g->data_xor, 0, sizeof(g->data_xor[0]) * rx.fec_p);
+    return g;
+}
+
+/*
+ Given a sequence number, this function tells whether a parity datagram still to come could rebuild it:
+ the parity of its share hasn't arrived, nothing from two groups on has either, and it hasn't been
+ waited for FEC_WAIT_MS yet.
+ 
+ Returns: 1 if it is worth waiting for, 0 otherwise
+ */
+static int fec_pending(uint32_t seq) {
+    if(!rx.fec || rx.fec_k == 0) return 0;
+    uint32_t start = seq - seq % rx.fec_k;
+    struct fec_group *g = &fec_groups[start / rx.fec_k % FEC_GROUPS];
+    int j = (seq - start) % rx.fec_p;
+    if(g->used && g->start == start && (g->done & (1 << j))) return 0;
+    return (int32_t)(rx.max_seq - start) < 2 * rx.fec_k && ms_since(&rx.gap_since) < FEC_WAIT_MS;
+}
+
+static void xor_into(char *dst, const char *src, int len) {
+    for(int i = 0; i < len; i++) dst[i] ^= src[i];
+}
+
+/*
+ Given a data datagram's sequence number, payload and length, this function XORs it into its FEC
+ group, once.
  
  Returns: nothing
  */
-void handle_invalid_comm(int tcp_socket){
-    //read in the length of the message
-    uint16_t len;
-    if(read(tcp_socket, &len, sizeof(uint16_t)) < 0) {
-        perror("read");
-        exit(1);
+static void fec_collect(uint32_t seq, const char *payload, int len) {
+    if(!rx.fec || rx.fec_k == 0) return;
+    uint32_t i = seq % rx.fec_k;
+    struct fec_group *g = fec_group(seq - i);
+    if(g == NULL || (g->have & (1ULL << i))) return;
+    g->have |= 1ULL << i;
+    xor_into(g->data_xor[i % rx.fec_p], payload, len);
+    g->len_xor[i % rx.fec_p] ^= len;
+}
+
+/*
+ Given a rebuilt datagram's sequence number, payload and length, this function puts it in the reorder
+ window to go out in sequence, unless it was written out or given up on already, or is there anyway.
+ 
+ Returns: nothing
+ */
+static void rx_insert(uint32_t seq, const char *payload, int len) {
+    int32_t ahead = (int32_t)(seq - rx.next_seq);
+    int i = seq % RX_WINDOW;
+    if(ahead < 0 || ahead >= RX_WINDOW || (rx.slot_len[i] != -1 && rx.slot_seq[i] == seq)) return;
+    //a slot queued for STDOUT earlier in this batch may be about to be reused
+    if(pool.out_holds_slots) out_flush();
+    rx.slot_seq[i] = seq;
+    rx.slot_len[i] = len;
+    memcpy(rx.slot[i], payload, len);
+    rx.held++;
+    rx.recovered++;
+}
+
+/*
+ Given a parity datagram's header, payload and length, header included, this function rebuilds the
+ datagram of its share that is missing, if only one is: it is whatever the parity and the XOR of the
+ rest of the share don't cancel out. The first parity datagram only tells us the group size, and
+ groups are collected from then on.
+ 
+ Returns: nothing
+ */
+static void fec_parity(const char *hdr, const char *payload, int bytes_read) {
+    uint16_t station, len_xor;
+    uint32_t seq;
+    memcpy(&station, &hdr[0], sizeof(uint16_t));
+    memcpy(&seq, &hdr[4], sizeof(uint32_t));
+    memcpy(&len_xor, &hdr[10], sizeof(uint16_t));
+    station = ntohs(station);
+    seq = ntohl(seq);
+    len_xor = ntohs(len_xor);
+    int k = (uint8_t)hdr[3];
+    int p = (uint8_t)hdr[8];
+    rx.parity++;
+    if(!rx.fec || !rx.started || station != rx.station) return;
+    if(k < 1 || k > FEC_MAX_GROUP || p < 1 || p > MIN(k, FEC_MAX_PARITY)) return;
+    if(k != rx.fec_k || p != rx.fec_p) {
+        memset(fec_groups, 0, sizeof(fec_groups));
+        rx.fec_k = k;
+        rx.fec_p = p;
+        return;
     }
-    //convert from network short,
-    len = ntohs(len);
-    //make a buffer,
-    char message[len];
     
-    //read the message into the buffer,
-    if(read(tcp_socket, message, len) < 0) {
-        perror("read");
-        exit(1);
+    uint32_t j = seq % k;
+    struct fec_group *g = fec_group(seq - j);
+    if(j >= (uint32_t)p || g == NULL || (g->done & (1 << j))) return;
+    g->done |= 1 << j;
+    int missing = 0, m = 0;
+    for(int i = j; i < k; i += p) {
+        if(!(g->have & (1ULL << i))) {
+            missing++;
+            m = i;
+        }
     }
-    //null-terminate it,
-    message[len] = 0;
+    int len = len_xor ^ g->len_xor[j];
+    int parity_len = bytes_read - FRAME_HEADER_SIZE;
+    if(missing != 1 || len <= 0 || len > parity_len) return;
+    xor_into(g->data_xor[j], payload, parity_len);
+    rx_insert(g->start + m, g->data_xor[j], len);
+}
+
+/*
+ This function writes out every datagram at the head of the window, then, if the head is missing
+ and has been for REORDER_WAIT_MS (or force is set), counts it lost and moves on. With FEC, a
+ missing head is waited for as long as a parity datagram still to come could rebuild it.
+ 
+ Returns: the number of payload bytes written
+ */
+static int rx_flush(int force) {
+    int written = 0;
+    while(rx.held > 0) {
+        int i = rx.next_seq % RX_WINDOW;
+        if(rx.slot_len[i] != -1 && rx.slot_seq[i] == rx.next_seq) {
+            out_append(rx.slot[i], rx.slot_len[i]);
+            pool.out_holds_slots = 1;
+            written += rx.slot_len[i];
+            rx.slot_len[i] = -1;
+            rx.held--;
+            rx.next_seq++;
+            clock_gettime(CLOCK_MONOTONIC, &rx.gap_since);
+        } else if(force || (ms_since(&rx.gap_since) >= REORDER_WAIT_MS && !fec_pending(rx.next_seq))) {
+            rx.lost++;
+            rx.next_seq++;
+        } else {
+            break;
+        }
+    }
+    return written;
+}
+
+/*
+ This function prints, and then resets, the loss, reorder and one-way delay counters, and with FEC
+ how many of the losses parity datagrams made up for. Delay is only meaningful if our clock is
+ synchronized with the server's.
+ 
+ Returns: nothing
+ */
+static void rx_report(void) {
+    unsigned long missing = rx.lost + rx.recovered;
+    unsigned long expected = rx.received - rx.duplicate + missing;
+    fprintf(stderr, "Received %lu datagrams: %lu lost (%.2f%%)", rx.received, missing,
+            expected ? 100.0 * missing / expected : 0.0);
+    if(rx.fec) {
+        fprintf(stderr, ", %lu recovered and %lu unrecoverable with %lu parity datagrams", rx.recovered, rx.lost,
+                rx.parity);
+    }
+    if(sim.percent > 0) {
+        fprintf(stderr, " (%lu dropped by -l)", sim.dropped);
+    }
+    fprintf(stderr, ", %lu reordered, %lu duplicate or too late", rx.reordered, rx.duplicate);
+    if(rx.received > 0) {
+        fprintf(stderr, "; one-way delay %.2f/%.2f/%.2f ms min/avg/max", rx.delay_min,
+                rx.delay_sum / rx.received, rx.delay_max);
+    }
+    fprintf(stderr, "\n");
+    rx.received = rx.lost = rx.reordered = rx.duplicate = rx.parity = rx.recovered = 0;
+    sim.dropped = 0;
+    rx.delay_sum = rx.delay_max = 0;
+    rx.delay_min = 1e9;
+    clock_gettime(CLOCK_MONOTONIC, &rx.last_report);
+}
+
+/*
+ Given a framed datagram's header and payload in the receive pool and its length, header included,
+ this function accounts for its sequence number and delay and queues its payload for STDOUT if it is
+ the next one due. One that arrives early
+ is copied into the reorder window until everything before it has been queued or given up on.
+ Headers never reach STDOUT, and neither do FEC parity datagrams, only what they rebuild.
+ 
+ Returns: the number of payload bytes queued
+ */
+int handle_frame(const char *buf, char *payload, int bytes_read) {
+    if(bytes_read < FRAME_HEADER_SIZE) return 0;
+    if(buf[2] & FRAME_FLAG_PARITY) {
+        fec_parity(buf, payload, bytes_read);
+        return rx_flush(0);
+    }
+    
+    //pull the header apart
+    uint16_t station;
+    uint32_t seq, ts_hi, ts_lo;
+    memcpy(&station, &buf[0], sizeof(uint16_t));
+    memcpy(&seq, &buf[4], sizeof(uint32_t));
+    memcpy(&ts_hi, &buf[8], sizeof(uint32_t));
+    memcpy(&ts_lo, &buf[12], sizeof(uint32_t));
+    station = ntohs(station);
+    seq = ntohl(seq);
+    uint64_t sent_us = ((uint64_t)ntohl(ts_hi) << 32) | ntohl(ts_lo);
+    
+    //one-way delay against our own wall clock
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    double delay = ((int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000 - (int64_t)sent_us) / 1e3;
+    if(rx.last_report.tv_sec == 0) clock_gettime(CLOCK_MONOTONIC, &rx.last_report);
+    rx.received++;
+    rx.delay_sum += delay;
+    if(delay < rx.delay_min) rx.delay_min = delay;
+    if(delay > rx.delay_max) rx.delay_max = delay;
+    
+    //a new station (or the first datagram) starts the sequence afresh
+    int written = 0;
+    if(!rx.started || station != rx.station) {
+        written += rx_flush(1);
+        for(int i = 0; i < RX_WINDOW; i++) rx.slot_len[i] = -1;
+        memset(fec_groups, 0, sizeof(fec_groups));
+        rx.held = 0;
+        rx.started = 1;
+        rx.station = station;
+        rx.next_seq = seq;
+        rx.max_seq = seq;
+        clock_gettime(CLOCK_MONOTONIC, &rx.gap_since);
+    }
+    
+    fec_collect(seq, payload, bytes_read - FRAME_HEADER_SIZE);
     
-    //and print it out to stderr
-    fprintf(stderr, "%s\n", message);
+    int32_t ahead = (int32_t)(seq - rx.next_seq);
+    if(ahead < 0) {
+        //already written out, or given up on
+        rx.duplicate++;
+    } else {
+        //too far ahead to wait for what's missing: give up on the oldest
+        while(ahead >= (rx.fec ? RX_WINDOW : REORDER_WINDOW)) {
+            int i = rx.next_seq % RX_WINDOW;
+            if(rx.slot_len[i] != -1 && rx.slot_seq[i] == rx.next_seq) {
+                out_append(rx.slot[i], rx.slot_len[i]);
+                pool.out_holds_slots = 1;
+                written += rx.slot_len[i];
+                rx.slot_len[i] = -1;
+                rx.held--;
+            } else {
+                rx.lost++;
+            }
+            rx.next_seq++;
+            ahead--;
+            clock_gettime(CLOCK_MONOTONIC, &rx.gap_since);
+        }
+        int i = seq % RX_WINDOW;
+        if(ahead == 0) {
+            //the one due next, as nearly all are: straight out of the pool
+            out_append(payload, bytes_read - FRAME_HEADER_SIZE);
+            written += bytes_read - FRAME_HEADER_SIZE;
+            if((int32_t)(seq - rx.max_seq) < 0) rx.reordered++;
+            else rx.max_seq = seq;
+            rx.next_seq++;
+            clock_gettime(CLOCK_MONOTONIC, &rx.gap_since);
+        } else if(rx.slot_len[i] != -1 && rx.slot_seq[i] == seq) {
+            rx.duplicate++;
+        } else {
+            if((int32_t)(seq - rx.max_seq) < 0) rx.reordered++;
+            else rx.max_seq = seq;
+            //a slot queued for STDOUT earlier in this batch may be about to be reused
+            if(pool.out_holds_slots) out_flush();
+            rx.slot_seq[i] = seq;
+            rx.slot_len[i] = MIN(bytes_read - FRAME_HEADER_SIZE, BUFSIZE);
+            memcpy(rx.slot[i], payload, rx.slot_len[i]);
+            rx.held++;
+        }
+    }
+    written += rx_flush(0);
+    return written;
 }
 
 /*
- Given the UDP Socket, this function reads from it and then writes what ever was streamed to
- the socket to STDOUT. Literally doing exactly what it's name implies.
+ Given a buffer and its length, this function queues it for the next write to STDOUT, writing
+ out what is already queued first if there is no room left. A buffer that carries straight on from
+ the last one queued, as consecutive ring slots do, extends it instead. The buffer must stay
+ untouched until out_flush().
  
  Returns: nothing
  */
-void read_and_echo(int udp_socket) {
-    char buf[4096];
-    int bytes_read;
-    if((bytes_read = read(udp_socket, buf, BUFSIZE)) < 0) {
-        perror("read");
-        exit(1);
+void out_append(char *buf, int len) {
+    if(len <= 0) return;
+    if(pool.num_out > 0) {
+        struct iovec *last = &pool.out[pool.num_out - 1];
+        if((char *)last->iov_base + last->iov_len == buf) {
+            last->iov_len += len;
+            pool.out_len += len;
+            return;
+        }
+    }
+    if(pool.num_out == OUT_MAX) out_flush();
+    pool.out[pool.num_out].iov_base = buf;
+    pool.out[pool.num_out].iov_len = len;
+    pool.num_out++;
+    pool.out_len += len;
+}
+
+/*
+ Given a piece just spliced into the pipe, its length and the stream position just past it, this
+ function records that every ring slot the piece touches, from the one its first byte is in to the
+ one its last byte is in, can't be reused until the reader has got that far.
+ 
+ Returns: nothing
+ */
+static void mark_spliced(const char *buf, size_t len, uint64_t end) {
+    if(len == 0 || buf < pool.ring || buf >= pool.ring + (size_t)pool.num_slots * RX_SLOT) return;
+    int first = (buf - pool.ring) / RX_SLOT;
+    int last = (buf + len - 1 - pool.ring) / RX_SLOT;
+    for(int slot = first; slot <= last && slot < pool.num_slots; slot++) {
+        pool.slot_end[slot] = MAX(pool.slot_end[slot], end);
+    }
+}
+
+/*
+ This function writes everything queued by out_append() to STDOUT, in as few calls as the pipe or
+ file will take it in: vmsplice() into a pipe when at least SPLICE_MIN bytes are queued, unless the
+ queue points at the reorder window, which is reused too soon to be lent to the pipe; writev()
+ otherwise. A trickle of one or two datagrams per wakeup is cheaper to copy than to splice.
+ 
+ Returns: nothing
+ */
+void out_flush(void) {
+    struct iovec *out = pool.out;
+    int num_out = pool.num_out;
+    int spliced = pool.splice && !pool.out_holds_slots && pool.out_len >= SPLICE_MIN;
+    while(num_out > 0) {
+        ssize_t written = spliced ? vmsplice(STDOUT_FILENO, out, num_out, 0) : writev(STDOUT_FILENO, out, num_out);
+        if(written < 0) {
+            if(errno == EINTR) continue;
+            if(spliced && (errno == EINVAL || errno == ENOSYS)) {
+                //a pipe that won't take spliced pages; copy from now on
+                fprintf(stderr, "vmsplice not available, writing STDOUT with writev\n");
+                pool.splice = 0;
+                spliced = 0;
+                continue;
+            }
+            perror(spliced ? "vmsplice" : "writev");
+            exit(1);
+        }
+        if(spliced) io.vmsplices++;
+        else io.writevs++;
+        
+        //skip what went out, which may end part way through a piece; a piece can cover many
+        //slots, and each one the pipe now refers to is marked with where the piece ends
+        uint64_t pos = pool.out_pos;
+        pool.out_pos += written;
+        while(num_out > 0 && written > 0) {
+            size_t done = MIN((size_t)written, out->iov_len);
+            if(spliced) mark_spliced(out->iov_base, done, pos + done);
+            pos += done;
+            written -= done;
+            out->iov_base = (char *)out->iov_base + done;
+            out->iov_len -= done;
+            if(out->iov_len == 0) {
+                out++;
+                num_out--;
+            }
+        }
+    }
+    pool.num_out = 0;
+    pool.out_len = 0;
+    pool.out_holds_slots = 0;
+}
+
+/*
+ Given a position in the stream written to STDOUT, this function waits until the reader of the
+ pipe has read past it. This only waits when a reader has fallen a whole ring behind, where a
+ copying write would have blocked on the full pipe anyway.
+ 
+ Returns: nothing
+ */
+static void wait_consumed(uint64_t pos) {
+    while(pos > pool.consumed) {
+        int unread;
+        if(ioctl(STDOUT_FILENO, FIONREAD, &unread) < 0) {
+            perror("ioctl");
+            exit(1);
+        }
+        pool.consumed = pool.out_pos - unread;
+        if(pos > pool.consumed) usleep(1000);
     }
-    write(STDOUT_FILENO, buf, bytes_read);
+}
+
+/*
+ This function decides, for -l, whether the datagram just received is to be treated as lost: a run
+ of sim.burst starts at random, often enough for sim.percent of them to go.
+ 
+ Returns: 1 to drop it, 0 to keep it
+ */
+static int sim_drop(void) {
+    if(sim.run == 0 && drand48() * 100 * sim.burst < sim.percent) sim.run = sim.burst;
+    if(sim.run == 0) return 0;
+    sim.run--;
+    sim.dropped++;
+    return 1;
+}
+
+/*
+ Given a UDP Socket and whether its datagrams are framed, this function takes everything waiting
+ on it RX_BATCH datagrams per recvmmsg(), payloads into the next slots of the ring, and writes each batch to
+ STDOUT with one writev() or vmsplice(). Raw datagrams are written straight from the ring; framed
+ ones go through the reorder window first.
+ 
+ Returns: the number of payload bytes written
+ */
+int read_batch(int udp_socket, int framed) {
+    int written = 0;
+    int received;
+    do {
+        //point the batch at the next slots, once the pipe no longer refers to them, taking
+        //frame headers into their own buffers
+        uint64_t busy_until = 0;
+        for(int i = 0; i < RX_BATCH; i++) {
+            int slot = (pool.next + i) % pool.num_slots;
+            pool.iov[i][1].iov_base = &pool.ring[(size_t)slot * RX_SLOT];
+            pool.msg[i].msg_hdr.msg_iov = framed ? &pool.iov[i][0] : &pool.iov[i][1];
+            pool.msg[i].msg_hdr.msg_iovlen = framed ? 2 : 1;
+            busy_until = MAX(busy_until, pool.slot_end[slot]);
+        }
+        wait_consumed(busy_until);
+        
+        received = recvmmsg(udp_socket, pool.msg, RX_BATCH, MSG_DONTWAIT, NULL);
+        io.recvmmsgs++;
+        if(received < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) break;
+            perror("recvmmsg");
+            exit(1);
+        }
+        for(int i = 0; i < received; i++) {
+            char *buf = pool.iov[i][1].iov_base;
+            if(sim.percent > 0 && sim_drop()) continue;
+            if(framed) {
+                written += handle_frame(pool.hdr[i], buf, pool.msg[i].msg_len);
+            } else {
+                out_append(buf, pool.msg[i].msg_len);
+                written += pool.msg[i].msg_len;
+            }
+        }
+        pool.next = (pool.next + received) % pool.num_slots;
+        
+        //the batch goes out before the next one is received
+        out_flush();
+    } while(received == RX_BATCH);
+    
+    if(framed && rx.interval > 0 && ms_since(&rx.last_report) >= rx.interval * 1000.0) rx_report();
+    io.bytes += written;
+    return written;
 }
@@ -0,0 +1,588 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "connection.h"
+#include "frame.h"
+#include "misc.h"
+#include "netio.h"
+#include "registry.h"
+#include "station.h"
+
+// microbenchmarks of the server's hot paths, linked against the server's
+// own code: reply encoding and command parsing, frame headers, queueing a
+// reply on a connection, a tick's fan-out to 1..10k loopback subscribers,
+// registry churn and the station lock under contention. Prints one JSON
+// object; keep runs around and diff them.
+//
+// Every case is repeated, doubling the count, until a run takes at least
+// -t seconds, and reports that run per operation: nanoseconds, syscalls
+// the server code made (send() calls and the datagram backend's own
+// count) and heap allocations (malloc, calloc and realloc calls, counted
+// through the linker's --wrap).
+
+#define BENCH_SINKS 256       // loopback sockets the subscribers share
+#define BENCH_CHUNK 1024
+#define BENCH_JOIN_BASE 1000  // subscribers already on the station
+#define BENCH_MAX_THREADS 16
+
+struct ses_t ses;
+
+static uint64_t num_allocs;
+static uint64_t num_syscalls;
+static double min_secs = 0.2;
+static const char *filter;
+static int first_result = 1;
+static volatile uint64_t sink;  // keeps results from being optimized out
+
+void *__real_malloc(size_t);
+void *__real_calloc(size_t, size_t);
+void *__real_realloc(void *, size_t);
+ssize_t __real_send(int, const void *, size_t, int);
+
+void *__wrap_malloc(size_t size){
+  __atomic_add_fetch(&num_allocs, 1, __ATOMIC_RELAXED);
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size){
+  __atomic_add_fetch(&num_allocs, 1, __ATOMIC_RELAXED);
+  return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size){
+  __atomic_add_fetch(&num_allocs, 1, __ATOMIC_RELAXED);
+  return __real_realloc(p, size);
+}
+
+ssize_t __wrap_send(int s, const void *buf, size_t len, int flags){
+  __atomic_add_fetch(&num_syscalls, 1, __ATOMIC_RELAXED);
+  return __real_send(s, buf, len, flags);
+}
+
+static int64_t now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts_to_ns(&ts);
+}
+
+struct result_t {
+  uint64_t ops;
+  int64_t ns;
+  uint64_t syscalls;
+  uint64_t allocs;
+};
+
+static int selected(const char *name){
+  return filter == NULL || strstr(name, filter) != NULL;
+}
+
+// run n operations of a case, doubling n until a run fills min_secs, and
+// return the last run
+
+static void measure(void (*run)(void *, uint64_t), void *arg,
+                    struct result_t *r){
+  uint64_t allocs, syscalls;
+  int64_t start;
+
+  r->ops = 1;
+  while (1){
+    allocs = __atomic_load_n(&num_allocs, __ATOMIC_RELAXED);
+    syscalls = __atomic_load_n(&num_syscalls, __ATOMIC_RELAXED);
+    start = now_ns();
+    run(arg, r->ops);
+    r->ns = now_ns() - start;
+    if (r->ns >= min_secs * 1e9 || r->ops >= (1ULL << 40)){
+      break;
+    }
+    r->ops *= 2;
+  }
+  r->allocs = __atomic_load_n(&num_allocs, __ATOMIC_RELAXED) - allocs;
+  r->syscalls = __atomic_load_n(&num_syscalls, __ATOMIC_RELAXED) - syscalls;
+  return;
+}
+
+// one element of the results array; extra, if any, is appended to it
+
+static void report(const char *name, const struct result_t *r,
+                   const char *extra){
+  printf("%s\n  {\"name\": \"%s\", \"ops\": %llu, \"ns_per_op\": %.2f, "
+         "\"syscalls_per_op\": %.4f, \"allocs_per_op\": %.4f%s%s}",
+         first_result ? "" : ",", name, (unsigned long long)r->ops,
+         (double)r->ns / r->ops, (double)r->syscalls / r->ops,
+         (double)r->allocs / r->ops, extra != NULL ? ", " : "",
+         extra != NULL ? extra : "");
+  fflush(stdout);
+  first_result = 0;
+  return;
+}
+
+static void bench(const char *name, void (*run)(void *, uint64_t), void *arg){
+  struct result_t r;
+
+  if (!selected(name)){
+    return;
+  }
+  measure(run, arg, &r);
+  report(name, &r, NULL);
+  return;
+}
+
+// reply encoding and command parsing
+
+static void run_encode(void *arg, uint64_t n){
+  uint64_t i, total;
+  char buf[sizeof(struct reply_t)];
+
+  total = 0;
+  for (i=0; i<n; i++){
+    total += encode_reply((const struct reply_t *)arg, buf);
+  }
+  sink = total;
+  return;
+}
+
+struct parse_case_t {
+  uint8_t buf[8];
+  size_t len;
+};
+
+static void run_parse(void *arg, uint64_t n){
+  uint64_t i, total;
+  struct parse_case_t *c;
+  struct cmd_t cmd;
+
+  c = (struct parse_case_t *)arg;
+  total = 0;
+  for (i=0; i<n; i++){
+    total += parse_command(c->buf, c->len, &cmd) + cmd.type;
+  }
+  sink = total;
+  return;
+}
+
+static void run_frame_encode(void *arg, uint64_t n){
+  uint64_t i;
+  unsigned char hdr[FRAME_HEADER_SIZE];
+
+  (void) arg;
+  for (i=0; i<n; i++){
+    frame_encode(hdr, 3, 0, i, 1700000000000000ULL + i);
+    sink = hdr[7];
+  }
+  return;
+}
+
+static void run_frame_decode(void *arg, uint64_t n){
+  uint64_t i, total, us;
+  uint16_t station;
+  uint8_t flags;
+  uint32_t seq;
+  unsigned char hdr[FRAME_HEADER_SIZE];
+
+  (void) arg;
+  frame_encode(hdr, 3, 0, 42, 1700000000000000ULL);
+  total = 0;
+  for (i=0; i<n; i++){
+    frame_decode(hdr, &station, &flags, &seq, &us);
+    total += station + flags + seq + us;
+  }
+  sink = total;
+  return;
+}
+
+static void bench_protocol(void){
+  int i;
+  struct reply_t reply;
+  struct parse_case_t c;
+  static const struct {
+    const char *name;
+    uint8_t bytes[5];
+    size_t len;
+  } cmds[] = {
+    {"parse_command/hello", {TYPE_CMD_HELLO, 0x30, 0x39}, 3},
+    {"parse_command/set_station", {TYPE_CMD_SET_STATION, 0, 1}, 3},
+    {"parse_command/hello_ext", {TYPE_CMD_HELLO_EXT, 0x30, 0x39, 0, 3}, 5},
+    {"parse_command/partial", {TYPE_CMD_HELLO_EXT, 0x30, 0x39}, 3},
+    {"parse_command/invalid", {9, 0, 0}, 3},
+  };
+
+  reply.type = TYPE_REPLY_WELCOME;
+  reply.welcome.num_stations = 8;
+  bench("encode_reply/welcome", run_encode, &reply);
+
+  reply.type = TYPE_REPLY_ANNOUNCE;
+  reply.announce.filename_size = snprintf(reply.announce.filename,
+                                          sizeof(reply.announce.filename),
+                                          "%s", "media/some_song_title.mp3");
+  bench("encode_reply/announce", run_encode, &reply);
+
+  reply.type = TYPE_REPLY_INVALID_COMMAND;
+  reply.invalid_command.reply_string_size = strlen(ERROR_INVALID_COMMAND);
+  memcpy(reply.invalid_command.reply_string, ERROR_INVALID_COMMAND,
+         reply.invalid_command.reply_string_size);
+  bench("encode_reply/invalid_command", run_encode, &reply);
+
+  reply.type = TYPE_REPLY_MULTICAST;
+  reply.multicast.group_ip = 0xefff2a00;
+  reply.multicast.port = DEFAULT_MCAST_PORT;
+  bench("encode_reply/multicast", run_encode, &reply);
+
+  reply.type = TYPE_REPLY_FEATURES;
+  reply.features.features = FEATURE_MULTICAST | FEATURE_FRAMING;
+  bench("encode_reply/features", run_encode, &reply);
+
+  for (i=0; i<(int)(sizeof(cmds) / sizeof(cmds[0])); i++){
+    memcpy(c.buf, cmds[i].bytes, sizeof(cmds[i].bytes));
+    c.len = cmds[i].len;
+    bench(cmds[i].name, run_parse, &c);
+  }
+
+  bench("frame/encode", run_frame_encode, NULL);
+  bench("frame/decode", run_frame_decode, NULL);
+  return;
+}
+
+// an ANNOUNCE queued on a connection whose peer reads it straight back, so
+// the queue never backs up: conn_queue()'s buffer handling plus its send()
+
+struct queue_case_t {
+  struct conn_t *conn;
+  int s_peer;
+  char msg[sizeof(struct reply_t)];
+  int len;
+};
+
+static void run_queue(void *arg, uint64_t n){
+  uint64_t i;
+  char buf[sizeof(struct reply_t)];
+  struct queue_case_t *c;
+
+  c = (struct queue_case_t *)arg;
+  for (i=0; i<n; i++){
+    if (conn_queue(c->conn, c->msg, c->len) == -1 ||
+        recv(c->s_peer, buf, sizeof(buf), 0) != c->len){
+      fprintf(stderr, "conn_queue() benchmark lost a reply\n");
+      exit(-1);
+    }
+  }
+  return;
+}
+
+static void bench_queue(void){
+  int sv[2];
+  struct reply_t reply;
+  struct queue_case_t c;
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1){
+    perror("socketpair()");
+    exit(-1);
+  }
+  c.conn = (struct conn_t *)calloc(1, sizeof(struct conn_t));
+  if (c.conn == NULL){
+    perror("calloc()");
+    exit(-1);
+  }
+  c.conn->s_client = sv[0];
+  c.conn->cur_station = -1;
+  c.conn->refs = 1;
+  pthread_mutex_init(&c.conn->out_lock, NULL);
+  c.s_peer = sv[1];
+
+  reply.type = TYPE_REPLY_ANNOUNCE;
+  reply.announce.filename_size = snprintf(reply.announce.filename,
+                                          sizeof(reply.announce.filename),
+                                          "%s", "media/some_song_title.mp3");
+  c.len = encode_reply(&reply, c.msg);
+  bench("conn_queue/announce", run_queue, &c);
+
+  close(sv[1]);
+  close(sv[0]);
+  c.conn->s_client = -1;
+  conn_put(c.conn);
+  return;
+}
+
+// one station's tick: acquire its snapshot, send the chunk to everyone in
+// it and release it, as station_tick_start()/end() and the scheduler do.
+// The sinks are never drained; loopback drops a datagram on a full receive
+// buffer only after the sender has paid for it.
+
+struct fanout_case_t {
+  struct registry_t reg;
+  pthread_mutex_t lock;
+  struct netio_t *io;
+  unsigned char frame[FRAME_HEADER_SIZE];
+  char chunk[BENCH_CHUNK];
+};
+
+static int sinks[BENCH_SINKS];
+static uint16_t sink_ports[BENCH_SINKS];
+
+static void run_fanout(void *arg, uint64_t n){
+  uint64_t i, calls;
+  struct fanout_case_t *c;
+  struct snapshot_t *snap;
+  struct fanout_t *fo;
+
+  c = (struct fanout_case_t *)arg;
+  calls = netio_syscalls(c->io);
+  for (i=0; i<n; i++){
+    snap = snapshot_acquire(&c->reg);
+    fo = &snap->fanout;
+    frame_encode(c->frame, 0, 0, i, 0);
+    fo->iov[FANOUT_IOV_HEADER].iov_base = c->frame;
+    fo->iov[FANOUT_IOV_HEADER].iov_len = FRAME_HEADER_SIZE;
+    fo->iov[FANOUT_IOV_CHUNK].iov_base = c->chunk;
+    fo->iov[FANOUT_IOV_CHUNK].iov_len = BENCH_CHUNK;
+    (void) netio_send(c->io, &fo, 1, NULL);
+    snapshot_release(&c->reg, &c->lock);
+  }
+  __atomic_add_fetch(&num_syscalls, netio_syscalls(c->io) - calls,
+                     __ATOMIC_RELAXED);
+  return;
+}
+
+// a client joining and leaving a station that already has BENCH_JOIN_BASE
+// subscribers, and the tick that publishes the change
+
+static void run_join_leave(void *arg, uint64_t n){
+  uint64_t i;
+  int handle;
+  struct fanout_case_t *c;
+
+  c = (struct fanout_case_t *)arg;
+  for (i=0; i<n; i++){
+    pthread_mutex_lock(&c->lock);
+    handle = registry_add(&c->reg, NULL, INADDR_LOOPBACK,
+                          sink_ports[i % BENCH_SINKS], 0);
+    pthread_mutex_unlock(&c->lock);
+    pthread_mutex_lock(&c->lock);
+    registry_remove(&c->reg, handle);
+    pthread_mutex_unlock(&c->lock);
+    pthread_mutex_lock(&c->lock);
+    (void) registry_publish(&c->reg);
+    pthread_mutex_unlock(&c->lock);
+  }
+  return;
+}
+
+static void fanout_case_init(struct fanout_case_t *c, int num, int mode){
+  int i;
+
+  registry_init(&c->reg);
+  pthread_mutex_init(&c->lock, NULL);
+  for (i=0; i<num; i++){
+    if (registry_add(&c->reg, NULL, INADDR_LOOPBACK,
+                     sink_ports[i % BENCH_SINKS], mode) == -1){
+      perror("registry_add()");
+      exit(-1);
+    }
+  }
+  if (registry_publish(&c->reg) == -1){
+    perror("registry_publish()");
+    exit(-1);
+  }
+  memset(c->chunk, 'x', sizeof(c->chunk));
+  return;
+}
+
+static void fanout_case_destroy(struct fanout_case_t *c){
+  registry_destroy(&c->reg);
+  pthread_mutex_destroy(&c->lock);
+  return;
+}
+
+static void bench_fanout(int max_subs){
+  int i, j, mode;
+  char name[64], extra[64];
+  struct result_t r;
+  struct sockaddr_in addr;
+  socklen_t addr_len;
+  struct fanout_case_t *c;
+  static const int sizes[] = {1, 64, 256, 10000};
+
+  for (i=0; i<BENCH_SINKS; i++){
+    sinks[i] = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr_len = sizeof(addr);
+    if (sinks[i] == -1 ||
+        bind(sinks[i], (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        getsockname(sinks[i], (struct sockaddr *)&addr, &addr_len) == -1){
+      perror("sink");
+      exit(-1);
+    }
+    sink_ports[i] = ntohs(addr.sin_port);
+  }
+
+  c = (struct fanout_case_t *)calloc(1, sizeof(struct fanout_case_t));
+  if (c == NULL){
+    perror("calloc()");
+    exit(-1);
+  }
+  c->io = netio_create(socket(AF_INET, SOCK_DGRAM, 0));
+  if (c->io == NULL){
+    exit(-1);
+  }
+  for (i=0; i<(int)(sizeof(sizes) / sizeof(sizes[0])); i++){
+    if (sizes[i] > max_subs){
+      continue;
+    }
+    for (j=0; j<2; j++){
+      mode = j ? SUB_FRAMED : 0;
+      snprintf(name, sizeof(name), "fanout/%s/%d", j ? "framed" : "raw",
+               sizes[i]);
+      if (!selected(name)){
+        continue;
+      }
+      snprintf(extra, sizeof(extra), "\"datagrams_per_op\": %d", sizes[i]);
+      fanout_case_init(c, sizes[i], mode);
+      measure(run_fanout, c, &r);
+      report(name, &r, extra);
+      fanout_case_destroy(c);
+    }
+  }
+
+  snprintf(name, sizeof(name), "registry/join_leave/%d", BENCH_JOIN_BASE);
+  if (selected(name)){
+    fanout_case_init(c, BENCH_JOIN_BASE, 0);
+    bench(name, run_join_leave, c);
+    fanout_case_destroy(c);
+  }
+
+  netio_destroy(c->io);
+  free(c);
+  for (i=0; i<BENCH_SINKS; i++){
+    close(sinks[i]);
+  }
+  return;
+}
+
+// threads taking and dropping one station lock around a short critical
+// section, through station_lock()/station_unlock() and their accounting
+
+struct lock_case_t {
+  struct station_t station;
+  int num_threads;
+  uint64_t per_thread;
+  uint64_t counter;
+};
+
+static void *lock_loop(void *arg){
+  uint64_t i;
+  struct lock_case_t *c;
+
+  c = (struct lock_case_t *)arg;
+  for (i=0; i<c->per_thread; i++){
+    station_lock(&c->station);
+    c->counter++;
+    station_unlock(&c->station);
+  }
+  return NULL;
+}
+
+static void run_lock(void *arg, uint64_t n){
+  int i;
+  pthread_t t[BENCH_MAX_THREADS];
+  struct lock_case_t *c;
+
+  c = (struct lock_case_t *)arg;
+  memset(&c->station.lock_stats, 0, sizeof(c->station.lock_stats));
+  c->per_thread = (n + c->num_threads - 1) / c->num_threads;
+  for (i=0; i<c->num_threads; i++){
+    if (pthread_create(&t[i], NULL, lock_loop, c) != 0){
+      perror("pthread_create()");
+      exit(-1);
+    }
+  }
+  for (i=0; i<c->num_threads; i++){
+    pthread_join(t[i], NULL);
+  }
+  return;
+}
+
+static void bench_lock(void){
+  int i;
+  char name[64], extra[64];
+  struct result_t r;
+  struct lock_case_t *c;
+  static const int threads[] = {1, 2, 4, 8};
+
+  c = (struct lock_case_t *)calloc(1, sizeof(struct lock_case_t));
+  if (c == NULL){
+    perror("calloc()");
+    exit(-1);
+  }
+  for (i=0; i<(int)(sizeof(threads) / sizeof(threads[0])); i++){
+    snprintf(name, sizeof(name), "station_lock/%d_threads", threads[i]);
+    if (!selected(name)){
+      continue;
+    }
+    memset(c, 0, sizeof(*c));
+    pthread_mutex_init(&c->station.lock, NULL);
+    c->num_threads = threads[i];
+    measure(run_lock, c, &r);
+
+    // each run starts the lock's counters over, so they are the last run's
+
+    snprintf(extra, sizeof(extra), "\"contended_share\": %.4f",
+             (double)c->station.lock_stats.contended /
+             c->station.lock_stats.acquires);
+    report(name, &r, extra);
+    pthread_mutex_destroy(&c->station.lock);
+  }
+  free(c);
+  return;
+}
+
+static void usage(char *argv0){
+  fprintf(stderr, "usage: %s [-t seconds] [-f filter] [-n subscribers]\n"
+          "  -t  minimum run time of each case (0.2)\n"
+          "  -f  only run cases whose name contains filter\n"
+          "  -n  largest fan-out to run (10000)\n", argv0);
+  return;
+}
+
+int main(int argc, char **argv){
+  int opt, max_subs;
+  struct timespec ts;
+
+  max_subs = 10000;
+  while ((opt = getopt(argc, argv, "t:f:n:")) != -1){
+    switch (opt){
+      case 't':
+        min_secs = atof(optarg);
+        break;
+      case 'f':
+        filter = optarg;
+        break;
+      case 'n':
+        max_subs = atoi(optarg);
+        break;
+      default:
+        usage(argv[0]);
+        return -1;
+    }
+  }
+  if (min_secs <= 0 || max_subs <= 0){
+    usage(argv[0]);
+    return -1;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  printf("{\"time\": %lld, \"backend\": \"%s\", \"cpus\": %ld, "
+         "\"min_secs\": %g, \"results\": [",
+         (long long)ts.tv_sec, netio_backend(),
+         sysconf(_SC_NPROCESSORS_ONLN), min_secs);
+  bench_protocol();
+  bench_queue();
+  bench_fanout(max_subs);
+  bench_lock();
+  printf("\n]}\n");
+  return 0;
+}
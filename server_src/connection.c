@@ -1,92 +1,201 @@
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sys/epoll.h>
 #include "connection.h"
 #include "station.h"
+#include "log.h"
+#include "playlist.h"
 #include "misc.h"
 
 extern struct ses_t ses; 
 
-int send_buffer(int s, void *buf, size_t len){
+// one epoll loop serving a share of the client connections
+
+struct worker_t {
+  int epfd;
+  int s_udp;        // for sending joining clients their first history burst
+  pthread_t thread;
+};
+
+static struct worker_t *workers;
+static int num_workers, next_worker;
+
+struct conn_t *conn_get(struct conn_t *conn){
+  __atomic_add_fetch(&conn->refs, 1, __ATOMIC_RELAXED);
+  return conn;
+}
+
+void conn_put(struct conn_t *conn){
+  if (__atomic_sub_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL) == 0){
+    pthread_mutex_destroy(&conn->out_lock);
+    free(conn->out);
+    free(conn);
+  }
+  return;
+}
+
+// send as much queued output as the socket takes without blocking; the
+// caller holds out_lock
+
+static int conn_write(struct conn_t *conn){
   int ret;
   size_t total;
+
   total = 0;
-  while (total < len){
-    ret = send(s, buf + total, len - total, 0);
+  while (total < conn->out_len){
+    ret = send(conn->s_client, conn->out + total, conn->out_len - total,
+               MSG_NOSIGNAL);
     if (ret == -1){
-      perror("send()");
+      if (errno == EINTR){
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK){
+        break;
+      }
+      log_error("session id %d: send(): %m", conn->s_client);
       return -1;
     }
-    if (ret == 0){
+    total += ret;
+  }
+  conn->out_len -= total;
+  memmove(conn->out, conn->out + total, conn->out_len);
+  return 0;
+}
+
+// flush queued output, and have the worker watch for writability only while
+// a backlog remains; the caller holds out_lock
+
+static int conn_flush(struct conn_t *conn){
+  int want_out;
+  struct epoll_event ev;
+
+  if (conn_write(conn) == -1){
+    return -1;
+  }
+  want_out = conn->out_len > 0;
+  if (want_out != conn->want_out){
+    ev.events = EPOLLIN | (want_out ? EPOLLOUT : 0);
+    ev.data.ptr = conn;
+    if (epoll_ctl(conn->worker->epfd, EPOLL_CTL_MOD, conn->s_client,
+                  &ev) == -1){
+      log_error("session id %d: epoll_ctl(): %m", conn->s_client);
       return -1;
     }
-    total += ret;
+    conn->want_out = want_out;
   }
   return 0;
 }
 
-int recv_buffer(int s, void *buf, size_t len){
+// append len bytes to the connection's outbound buffer and push out what
+// the socket takes right now; never blocks, so any thread may call it
+
+int conn_queue(struct conn_t *conn, const void *buf, size_t len){
   int ret;
-  size_t total;
-  total = 0;
-  while (total < len){
-    ret = recv(s, buf + total, len - total, 0);
-    if (ret == -1){
-      perror("recv()");
-      return RECV_ERROR;
+  size_t size;
+  void *p;
+
+  pthread_mutex_lock(&conn->out_lock);
+
+  if (conn->s_client == -1){
+    pthread_mutex_unlock(&conn->out_lock);
+    return -1;
+  }
+
+  // a client that stopped reading gets cut off rather than buffered forever
+
+  if (conn->out_len + len > CONN_OUTBUF_MAX){
+    log_warn("session id %d: client not reading replies; closing connection",
+             conn->s_client);
+    shutdown(conn->s_client, SHUT_RDWR);
+    pthread_mutex_unlock(&conn->out_lock);
+    return -1;
+  }
+  if (conn->out_len + len > conn->out_size){
+    size = conn->out_size ? conn->out_size : CONN_OUTBUF_INITIAL;
+    while (size < conn->out_len + len){
+      size *= 2;
     }
-    if (ret == 0){
-      return RECV_CLOSED;
+    p = realloc(conn->out, size);
+    if (p == NULL){
+      log_error("realloc(): %m");
+      pthread_mutex_unlock(&conn->out_lock);
+      return -1;
+    }
+    conn->out = p;
+    conn->out_size = size;
+  }
+  memcpy(conn->out + conn->out_len, buf, len);
+  conn->out_len += len;
+
+  // with a backlog already queued, the worker flushes on EPOLLOUT
+
+  ret = 0;
+  if (conn->out_len == len){
+    ret = conn_flush(conn);
+    if (ret == -1){
+      shutdown(conn->s_client, SHUT_RDWR);
     }
-    total += ret;
   }
-  return RECV_SUCCESS;
+
+  pthread_mutex_unlock(&conn->out_lock);
+  return ret;
 }
 
-int recv_command(int s, struct cmd_t *cmd){
-  int ret;
+// decode one command from the len bytes at buf; returns the number of bytes
+// it took, 0 if the command isn't complete yet, or RECV_INVALID_COMMAND
 
-  // must do multiple recvs, as incoming packet size is unknown
+int parse_command(const void *buf, size_t len, struct cmd_t *cmd){
+  const uint8_t *p;
+  uint16_t uint16_tmp;
 
-  ret = recv_buffer(s, &cmd->type, sizeof(cmd->type));
-  if (ret != RECV_SUCCESS){
-    return ret;
+  p = buf;
+  if (len < sizeof(cmd->type)){
+    return 0;
   }
-  switch (cmd->type){ 
+  cmd->type = p[0];
+  switch (cmd->type){
     case TYPE_CMD_HELLO:
-      ret = recv_buffer(s, &cmd->hello.udp_port,
-                        sizeof(cmd->hello.udp_port));
-      if (ret != RECV_SUCCESS){
-        return ret;
-      }
-      cmd->hello.udp_port = ntohs(cmd->hello.udp_port);
-      break;
     case TYPE_CMD_SET_STATION:
-      ret = recv_buffer(s, &cmd->set_station.station_no,
-                        sizeof(cmd->set_station.station_no));
-      if (ret != RECV_SUCCESS){
-        return ret;
+      if (len < sizeof(cmd->type) + sizeof(uint16_tmp)){
+        return 0;
       }
-      cmd->set_station.station_no = ntohs(cmd->set_station.station_no);
-      break;
+      memcpy(&uint16_tmp, p + sizeof(cmd->type), sizeof(uint16_tmp));
+      if (cmd->type == TYPE_CMD_HELLO){
+        cmd->hello.udp_port = ntohs(uint16_tmp);
+      }
+      else {
+        cmd->set_station.station_no = ntohs(uint16_tmp);
+      }
+      return sizeof(cmd->type) + sizeof(uint16_tmp);
+    case TYPE_CMD_HELLO_EXT:
+      if (len < sizeof(cmd->type) + 2 * sizeof(uint16_tmp)){
+        return 0;
+      }
+      memcpy(&uint16_tmp, p + sizeof(cmd->type), sizeof(uint16_tmp));
+      cmd->hello_ext.udp_port = ntohs(uint16_tmp);
+      memcpy(&uint16_tmp, p + sizeof(cmd->type) + sizeof(uint16_tmp),
+             sizeof(uint16_tmp));
+      cmd->hello_ext.features = ntohs(uint16_tmp);
+      return sizeof(cmd->type) + 2 * sizeof(uint16_tmp);
     default:
       return RECV_INVALID_COMMAND;
-      break;
   }
-  return 0;
 }
 
-int send_reply(int s, const struct reply_t *reply){
-  int ret;
-  char buf[sizeof(struct reply_t)], *p;
+// encode reply in wire format into buf, which must hold at least
+// sizeof(struct reply_t) bytes; returns the encoded length
+
+int encode_reply(const struct reply_t *reply, void *buf){
+  char *p;
   uint16_t uint16_tmp;
+  uint32_t uint32_tmp;
 
   p = buf;
 
-  // prepare buffer for sending
-
   memcpy(p, &reply->type, sizeof(reply->type));
   p += sizeof(reply->type);
   switch (reply->type){
@@ -110,228 +219,440 @@ int send_reply(int s, const struct reply_t *reply){
              reply->invalid_command.reply_string_size);
       p += reply->invalid_command.reply_string_size;
       break;
+    case TYPE_REPLY_MULTICAST:
+      uint32_tmp = htonl(reply->multicast.group_ip);
+      memcpy(p, &uint32_tmp, sizeof(uint32_tmp));
+      p += sizeof(uint32_tmp);
+      uint16_tmp = htons(reply->multicast.port);
+      memcpy(p, &uint16_tmp, sizeof(uint16_tmp));
+      p += sizeof(uint16_tmp);
+      break;
+    case TYPE_REPLY_FEATURES:
+      uint16_tmp = htons(reply->features.features);
+      memcpy(p, &uint16_tmp, sizeof(uint16_tmp));
+      p += sizeof(uint16_tmp);
+      break;
   };
 
-  // send buffer
-
-  ret = send_buffer(s, buf, p-buf);
-  if (ret == -1){
-    return -1;
-  }
+  return p - (char *)buf;
+}
 
-  return 0;
+int conn_send_reply(struct conn_t *conn, const struct reply_t *reply){
+  char buf[sizeof(struct reply_t)];
+  return conn_queue(conn, buf, encode_reply(reply, buf));
 }
 
-void *connection_loop(struct connection_info_t *connection_info){
-  int abort, cur_slot, cur_station, ret, s_client;
-  struct cmd_t cmd;
+// send INVALID_COMMAND carrying msg; the caller then closes the connection
+
+static void send_invalid(struct conn_t *conn, const char *msg){
   struct reply_t reply;
-  uint32_t ip;
-  uint16_t udp_port;
+  reply.type = TYPE_REPLY_INVALID_COMMAND;
+  reply.invalid_command.reply_string_size = strlen(msg);
+  memcpy(reply.invalid_command.reply_string, msg,
+         reply.invalid_command.reply_string_size);
+  (void) conn_send_reply(conn, &reply);
+  return;
+}
 
-  memcpy(&ip, &connection_info->ip, sizeof(uint32_t));
-  s_client = connection_info->s_client;
-  free(connection_info);
+// from any thread holding a reference: send INVALID_COMMAND carrying msg
+// and have the connection's worker close it, as if the client had hung up,
+// once that is out
 
-  abort = 0;
-  cur_station = -1;
+void conn_kick(struct conn_t *conn, const char *msg){
+  send_invalid(conn, msg);
+  pthread_mutex_lock(&conn->out_lock);
+  if (conn->s_client != -1){
+    (void) shutdown(conn->s_client, SHUT_RD);
+  }
+  pthread_mutex_unlock(&conn->out_lock);
+  return;
+}
 
-  // read HELLO 
+// unsubscribe from the current station, if any and unless the station was
+// torn down (and its registry emptied) since we joined it
 
-  fprintf(stderr, "session id %d: new client connected; expecting HELLO\n", s_client);
+static void leave_station(struct conn_t *conn){
+  struct station_t *station;
 
-  ret = recv_command(s_client, &cmd);
-  if (ret != RECV_SUCCESS || cmd.type != TYPE_CMD_HELLO){
-    if (ret == RECV_SUCCESS || ret == RECV_INVALID_COMMAND){
-      reply.type = TYPE_REPLY_INVALID_COMMAND;
-      reply.invalid_command.reply_string_size = strlen(ERROR_NO_HELLO);
-      memcpy(reply.invalid_command.reply_string, ERROR_NO_HELLO,
-             reply.invalid_command.reply_string_size);
-      (void) send_reply(s_client, &reply);
-    }
-    close(s_client);
-    return NULL;
+  if (conn->cur_station == -1){
+    return;
   }
+  station = station_get(conn->cur_station);
 
-  udp_port = cmd.hello.udp_port;
+  station_lock(station);
+  if (station->generation == conn->cur_gen){
+    registry_remove(&station->clients, conn->cur_handle);
+    stats_add(&station->stats.leaves, 1);
+  }
+  station_unlock(station);
 
-  // send WELCOME
+  conn->cur_station = -1;
+  return;
+}
 
-  fprintf(stderr,
-          "session id %d, UDP port %d: HELLO received; sending WELCOME, expecting SET_STATION\n",
-          s_client, udp_port);
+// subscribe to station_no; returns -1 if the connection has to be closed
 
-  reply.type = TYPE_REPLY_WELCOME;
-  reply.welcome.num_stations = ses.num_stations;
+static int join_station(struct conn_t *conn, int station_no){
+  int handle, mode, wake;
+  uint64_t start;
+  size_t announce_len;
+  char announce[sizeof(struct reply_t)];
+  struct station_t *station;
+  struct history_burst_t burst;
+  struct subscriber_t *sub;
+  struct reply_t reply;
 
-  ret = send_reply(s_client, &reply);
-  if (ret == -1){
-    close(s_client);
-    return NULL;
+  station = station_get(station_no);
+
+  // tell a capable client where to listen before anything else
+
+  mode = conn->features & FEATURE_FRAMING ? SUB_FRAMED : 0;
+  if ((conn->features & FEATURE_MULTICAST) && station->clients.group_ip != 0){
+    mode |= SUB_MULTICAST;
+    reply.type = TYPE_REPLY_MULTICAST;
+    reply.multicast.group_ip = station->clients.group_ip;
+    reply.multicast.port = station->clients.group_port;
+    if (conn_send_reply(conn, &reply) == -1){
+      return -1;
+    }
+  }
+
+  // parity only goes out unicast, like the frame headers it relies on
+
+  if ((conn->features & FEATURE_FEC) && !(mode & SUB_MULTICAST)){
+    mode |= SUB_FEC;
   }
 
-  // expect SET_STATION until client closes
+  station_lock(station);
+  if (station->state != STATION_LIVE){
+    station_unlock(station);
+    log_info("session id %d: station %d was removed, sending INVALID_COMMAND; closing connection",
+             conn->s_client, station_no);
+    send_invalid(conn, ERROR_NO_SUCH_STATION);
+    return -1;
+  }
 
-  while ((ret = recv_command(s_client, &cmd)) == RECV_SUCCESS){
-    if (cmd.type == TYPE_CMD_SET_STATION &&
-        cmd.set_station.station_no < ses.num_stations){
+  // a client joining mid-stream first catches up on the station's recent
+  // history, at burst_chunks per tick, and only then goes live
 
-      fprintf(stderr, "session id %d: received SET_STATION to station %d\n",
-              s_client, cmd.set_station.station_no);
+  start = history_start(&station->history);
+  if (ses.burst_chunks > 0 && start < history_head(&station->history)){
+    mode |= SUB_BURSTING;
+  }
+  burst.num = 0;
+  handle = registry_add(&station->clients, conn, conn->ip, conn->udp_port,
+                        mode);
+  if (handle != -1){
+    sub = registry_get(&station->clients, handle);
+    sub->flags = CLIENT_ACTIVE;
+
+    // the first slice goes out now rather than at the next tick, so the
+    // player has something to decode as soon as it has the ANNOUNCE; it
+    // is read out here and sent once the lock is let go
+
+    if (mode & SUB_BURSTING){
+      sub->burst_next = start;
+      history_read(&station->history, &sub->burst_next, ses.burst_chunks,
+                   &burst);
+    }
+  }
 
-      // unsubscribe from current station
+  // the ANNOUNCE changes with the track, so take a copy while locked
 
-      if (cur_station != -1){
+  memcpy(announce, station->announce, station->announce_len);
+  announce_len = station->announce_len;
+  conn->cur_gen = station->generation;
 
-        ret = pthread_mutex_lock(&ses.station[cur_station].lock);
-        if (ret != 0){
-          perror("pthread_mutex_lock()");
-          exit(-1);
-        }
+  // the first listener of a parked station wakes it; the stream starts
+  // once its track is open, the ANNOUNCE goes out now
 
-        if (ses.station[cur_station].client[cur_slot].flags & CLIENT_NEW){
-          fprintf(stderr, "session id %d: client sent two SET_STATION commands without waiting for ANNOUNCE inbetween; sending INVALID_COMMAND; closing connection\n", s_client);
-          abort = 1;
-          reply.type = TYPE_REPLY_INVALID_COMMAND;
-          reply.invalid_command.reply_string_size = strlen(ERROR_SS_OUT_OF_ORDER);
-          memcpy(reply.invalid_command.reply_string, ERROR_SS_OUT_OF_ORDER,
-                 reply.invalid_command.reply_string_size);
-          (void) send_reply(s_client, &reply);
-          close(s_client);
-        }
+  wake = handle != -1 && station->parked == STATION_PARKED;
+  if (wake){
+    station->parked = STATION_WAKING;
+  }
 
-        ses.station[cur_station].client[cur_slot].flags = 0;
+  station_unlock(station);
+  if (wake){
+    playlist_resume(station);
+  }
 
-        ret = pthread_mutex_unlock(&ses.station[cur_station].lock);
-        if (ret != 0){
-          perror("pthread_mutex_unlock()");
-          exit(-1);
-        }
+  // a removal lets go of the station's songs under the write lock
 
-        if (abort){
-          return NULL;
-        }
+  if (burst.num > 0){
+    stations_read_lock();
+    if (history_send(&burst, conn->worker->s_udp, conn->ip, conn->udp_port,
+                     mode & SUB_FRAMED, station_no) == -1){
+      log_error("session id %d: sendmmsg(): %m", conn->s_client);
+    }
+    stations_read_unlock();
+  }
 
-      }
+  if (handle == -1){
+    log_error("session id %d: out of memory subscribing to station %d; closing connection",
+              conn->s_client, station_no);
+    return -1;
+  }
 
-      // subscribe to new station
+  conn->cur_station = station_no;
+  conn->cur_handle = handle;
+  stats_add(&station->stats.joins, 1);
+  stats_add(&station->stats.announces, 1);
+  return conn_queue(conn, announce, announce_len);
+}
 
-      cur_station = cmd.set_station.station_no;
+// advance the protocol state machine by one command; returns -1 if the
+// connection has to be closed
 
-      ret = pthread_mutex_lock(&ses.station[cur_station].lock);
-      if (ret != 0){
-        perror("pthread_mutex_lock()");
-        exit(-1);
-      }
+static int handle_command(struct conn_t *conn, const struct cmd_t *cmd){
+  struct reply_t reply;
 
-      for (cur_slot=0; cur_slot<MAX_CLIENTS_PER_STATION; cur_slot++){
-        if (!(ses.station[cur_station].client[cur_slot].flags & CLIENT_ACTIVE)){
-          ses.station[cur_station].client[cur_slot].flags = CLIENT_ACTIVE |
-                                                            CLIENT_NEW;
-          ses.station[cur_station].client[cur_slot].s_client = s_client;
-          ses.station[cur_station].client[cur_slot].ip = ip; 
-          ses.station[cur_station].client[cur_slot].udp_port = udp_port; 
-          break;
-        }
-      }
-      if (cur_slot == MAX_CLIENTS_PER_STATION){
-        // TODO realloc client list
-        fprintf(stderr,
-                "session id %d: functionality not implemented, sending INVALID_COMMAND; closing connection\n",
-                s_client);
-        abort = 1;
-        reply.type = TYPE_REPLY_INVALID_COMMAND;
-        reply.invalid_command.reply_string_size = strlen(ERROR_NOT_IMPLEMENTED);
-        memcpy(reply.invalid_command.reply_string, ERROR_NOT_IMPLEMENTED,
-               reply.invalid_command.reply_string_size);
-        (void) send_reply(s_client, &reply);
-        close(s_client);
+  // expect HELLO first, and answer it with WELCOME
+
+  if (conn->state == CONN_EXPECT_HELLO){
+    if (cmd->type == TYPE_CMD_HELLO_EXT){
+      conn->udp_port = cmd->hello_ext.udp_port;
+      conn->features = cmd->hello_ext.features &
+                       (FEATURE_FRAMING |
+                        (ses.mcast_group != 0 ? FEATURE_MULTICAST : 0) |
+                        (ses.fec_k != 0 ? FEATURE_FEC : 0));
+      if (!(conn->features & FEATURE_FRAMING)){
+        conn->features &= ~FEATURE_FEC;
       }
+    }
+    else if (cmd->type == TYPE_CMD_HELLO){
+      conn->udp_port = cmd->hello.udp_port;
+    }
+    else {
+      send_invalid(conn, ERROR_NO_HELLO);
+      return -1;
+    }
 
-      ret = pthread_mutex_unlock(&ses.station[cur_station].lock);
-      if (ret != 0){
-        perror("pthread_mutex_unlock()");
-        exit(-1);
-      }
+    log_info("session id %d, UDP port %d: HELLO received; sending WELCOME, expecting SET_STATION",
+             conn->s_client, conn->udp_port);
 
-      if (abort){
-        return NULL;
-      }
+    reply.type = TYPE_REPLY_WELCOME;
+    reply.welcome.num_stations = __atomic_load_n(&ses.num_stations,
+                                                 __ATOMIC_ACQUIRE);
+    if (conn_send_reply(conn, &reply) == -1){
+      return -1;
+    }
+
+    // a HELLO_EXT is answered with what the client may rely on
 
+    if (cmd->type == TYPE_CMD_HELLO_EXT){
+      reply.type = TYPE_REPLY_FEATURES;
+      reply.features.features = conn->features;
+      if (conn_send_reply(conn, &reply) == -1){
+        return -1;
+      }
     }
-    else {
+    conn->state = CONN_EXPECT_SET_STATION;
+    return 0;
+  }
 
-      // invalid command
+  // then expect SET_STATION until client closes
 
-      if (cur_station != -1){
+  if (cmd->type != TYPE_CMD_SET_STATION){
+    log_warn("session id %d: received something else while expecting SET_STATION, sending INVALID_COMMAND; closing connection", conn->s_client);
+    leave_station(conn);
+    send_invalid(conn, ERROR_NO_SET_STATION);
+    return -1;
+  }
+  if (cmd->set_station.station_no >=
+      __atomic_load_n(&ses.num_stations, __ATOMIC_ACQUIRE)){
+    log_warn("session id %d: received request for invalid station, sending INVALID_COMMAND; closing connection", conn->s_client);
+    leave_station(conn);
+    send_invalid(conn, ERROR_NO_SUCH_STATION);
+    return -1;
+  }
 
-        ret = pthread_mutex_lock(&ses.station[cur_station].lock);
-        if (ret != 0){
-          perror("pthread_mutex_lock()");
-          exit(-1);
-        }
+  log_info("session id %d: received SET_STATION to station %d",
+           conn->s_client, cmd->set_station.station_no);
 
-        ses.station[cur_station].client[cur_slot].flags = 0;
+  // every SET_STATION is answered with an ANNOUNCE right away, so there is
+  // no window for one to arrive out of order
 
-        ret = pthread_mutex_unlock(&ses.station[cur_station].lock);
-        if (ret != 0){
-          perror("pthread_mutex_unlock()");
-          exit(-1);
-        }
+  leave_station(conn);
+  return join_station(conn, cmd->set_station.station_no);
+}
 
-      }
+// read whatever the client sent and run every complete command in it;
+// returns -1 if the connection has to be closed
 
-      reply.type = TYPE_REPLY_INVALID_COMMAND;
-      if (cmd.type != TYPE_CMD_SET_STATION){
-        fprintf(stderr, "session id %d: received something else while expecting SET_STATION, sending INVALID_COMMAND; closing connection\n", s_client);
-        reply.invalid_command.reply_string_size = strlen(ERROR_NO_SET_STATION);
-        memcpy(reply.invalid_command.reply_string, ERROR_NO_SET_STATION,
-               reply.invalid_command.reply_string_size);
-      }
-      else {
-        fprintf(stderr, "session id %d: received request for invalid station, sending INVALID_COMMAND; closing connection\n", s_client);
-        reply.invalid_command.reply_string_size = strlen(ERROR_NO_SUCH_STATION);
-        memcpy(reply.invalid_command.reply_string, ERROR_NO_SUCH_STATION,
-               reply.invalid_command.reply_string_size);
-      }
-      (void) send_reply(s_client, &reply);
-      close(s_client);
-      return NULL;
+static int conn_readable(struct conn_t *conn){
+  int ret;
+  size_t pos;
+  struct cmd_t cmd;
 
+  ret = recv(conn->s_client, conn->in + conn->in_len,
+             sizeof(conn->in) - conn->in_len, 0);
+  if (ret == -1){
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR){
+      return 0;
     }
+    log_error("session id %d: recv(): %m", conn->s_client);
+    return -1;
   }
+  if (ret == 0){
+    log_info("session id %d: client closed connection", conn->s_client);
+    return -1;
+  }
+  conn->in_len += ret;
 
+  pos = 0;
+  while ((ret = parse_command(conn->in + pos, conn->in_len - pos, &cmd)) > 0){
+    pos += ret;
+    if (handle_command(conn, &cmd) == -1){
+      return -1;
+    }
+  }
   if (ret == RECV_INVALID_COMMAND){
-    fprintf(stderr, "session id %d: received command with invalid type, sending INVALID_COMMAND; closing connection\n", s_client);
-    reply.type = TYPE_REPLY_INVALID_COMMAND;
-    reply.invalid_command.reply_string_size = strlen(ERROR_INVALID_COMMAND);
-    memcpy(reply.invalid_command.reply_string, ERROR_INVALID_COMMAND,
-           reply.invalid_command.reply_string_size);
-    (void) send_reply(s_client, &reply);
+    if (conn->state == CONN_EXPECT_HELLO){
+      send_invalid(conn, ERROR_NO_HELLO);
+    }
+    else {
+      log_warn("session id %d: received command with invalid type, sending INVALID_COMMAND; closing connection", conn->s_client);
+      send_invalid(conn, ERROR_INVALID_COMMAND);
+    }
+    return -1;
   }
-  else {
-    fprintf(stderr, "session id %d: client closed connection\n", s_client);
+
+  // keep the start of a command split across segments for next time
+
+  conn->in_len -= pos;
+  memmove(conn->in, conn->in + pos, conn->in_len);
+  return 0;
+}
+
+// tear a connection down; queued replies (such as a final INVALID_COMMAND)
+// get one last nonblocking chance to go out
+
+static void conn_close(struct conn_t *conn){
+  leave_station(conn);
+
+  pthread_mutex_lock(&conn->out_lock);
+  if (conn->out_len > 0){
+    (void) conn_write(conn);
   }
+  close(conn->s_client); // also drops it from the worker's epoll set
+  conn->s_client = -1;
+  pthread_mutex_unlock(&conn->out_lock);
 
-  if (cur_station != -1){
+  conn_put(conn);
+  return;
+}
 
-    ret = pthread_mutex_lock(&ses.station[cur_station].lock);
-    if (ret != 0){
-      perror("pthread_mutex_lock()");
+static void *worker_loop(struct worker_t *worker){
+  int i, n, ret;
+  struct conn_t *conn;
+  struct epoll_event events[WORKER_MAX_EVENTS];
+  struct thread_stats_t *stats;
+  struct timespec start, end;
+
+  stats = stats_register_thread("conn", worker - workers);
+  while (1){
+    n = epoll_wait(worker->epfd, events, WORKER_MAX_EVENTS, -1);
+    if (n == -1){
+      if (errno == EINTR){
+        continue;
+      }
+      perror("epoll_wait()");
       exit(-1);
     }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i=0; i<n; i++){
+      conn = events[i].data.ptr;
+      ret = 0;
+      if (events[i].events & EPOLLOUT){
+        pthread_mutex_lock(&conn->out_lock);
+        ret = conn_flush(conn);
+        pthread_mutex_unlock(&conn->out_lock);
+      }
+      if (ret == 0 && events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)){
+        ret = conn_readable(conn);
+      }
+      if (ret == -1){
+        conn_close(conn);
+      }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats_add(&stats->wakeups, 1);
+    stats_add(&stats->items, n);
+    stats_hist_add(&stats->busy, ts_to_ns(&end) - ts_to_ns(&start));
+  }
 
-    ses.station[cur_station].client[cur_slot].flags = 0;
+  return NULL;
+}
 
-    ret = pthread_mutex_unlock(&ses.station[cur_station].lock);
+void create_connection_workers(int n){
+  int i, ret;
+  workers = (struct worker_t *)malloc(n * sizeof(struct worker_t));
+  if (workers == NULL){
+    perror("malloc()");
+    exit(-1);
+  }
+  num_workers = n;
+  for (i=0; i<num_workers; i++){
+    workers[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (workers[i].epfd == -1){
+      perror("epoll_create1()");
+      exit(-1);
+    }
+    workers[i].s_udp = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (workers[i].s_udp == -1){
+      perror("socket()");
+      exit(-1);
+    }
+    ret = pthread_create(&workers[i].thread, NULL,
+                         (void *(*)(void *))worker_loop, &workers[i]);
     if (ret != 0){
-      perror("pthread_mutex_unlock()");
+      perror("pthread_create()");
       exit(-1);
     }
-
+    pthread_detach(workers[i].thread);
   }
+  return;
+}
 
-  close(s_client);
+// hand a freshly accepted, nonblocking socket to the next worker
 
-  return NULL;
+int connection_add(int s_client, uint32_t ip){
+  int ret;
+  struct conn_t *conn;
+  struct epoll_event ev;
+
+  conn = (struct conn_t *)malloc(sizeof(struct conn_t));
+  if (conn == NULL){
+    log_error("malloc(): %m");
+    return -1;
+  }
+  conn->s_client = s_client;
+  conn->ip = ip;
+  conn->udp_port = 0;
+  conn->features = 0;
+  conn->state = CONN_EXPECT_HELLO;
+  conn->cur_station = -1;
+  conn->cur_handle = -1;
+  conn->in_len = 0;
+  conn->refs = 1; // the worker's
+  pthread_mutex_init(&conn->out_lock, NULL);
+  conn->out = NULL;
+  conn->out_len = 0;
+  conn->out_size = 0;
+  conn->want_out = 0;
+  conn->worker = &workers[next_worker];
+
+  log_info("session id %d: new client connected; expecting HELLO", s_client);
+
+  ev.events = EPOLLIN;
+  ev.data.ptr = conn;
+  ret = epoll_ctl(workers[next_worker].epfd, EPOLL_CTL_ADD, s_client, &ev);
+  if (ret == -1){
+    log_error("session id %d: epoll_ctl(): %m", s_client);
+    pthread_mutex_destroy(&conn->out_lock);
+    free(conn);
+    return -1;
+  }
+  next_worker = (next_worker + 1) % num_workers;
+  return 0;
 }
@@ -2,6 +2,7 @@
 #define _CONNECTION_H
 
 #include <arpa/inet.h>
+#include <pthread.h>
 
 #define RECV_SUCCESS 0
 #define RECV_ERROR -1
@@ -10,14 +11,48 @@
 
 #define TYPE_CMD_HELLO 0
 #define TYPE_CMD_SET_STATION 1
+#define TYPE_CMD_HELLO_EXT 2 // HELLO plus the FEATURE_* bits the client has
 
 #define TYPE_REPLY_WELCOME 0
 #define TYPE_REPLY_ANNOUNCE 1
 #define TYPE_REPLY_INVALID_COMMAND 2
+#define TYPE_REPLY_MULTICAST 3 // listen on this group; precedes the ANNOUNCE
+#define TYPE_REPLY_FEATURES 4  // FEATURE_* bits granted; follows the WELCOME
 
-struct connection_info_t {
-  uint32_t ip;
+#define FEATURE_MULTICAST 1 // can join a station's multicast group
+#define FEATURE_FRAMING 2   // wants a frame header on every unicast datagram
+#define FEATURE_FEC 4       // and parity datagrams to repair losses with;
+                            // only granted along with FEATURE_FRAMING
+
+#define CONN_EXPECT_HELLO 0
+#define CONN_EXPECT_SET_STATION 1
+
+#define CONN_INBUF_SIZE 64
+#define CONN_OUTBUF_INITIAL 256
+#define CONN_OUTBUF_MAX (64 * 1024) // backlog at which a client is dropped
+#define WORKER_MAX_EVENTS 64
+
+// per-connection protocol state, owned by one worker thread; the outbound
+// buffer may be filled by any thread holding a reference
+
+struct conn_t {
   int s_client;
+  uint32_t ip;       // host order
+  uint16_t udp_port; // host order
+  int features;      // FEATURE_* bits granted after HELLO_EXT
+  int state;         // CONN_EXPECT_*
+  int cur_station;   // -1 if not subscribed
+  int cur_handle;     // subscription handle in the station's registry
+  int cur_gen;        // the station's generation when we joined it
+  size_t in_len;
+  uint8_t in[CONN_INBUF_SIZE]; // received bytes not yet parsed
+  int refs;                    // the worker's, plus any held by stations
+  struct worker_t *worker;
+  pthread_mutex_t out_lock;    // guards out*, want_out and s_client closing
+  char *out;                   // encoded replies not yet taken by the socket
+  size_t out_len;
+  size_t out_size;
+  int want_out;                // EPOLLOUT armed?
 };
 
 struct cmd_t {
@@ -29,6 +64,10 @@ struct cmd_t {
     struct {
       uint16_t station_no;
     } set_station;
+    struct {
+      uint16_t udp_port;
+      uint16_t features;
+    } hello_ext;
   };
 };
 
@@ -46,11 +85,24 @@ struct reply_t {
       uint8_t reply_string_size;
       char reply_string[1 << sizeof(uint8_t)*8];
     } invalid_command;
+    struct {
+      uint32_t group_ip; // host order
+      uint16_t port;
+    } multicast;
+    struct {
+      uint16_t features;
+    } features;
   };
 };
 
-int recv_command(int, struct cmd_t *);
-int send_reply(int, const struct reply_t *);
-void *connection_loop(struct connection_info_t *);
+int parse_command(const void *, size_t, struct cmd_t *);
+int encode_reply(const struct reply_t *, void *);
+struct conn_t *conn_get(struct conn_t *);
+void conn_put(struct conn_t *);
+int conn_queue(struct conn_t *, const void *, size_t);
+int conn_send_reply(struct conn_t *, const struct reply_t *);
+void conn_kick(struct conn_t *, const char *);
+void create_connection_workers(int);
+int connection_add(int, uint32_t);
 
 #endif
@@ -0,0 +1,264 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fanout.h"
+
+void fanout_init(struct fanout_t *fo){
+  memset(fo, 0, sizeof(*fo));
+  return;
+}
+
+void fanout_destroy(struct fanout_t *fo){
+  free(fo->addr);
+  free(fo->msg);
+  free(fo->status);
+  memset(fo, 0, sizeof(*fo));
+  return;
+}
+
+// reallocate to hold size entries (never fewer than num); on failure every
+// array still holds at least min(size, old size) entries
+
+int fanout_resize(struct fanout_t *fo, int size){
+  int i, ret;
+  void *p;
+
+  ret = -1;
+  p = realloc(fo->msg, size * sizeof(*fo->msg));
+  if (p == NULL){
+    goto out;
+  }
+  fo->msg = p;
+  p = realloc(fo->status, size * sizeof(*fo->status));
+  if (p == NULL){
+    goto out;
+  }
+  fo->status = p;
+  p = realloc(fo->addr, size * sizeof(*fo->addr));
+  if (p == NULL){
+    goto out;
+  }
+  fo->addr = p;
+
+  // addr may have moved, so every msg_name has to be re-pointed
+
+  for (i=0; i<fo->num; i++){
+    fo->msg[i].msg_hdr.msg_name = &fo->addr[i];
+  }
+  ret = 0;
+
+out:
+  if (ret == 0 || size < fo->size){
+    fo->size = size;
+  }
+  return ret;
+}
+
+// make room for size entries up front
+
+int fanout_reserve(struct fanout_t *fo, int size){
+  if (size <= fo->size){
+    return 0;
+  }
+  return fanout_resize(fo, size);
+}
+
+// append a destination, framed or raw; returns its index in the vector,
+// or -1
+
+int fanout_add(struct fanout_t *fo, uint32_t ip, uint16_t udp_port,
+               int framed){
+  int i;
+
+  if (fo->num == fo->size &&
+      fanout_resize(fo, fo->size ? fo->size * 2 : FANOUT_INITIAL_SIZE) == -1){
+    return -1;
+  }
+  i = fo->num++;
+
+  memset(&fo->addr[i], 0, sizeof(fo->addr[i]));
+  fo->addr[i].sin_family = AF_INET;
+  fo->addr[i].sin_addr.s_addr = htonl(ip);
+  fo->addr[i].sin_port = htons(udp_port);
+
+  memset(&fo->msg[i], 0, sizeof(fo->msg[i]));
+  fo->msg[i].msg_hdr.msg_name = &fo->addr[i];
+  fo->msg[i].msg_hdr.msg_namelen = sizeof(fo->addr[i]);
+  if (framed){
+    fo->msg[i].msg_hdr.msg_iov = &fo->iov[FANOUT_IOV_HEADER];
+    fo->msg[i].msg_hdr.msg_iovlen = 2;
+  }
+  else {
+    fo->msg[i].msg_hdr.msg_iov = &fo->iov[FANOUT_IOV_CHUNK];
+    fo->msg[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  fo->status[i] = 0;
+  return i;
+}
+
+// remove entry i by moving the last entry into its place, giving memory
+// back once the vector is mostly empty
+
+void fanout_remove(struct fanout_t *fo, int i){
+  int last;
+
+  last = --fo->num;
+  if (i != last){
+    fo->addr[i] = fo->addr[last];
+    fo->msg[i] = fo->msg[last];
+    fo->msg[i].msg_hdr.msg_name = &fo->addr[i];
+    fo->status[i] = fo->status[last];
+  }
+  if (fo->size > FANOUT_INITIAL_SIZE && fo->num < fo->size / 4){
+    (void) fanout_resize(fo, fo->size / 2); // failing to shrink is harmless
+  }
+  return;
+}
+
+// point slice at num entries of fo starting at off; it shares fo's arrays,
+// so sending it fills in fo's status[], and it must not be resized
+
+void fanout_slice(struct fanout_t *slice, const struct fanout_t *fo, int off,
+                  int num){
+  slice->num = num;
+  slice->size = num;
+  slice->iov[FANOUT_IOV_HEADER] = fo->iov[FANOUT_IOV_HEADER];
+  slice->iov[FANOUT_IOV_CHUNK] = fo->iov[FANOUT_IOV_CHUNK];
+  slice->addr = fo->addr + off;
+  slice->msg = fo->msg + off;
+  slice->status = fo->status + off;
+  return;
+}
+
+// sendmmsg() num messages FANOUT_MAX_BATCH at a time, filling in status[]
+// per message and counting the calls made in *calls, if given; returns the
+// number of failed messages
+
+static int send_vec(int s, struct mmsghdr *msg, int num, int *status,
+                    uint64_t *calls){
+  int ret, i, off, failed, batch;
+
+  failed = 0;
+  off = 0;
+  while (off < num){
+    batch = num - off;
+    if (batch > FANOUT_MAX_BATCH){
+      batch = FANOUT_MAX_BATCH;
+    }
+    ret = sendmmsg(s, msg + off, batch, 0);
+    if (calls != NULL){
+      (*calls)++;
+    }
+    if (ret == -1){
+      if (errno == EINTR){
+        continue;
+      }
+
+      // sendmmsg() only reports an error for the first message of a batch,
+      // so record it against that destination and carry on with the rest
+
+      status[off++] = errno;
+      failed++;
+      continue;
+    }
+    for (i=off; i<off+ret; i++){
+      status[i] = 0;
+    }
+    off += ret;
+  }
+  return failed;
+}
+
+void fanout_batch_init(struct fanout_batch_t *b){
+  memset(b, 0, sizeof(*b));
+  return;
+}
+
+void fanout_batch_destroy(struct fanout_batch_t *b){
+  free(b->msg);
+  free(b->status);
+  memset(b, 0, sizeof(*b));
+  return;
+}
+
+// how many of fo's entries failed after a batch send, which only needs
+// counting if any in the batch did
+
+int fanout_count_failed(const struct fanout_t *fo, int any){
+  int i, failed;
+
+  failed = 0;
+  for (i=0; any && i<fo->num; i++){
+    failed += fo->status[i] != 0;
+  }
+  return failed;
+}
+
+// send each of n fan-outs its own chunk (and header), which the caller has
+// already put in its iovs, through as few sendmmsg() calls as all of them
+// together need; fills in every fan-out's status[], and its number of
+// failed entries in failed_each[] if given, and returns the total
+
+int fanout_send_batch(int s, struct fanout_batch_t *b, struct fanout_t **fo,
+                      int n, int *failed_each){
+  int i, num, failed;
+  void *p;
+
+  if (n == 1){
+    failed = send_vec(s, fo[0]->msg, fo[0]->num, fo[0]->status, &b->calls);
+    if (failed_each != NULL){
+      failed_each[0] = failed;
+    }
+    return failed;
+  }
+
+  num = 0;
+  for (i=0; i<n; i++){
+    num += fo[i]->num;
+  }
+  if (num > b->size){
+    p = realloc(b->msg, num * sizeof(*b->msg));
+    if (p == NULL){
+      goto one_by_one;
+    }
+    b->msg = p;
+    p = realloc(b->status, num * sizeof(*b->status));
+    if (p == NULL){
+      goto one_by_one;
+    }
+    b->status = p;
+    b->size = num;
+  }
+
+  // the headers still point at each fan-out's own addresses and iov, so
+  // gathering them is a flat copy
+
+  b->num = 0;
+  for (i=0; i<n; i++){
+    memcpy(b->msg + b->num, fo[i]->msg, fo[i]->num * sizeof(*b->msg));
+    b->num += fo[i]->num;
+  }
+  failed = send_vec(s, b->msg, b->num, b->status, &b->calls);
+  b->num = 0;
+  for (i=0; i<n; i++){
+    memcpy(fo[i]->status, b->status + b->num,
+           fo[i]->num * sizeof(*b->status));
+    b->num += fo[i]->num;
+    if (failed_each != NULL){
+      failed_each[i] = fanout_count_failed(fo[i], failed > 0);
+    }
+  }
+  return failed;
+
+one_by_one:
+  failed = 0;
+  for (i=0; i<n; i++){
+    num = send_vec(s, fo[i]->msg, fo[i]->num, fo[i]->status, &b->calls);
+    if (failed_each != NULL){
+      failed_each[i] = num;
+    }
+    failed += num;
+  }
+  return failed;
+}
@@ -0,0 +1,50 @@
+#ifndef _FANOUT_H
+#define _FANOUT_H
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#define FANOUT_INITIAL_SIZE 16
+#define FANOUT_MAX_BATCH 1024 // UIO_MAXIOV, the kernel's cap per sendmmsg()
+
+#define FANOUT_IOV_HEADER 0 // frame header, sent only to framed entries
+#define FANOUT_IOV_CHUNK 1  // the chunk itself, sent to every entry
+
+// dense, ready-to-send destination vector for one station; entry i of addr,
+// msg and status all describe the same subscriber. Framed entries send
+// both iovs, raw ones only the chunk.
+
+struct fanout_t {
+  int num;                  // live entries
+  int size;                 // allocated entries
+  struct iovec iov[2];      // header and chunk shared by a tick's messages
+  struct sockaddr_in *addr;
+  struct mmsghdr *msg;
+  int *status;              // 0 or errno of the last send to this entry
+};
+
+// scratch vector for sending several fan-outs with shared sendmmsg() calls
+
+struct fanout_batch_t {
+  int num;
+  int size;
+  struct mmsghdr *msg;
+  int *status;
+  uint64_t calls;  // sendmmsg() calls made so far
+};
+
+void fanout_init(struct fanout_t *);
+void fanout_destroy(struct fanout_t *);
+int fanout_resize(struct fanout_t *, int);
+int fanout_reserve(struct fanout_t *, int);
+int fanout_add(struct fanout_t *, uint32_t, uint16_t, int);
+void fanout_remove(struct fanout_t *, int);
+void fanout_slice(struct fanout_t *, const struct fanout_t *, int, int);
+void fanout_batch_init(struct fanout_batch_t *);
+void fanout_batch_destroy(struct fanout_batch_t *);
+int fanout_send_batch(int, struct fanout_batch_t *, struct fanout_t **, int,
+                      int *);
+int fanout_count_failed(const struct fanout_t *, int);
+
+#endif
@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <string.h>
+#include "fec.h"
+
+// p parity buffers for groups of k datagrams of up to size bytes
+
+int fec_init(struct fec_t *fec, int k, int p, size_t size){
+  memset(fec, 0, sizeof(*fec));
+  fec->parity = (unsigned char *)malloc(p * size);
+  if (fec->parity == NULL){
+    return -1;
+  }
+  fec->k = k;
+  fec->p = p;
+  fec->size = size;
+  return 0;
+}
+
+void fec_destroy(struct fec_t *fec){
+  free(fec->parity);
+  memset(fec, 0, sizeof(*fec));
+  return;
+}
+
+// dst ^= src, a word at a time where it can
+
+static void xor_bytes(unsigned char *dst, const unsigned char *src,
+                      size_t n){
+  size_t i;
+  uint64_t a, b;
+
+  for (i=0; i+sizeof(a)<=n; i+=sizeof(a)){
+    memcpy(&a, dst + i, sizeof(a));
+    memcpy(&b, src + i, sizeof(b));
+    a ^= b;
+    memcpy(dst + i, &a, sizeof(a));
+  }
+  for (; i<n; i++){
+    dst[i] ^= src[i];
+  }
+  return;
+}
+
+// fold in the datagram sent as seq; returns 1 if it completed a group,
+// whose parity fec_parity() then points fan-outs at
+
+int fec_add(struct fec_t *fec, uint64_t seq, const void *data, size_t len){
+  int i, j;
+  unsigned char *buf;
+
+  i = seq % fec->k;
+  j = i % fec->p;
+  buf = fec->parity + j * fec->size;
+  if (i == 0){
+    fec->have = 0;
+  }
+
+  // the first of its share starts the buffer off; the rest are XORed in,
+  // with whatever goes beyond the longest so far XORed onto zeroes
+
+  if (i < fec->p){
+    memcpy(buf, data, len);
+    fec->len[j] = len;
+    fec->len_xor[j] = len;
+  }
+  else {
+    if (len > fec->len[j]){
+      memcpy(buf + fec->len[j], (const unsigned char *)data + fec->len[j],
+             len - fec->len[j]);
+      xor_bytes(buf, data, fec->len[j]);
+      fec->len[j] = len;
+    }
+    else {
+      xor_bytes(buf, data, len);
+    }
+    fec->len_xor[j] ^= len;
+  }
+
+  // a group we didn't see from its start (the station came up mid-way)
+  // gets no parity
+
+  fec->have++;
+  return i == fec->k - 1 && fec->have == fec->k;
+}
+
+// point fo at parity datagram j of the group ending at seq, header and
+// all, for the caller to send as it sends a tick's chunk; the header is
+// rewritten for each j, so one has to be sent before the next is asked for
+
+void fec_parity(struct fec_t *fec, int j, struct fanout_t *fo,
+                uint16_t station, uint64_t seq){
+  frame_encode_parity(fec->frame, station, fec->k, seq - (fec->k - 1) + j,
+                      fec->p, fec->len_xor[j]);
+  fo->iov[FANOUT_IOV_HEADER].iov_base = fec->frame;
+  fo->iov[FANOUT_IOV_HEADER].iov_len = FRAME_HEADER_SIZE;
+  fo->iov[FANOUT_IOV_CHUNK].iov_base = fec->parity + j * fec->size;
+  fo->iov[FANOUT_IOV_CHUNK].iov_len = fec->len[j];
+  return;
+}
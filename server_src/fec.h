@@ -0,0 +1,36 @@
+#ifndef _FEC_H
+#define _FEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "fanout.h"
+#include "frame.h"
+
+#define FEC_MAX_GROUP 64 // data datagrams one parity group can span
+#define FEC_MAX_PARITY 8 // parity datagrams per group
+
+// forward error correction for clients that negotiated FEATURE_FEC: each
+// group of k datagrams, sequence numbers g to g+k-1 for g a multiple of k,
+// is followed by p parity datagrams. Parity j is the XOR of the group's
+// datagrams j, j+p, j+2p, ..., zero-padded to the longest of them, so a
+// client missing at most one of each can rebuild them: any single loss
+// with p = 1, a burst of up to p in a row with more. That costs p/k of
+// extra traffic.
+
+struct fec_t {
+  int k;
+  int p;
+  size_t size;                       // of the largest datagram
+  unsigned char *parity;             // p buffers of size bytes
+  size_t len[FEC_MAX_PARITY];        // of the longest datagram in each
+  uint16_t len_xor[FEC_MAX_PARITY];  // XOR of their lengths
+  int have;                          // datagrams of the group added so far
+  unsigned char frame[FRAME_HEADER_SIZE];
+};
+
+int fec_init(struct fec_t *, int, int, size_t);
+void fec_destroy(struct fec_t *);
+int fec_add(struct fec_t *, uint64_t, const void *, size_t);
+void fec_parity(struct fec_t *, int, struct fanout_t *, uint16_t, uint64_t);
+
+#endif
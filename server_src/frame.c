@@ -0,0 +1,76 @@
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "frame.h"
+
+void frame_encode(void *buf, uint16_t station, uint8_t flags, uint32_t seq,
+                  uint64_t ts_us){
+  unsigned char *p;
+  uint16_t uint16_tmp;
+  uint32_t uint32_tmp;
+
+  p = buf;
+  uint16_tmp = htons(station);
+  memcpy(p, &uint16_tmp, sizeof(uint16_tmp));
+  p[2] = flags;
+  p[3] = 0;
+  uint32_tmp = htonl(seq);
+  memcpy(p + 4, &uint32_tmp, sizeof(uint32_tmp));
+  uint32_tmp = htonl(ts_us >> 32);
+  memcpy(p + 8, &uint32_tmp, sizeof(uint32_tmp));
+  uint32_tmp = htonl(ts_us & 0xffffffff);
+  memcpy(p + 12, &uint32_tmp, sizeof(uint32_tmp));
+  return;
+}
+
+// the header of parity datagram j of the group starting at seq - j, for
+// groups of k datagrams with that many parities each
+
+void frame_encode_parity(void *buf, uint16_t station, uint8_t k, uint32_t seq,
+                         uint8_t parities, uint16_t len_xor){
+  unsigned char *p;
+  uint16_t uint16_tmp;
+  uint32_t uint32_tmp;
+
+  p = buf;
+  uint16_tmp = htons(station);
+  memcpy(p, &uint16_tmp, sizeof(uint16_tmp));
+  p[2] = FRAME_FLAG_PARITY;
+  p[3] = k;
+  uint32_tmp = htonl(seq);
+  memcpy(p + 4, &uint32_tmp, sizeof(uint32_tmp));
+  p[8] = parities;
+  p[9] = 0;
+  uint16_tmp = htons(len_xor);
+  memcpy(p + 10, &uint16_tmp, sizeof(uint16_tmp));
+  memset(p + 12, 0, 4);
+  return;
+}
+
+// the reverse, for tools that listen like a client
+
+void frame_decode(const void *buf, uint16_t *station, uint8_t *flags,
+                  uint32_t *seq, uint64_t *ts_us){
+  const unsigned char *p;
+  uint16_t uint16_tmp;
+  uint32_t hi, lo;
+
+  p = buf;
+  memcpy(&uint16_tmp, p, sizeof(uint16_tmp));
+  *station = ntohs(uint16_tmp);
+  *flags = p[2];
+  memcpy(seq, p + 4, sizeof(*seq));
+  *seq = ntohl(*seq);
+  memcpy(&hi, p + 8, sizeof(hi));
+  memcpy(&lo, p + 12, sizeof(lo));
+  *ts_us = ((uint64_t)ntohl(hi) << 32) | ntohl(lo);
+  return;
+}
+
+// wall clock, so a client with a synchronized clock can take one-way delay
+
+uint64_t frame_now_us(void){
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
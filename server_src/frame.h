@@ -0,0 +1,26 @@
+#ifndef _FRAME_H
+#define _FRAME_H
+
+#include <stdint.h>
+
+// header in front of every datagram to a client that negotiated
+// FEATURE_FRAMING, all fields in network order:
+//   u16 station, u8 flags, u8 reserved, u32 seq, u64 send time (us since
+//   the epoch). seq counts the station's ticks, so a chunk sent from
+//   history carries the same number it had live.
+// A parity datagram (see fec.h) has FRAME_FLAG_PARITY set, k in the
+// reserved byte and, for seq, the sequence number of the first datagram it
+// covers; in place of the send time it carries u8 p, u8 zero, u16 the XOR
+// of the covered datagrams' lengths and u32 zero.
+
+#define FRAME_HEADER_SIZE 16
+#define FRAME_FLAG_BURST 1  // resent from history to a joining client
+#define FRAME_FLAG_PARITY 2 // FEC parity, not stream data
+
+void frame_encode(void *, uint16_t, uint8_t, uint32_t, uint64_t);
+void frame_encode_parity(void *, uint16_t, uint8_t, uint32_t, uint8_t,
+                         uint16_t);
+void frame_decode(const void *, uint16_t *, uint8_t *, uint32_t *, uint64_t *);
+uint64_t frame_now_us(void);
+
+#endif
@@ -0,0 +1,201 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "history.h"
+#include "frame.h"
+
+int history_init(struct history_t *h, int size, int64_t span_ns){
+  int i;
+
+  h->entry = (struct history_entry_t *)malloc(size * sizeof(*h->entry));
+  if (h->entry == NULL){
+    return -1;
+  }
+  for (i=0; i<size; i++){
+    h->entry[i].tick = HISTORY_EMPTY;
+  }
+  h->size = size;
+  h->head = 0;
+  h->span_ns = span_ns;
+  return 0;
+}
+
+void history_destroy(struct history_t *h){
+  free(h->entry);
+  h->entry = NULL;
+  h->size = 0;
+  h->head = 0;
+  return;
+}
+
+// forget every entry, as when the song data they point into is let go;
+// tick numbers carry on from the same head. Only the station's tick calls
+// it, like history_push().
+
+void history_reset(struct history_t *h){
+  int i;
+
+  for (i=0; i<h->size; i++){
+    __atomic_store_n(&h->entry[i].tick, HISTORY_EMPTY, __ATOMIC_RELEASE);
+  }
+  return;
+}
+
+// forget the entries of ticks before tick, as when the song data they
+// point into is let go before the ring has moved past it; only the
+// station's tick calls it
+
+void history_forget(struct history_t *h, uint64_t tick){
+  uint64_t t;
+  struct history_entry_t *e;
+
+  t = h->head > (uint64_t)h->size ? h->head - h->size : 0;
+  for (; t<tick; t++){
+    e = &h->entry[t % h->size];
+    if (e->tick == t){
+      __atomic_store_n(&e->tick, HISTORY_EMPTY, __ATOMIC_RELEASE);
+    }
+  }
+  return;
+}
+
+// record the datagram just sent; the entry is invalidated while it is
+// rewritten, then published with its new tick number
+
+void history_push(struct history_t *h, const char *data, size_t len,
+                  int64_t media_ns){
+  struct history_entry_t *e;
+
+  e = &h->entry[h->head % h->size];
+  __atomic_store_n(&e->tick, HISTORY_EMPTY, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  e->data = data;
+  e->len = len;
+  e->media_ns = media_ns;
+  __atomic_store_n(&e->tick, h->head, __ATOMIC_RELEASE);
+  __atomic_store_n(&h->head, h->head + 1, __ATOMIC_RELEASE);
+  return;
+}
+
+uint64_t history_head(const struct history_t *h){
+  return __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+}
+
+// copy entry tick into *e; fails if it is gone or being rewritten
+
+static int read_entry(const struct history_t *h, uint64_t tick,
+                      struct history_entry_t *e){
+  const struct history_entry_t *p;
+
+  p = &h->entry[tick % h->size];
+  if (__atomic_load_n(&p->tick, __ATOMIC_ACQUIRE) != tick){
+    return -1;
+  }
+  e->data = p->data;
+  e->len = p->len;
+  e->media_ns = p->media_ns;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&p->tick, __ATOMIC_RELAXED) != tick){
+    return -1;
+  }
+  e->tick = tick;
+  return 0;
+}
+
+// oldest tick still within span_ns of the newest; the head if the ring is
+// empty. One slot is left alone, as the next push may be rewriting it.
+
+uint64_t history_start(const struct history_t *h){
+  uint64_t head, start;
+  int64_t newest_ns;
+  struct history_entry_t e;
+
+  head = history_head(h);
+  if (head == 0 || read_entry(h, head - 1, &e) == -1){
+    return head;
+  }
+  newest_ns = e.media_ns;
+  start = head - 1;
+  while (start > 0 && head - start < (uint64_t)h->size - 1 &&
+         read_entry(h, start - 1, &e) == 0 &&
+         newest_ns - e.media_ns < h->span_ns){
+    start--;
+  }
+  return start;
+}
+
+// copy the datagrams from tick *cursor on into b, at most max of them and
+// none the station hasn't sent yet. Moves *cursor past them, skipping
+// ahead if it fell out of the ring; returns how many. Called under the
+// station's lock; history_send() sends them once it is let go, the song
+// data they point into being kept until the ring has moved well past.
+
+int history_read(const struct history_t *h, uint64_t *cursor, int max,
+                 struct history_burst_t *b){
+  uint64_t head;
+
+  if (max > HISTORY_MAX_BURST){
+    max = HISTORY_MAX_BURST;
+  }
+  head = history_head(h);
+  b->num = 0;
+  while (b->num < max && *cursor < head){
+    if (read_entry(h, *cursor, &b->entry[b->num]) == -1){
+      *cursor = history_start(h);
+      if (read_entry(h, *cursor, &b->entry[b->num]) == -1){
+        break;
+      }
+    }
+    b->num++;
+    (*cursor)++;
+  }
+  return b->num;
+}
+
+// send what history_read() copied out to ip:udp_port through socket s,
+// framed as station_no's if framed; returns the number sent, or -1
+
+int history_send(const struct history_burst_t *b, int s,
+                 uint32_t ip, uint16_t udp_port, int framed,
+                 uint16_t station_no){
+  int i, ret;
+  uint64_t now_us;
+  struct sockaddr_in addr;
+  unsigned char header[HISTORY_MAX_BURST][FRAME_HEADER_SIZE];
+  struct iovec iov[HISTORY_MAX_BURST][2];
+  struct mmsghdr msg[HISTORY_MAX_BURST];
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(ip);
+  addr.sin_port = htons(udp_port);
+
+  now_us = framed ? frame_now_us() : 0;
+  for (i=0; i<b->num; i++){
+    frame_encode(header[i], station_no, FRAME_FLAG_BURST, b->entry[i].tick,
+                 now_us);
+    iov[i][0].iov_base = header[i];
+    iov[i][0].iov_len = FRAME_HEADER_SIZE;
+    iov[i][1].iov_base = (void *)b->entry[i].data;
+    iov[i][1].iov_len = b->entry[i].len;
+    memset(&msg[i], 0, sizeof(msg[i]));
+    msg[i].msg_hdr.msg_name = &addr;
+    msg[i].msg_hdr.msg_namelen = sizeof(addr);
+    msg[i].msg_hdr.msg_iov = framed ? &iov[i][0] : &iov[i][1];
+    msg[i].msg_hdr.msg_iovlen = framed ? 2 : 1;
+  }
+
+  for (i=0; i<b->num; i+=ret){
+    ret = sendmmsg(s, msg + i, b->num - i, 0);
+    if (ret == -1){
+      if (errno == EINTR){
+        ret = 0;
+        continue;
+      }
+      return -1;
+    }
+  }
+  return b->num;
+}
@@ -0,0 +1,55 @@
+#ifndef _HISTORY_H
+#define _HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#define DEFAULT_HISTORY_MS 2000 // how much of each station a join can catch up on
+#define DEFAULT_BURST_CHUNKS 4  // history datagrams a joining client gets per tick
+#define HISTORY_MAX_BURST 64
+
+// one datagram a station sent; the bytes themselves stay in the song store,
+// which the station keeps them in until the ring has moved past them
+
+struct history_entry_t {
+  uint64_t tick;    // number of the tick that sent it, or HISTORY_EMPTY
+  const char *data; // in the song it came from
+  size_t len;
+  int64_t media_ns; // stream time it starts at
+};
+
+#define HISTORY_EMPTY UINT64_MAX
+
+// datagrams copied out of the ring for one client, so they can be sent
+// after the station's lock is let go
+
+struct history_burst_t {
+  int num;
+  struct history_entry_t entry[HISTORY_MAX_BURST];
+};
+
+// ring of the datagrams a station sent in the last span_ns of stream time.
+// Only the station's tick writes it; readers check each entry's tick
+// number, so an entry overwritten under them is noticed, not sent.
+
+struct history_t {
+  int size;
+  struct history_entry_t *entry;
+  uint64_t head;    // number of the next tick
+  int64_t span_ns;
+};
+
+int history_init(struct history_t *, int, int64_t);
+void history_destroy(struct history_t *);
+void history_reset(struct history_t *);
+void history_forget(struct history_t *, uint64_t);
+void history_push(struct history_t *, const char *, size_t, int64_t);
+uint64_t history_head(const struct history_t *);
+uint64_t history_start(const struct history_t *);
+int history_read(const struct history_t *, uint64_t *, int,
+                 struct history_burst_t *);
+int history_send(const struct history_burst_t *, int,
+                 uint32_t, uint16_t, int, uint16_t);
+
+#endif
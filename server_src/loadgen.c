@@ -0,0 +1,816 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include "connection.h"
+#include "frame.h"
+
+// load generator: opens many simulated listeners against a running server
+// over loopback, each with its own TCP session and UDP sink port, tunes
+// them to stations and zaps them around on a schedule. Reports aggregate
+// throughput, drops (from frame sequence numbers), per-client jitter,
+// inter-arrival times, join latency and the server's CPU use.
+
+#define LG_REPLY_BUFSIZE 512   // longest reply is 257 bytes
+#define LG_RECV_BATCH 32
+#define LG_DGRAM 2048
+#define LG_MAX_EVENTS 256
+#define LG_TICK_MS 10          // how often zaps are looked for
+#define LG_GAP_BUCKET_US 50    // inter-arrival histogram resolution
+#define LG_GAP_BUCKETS 40000   // so up to 2 s
+#define LG_JITTER_MIN_DATAGRAMS 16
+
+#define SESSION_CLOSED -1
+
+struct session_t {
+  int s_tcp;
+  int s_udp;
+  int station;            // tuned to, -1 before WELCOME
+  size_t in_len;
+  uint8_t in[LG_REPLY_BUFSIZE];
+  int64_t zap_ns;         // when to switch stations next
+  int64_t set_ns;         // when SET_STATION went out; 0 once data came
+
+  int seq_valid;
+  uint32_t next_seq;
+  int64_t last_arrival_ns;
+  uint64_t last_send_us;
+  int64_t last_gap_ns;
+  double jitter_ns;       // RFC 3550 interarrival jitter estimate
+  uint64_t jitter_samples;
+};
+
+// everything below is written by one worker; the main thread only reads
+// the counters, for progress lines
+
+struct lg_worker_t {
+  pthread_t thread;
+  int epfd;
+  struct session_t *session;
+  int num;
+
+  uint64_t bytes;
+  uint64_t datagrams;
+  uint64_t lost;
+  uint64_t reordered;
+  uint64_t stale;        // from the station before a zap
+  uint64_t zaps;
+  uint64_t welcomed;     // sessions that got their WELCOME
+  uint64_t joins;        // station changes that have seen data
+  uint64_t closed;       // sessions the server dropped
+  uint64_t *gaps;        // inter-arrival histogram, LG_GAP_BUCKETS long
+  double *join_ms;
+  int num_join;
+  int size_join;
+};
+
+static struct lg_worker_t *workers;
+static int num_workers;
+static volatile int running = 1;
+static int num_stations;       // from the first WELCOME
+static int fixed_station = -1; // -S: every session on this station
+static int zap_ms;
+static int framed = 1;
+
+static int64_t now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static double self_cpu_ms(void){
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1e3 +
+         (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e3;
+}
+
+static int64_t realtime_ns(const struct timespec *ts){
+  return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+// server CPU time in clock ticks from /proc/<pid>/stat, or -1
+
+static long long proc_cpu_ticks(int pid, long long *user, long long *sys){
+  char path[64], buf[1024], *p;
+  FILE *f;
+  unsigned long long utime, stime;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  f = fopen(path, "r");
+  if (f == NULL){
+    return -1;
+  }
+  p = fgets(buf, sizeof(buf), f);
+  fclose(f);
+
+  // the command name may hold spaces, so count fields from its ')'
+
+  if (p == NULL || (p = strrchr(buf, ')')) == NULL ||
+      sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+             &utime, &stime) != 2){
+    return -1;
+  }
+  *user = utime;
+  *sys = stime;
+  return utime + stime;
+}
+
+static int pick_station(int current){
+  int station;
+
+  if (fixed_station != -1){
+    return fixed_station;
+  }
+  if (num_stations < 2){
+    return 0;
+  }
+  do {
+    station = rand() % num_stations;
+  } while (station == current);
+  return station;
+}
+
+static void session_close(struct lg_worker_t *w, struct session_t *s){
+  close(s->s_tcp);
+  close(s->s_udp);
+  s->s_tcp = SESSION_CLOSED;
+  s->station = -1;
+  w->closed++;
+  return;
+}
+
+static void tune(struct lg_worker_t *w, struct session_t *s, int station,
+                 int64_t now){
+  uint8_t msg[3];
+  uint16_t station_n;
+
+  msg[0] = TYPE_CMD_SET_STATION;
+  station_n = htons(station);
+  memcpy(&msg[1], &station_n, sizeof(station_n));
+  if (send(s->s_tcp, msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg)){
+    session_close(w, s);
+    return;
+  }
+  s->station = station;
+  s->set_ns = now;
+  s->seq_valid = 0;
+  s->last_arrival_ns = 0;
+  s->last_gap_ns = 0;
+
+  // spread zaps over 0.5 to 1.5 times the interval so sessions don't move
+  // in lockstep
+
+  if (zap_ms > 0){
+    s->zap_ns = now + (int64_t)zap_ms * 1000000 / 2 +
+                (int64_t)(rand() % (zap_ms + 1)) * 1000000;
+  }
+  return;
+}
+
+// length of the complete reply at the start of buf, 0 if more is to come,
+// -1 if it isn't a reply
+
+static int reply_length(const uint8_t *buf, size_t len){
+  if (len < 1){
+    return 0;
+  }
+  switch (buf[0]){
+    case TYPE_REPLY_WELCOME:
+    case TYPE_REPLY_FEATURES:
+      return len < 3 ? 0 : 3;
+    case TYPE_REPLY_MULTICAST:
+      return len < 7 ? 0 : 7;
+    case TYPE_REPLY_ANNOUNCE:
+    case TYPE_REPLY_INVALID_COMMAND:
+      if (len < 2){
+        return 0;
+      }
+      return len < 2 + (size_t)buf[1] ? 0 : 2 + buf[1];
+  }
+  return -1;
+}
+
+static void tcp_readable(struct lg_worker_t *w, struct session_t *s){
+  int ret, len;
+  size_t pos;
+  uint16_t uint16_tmp;
+
+  ret = recv(s->s_tcp, s->in + s->in_len, sizeof(s->in) - s->in_len,
+             MSG_DONTWAIT);
+  if (ret == -1 && (errno == EAGAIN || errno == EINTR)){
+    return;
+  }
+  if (ret <= 0){
+    session_close(w, s);
+    return;
+  }
+  s->in_len += ret;
+
+  pos = 0;
+  while ((len = reply_length(s->in + pos, s->in_len - pos)) > 0){
+    switch (s->in[pos]){
+      case TYPE_REPLY_WELCOME:
+        memcpy(&uint16_tmp, s->in + pos + 1, sizeof(uint16_tmp));
+        __atomic_store_n(&num_stations, ntohs(uint16_tmp), __ATOMIC_RELAXED);
+        w->welcomed++;
+        tune(w, s, pick_station(-1), now_ns());
+        break;
+      case TYPE_REPLY_INVALID_COMMAND:
+        fprintf(stderr, "INVALID_COMMAND: %.*s\n", s->in[pos + 1],
+                s->in + pos + 2);
+        session_close(w, s);
+        return;
+    }
+    if (s->s_tcp == SESSION_CLOSED){
+      return;
+    }
+    pos += len;
+  }
+  if (len == -1){
+    fprintf(stderr, "unknown reply type %d\n", s->in[pos]);
+    session_close(w, s);
+    return;
+  }
+  s->in_len -= pos;
+  memmove(s->in, s->in + pos, s->in_len);
+  return;
+}
+
+// account for one datagram received at arrival (CLOCK_REALTIME ns, from
+// the kernel's receive timestamp)
+
+static void datagram(struct lg_worker_t *w, struct session_t *s,
+                     const uint8_t *buf, int len, int64_t arrival){
+  uint16_t station;
+  uint8_t flags;
+  uint32_t seq;
+  uint64_t send_us;
+  int32_t ahead;
+  int64_t gap, d;
+  void *p;
+
+  w->bytes += len;
+  w->datagrams++;
+  flags = 0;
+  send_us = 0;
+  if (framed){
+    if (len < FRAME_HEADER_SIZE){
+      return;
+    }
+    frame_decode(buf, &station, &flags, &seq, &send_us);
+    if (station != s->station){
+      w->stale++;
+      return;
+    }
+
+    // forward jumps are losses; a datagram behind the sequence turns one
+    // of them into a reordering
+
+    if (!s->seq_valid){
+      s->seq_valid = 1;
+      s->next_seq = seq + 1;
+    }
+    else {
+      ahead = (int32_t)(seq - s->next_seq);
+      if (ahead >= 0){
+        w->lost += ahead;
+        s->next_seq = seq + 1;
+      }
+      else {
+        w->reordered++;
+        if (w->lost > 0){
+          w->lost--;
+        }
+      }
+    }
+  }
+
+  if (s->set_ns != 0){
+    if (w->num_join == w->size_join){
+      p = realloc(w->join_ms, (w->size_join * 2 + 64) * sizeof(double));
+      if (p == NULL){
+        perror("realloc()");
+        exit(-1);
+      }
+      w->join_ms = p;
+      w->size_join = w->size_join * 2 + 64;
+    }
+    w->join_ms[w->num_join++] = (now_ns() - s->set_ns) / 1e6;
+    w->joins++;
+    s->set_ns = 0;
+  }
+
+  // history bursts arrive back to back by design, so they only set the
+  // baseline for the live datagrams that follow
+
+  if (s->last_arrival_ns != 0 && !(flags & FRAME_FLAG_BURST)){
+    gap = arrival - s->last_arrival_ns;
+    if (gap >= 0){
+      w->gaps[gap / 1000 / LG_GAP_BUCKET_US < LG_GAP_BUCKETS ?
+              gap / 1000 / LG_GAP_BUCKET_US : LG_GAP_BUCKETS - 1]++;
+    }
+
+    // transit time difference when the sender's timestamps are there,
+    // otherwise the change in spacing
+
+    d = framed ? gap - (int64_t)(send_us - s->last_send_us) * 1000
+               : gap - s->last_gap_ns;
+    if (d < 0){
+      d = -d;
+    }
+    s->jitter_ns += (d - s->jitter_ns) / 16;
+    s->jitter_samples++;
+    s->last_gap_ns = gap;
+  }
+  s->last_arrival_ns = arrival;
+  s->last_send_us = send_us;
+  return;
+}
+
+static void udp_readable(struct lg_worker_t *w, struct session_t *s){
+  int i, n;
+  int64_t arrival;
+  struct timespec ts;
+  struct cmsghdr *cmsg;
+  static __thread uint8_t buf[LG_RECV_BATCH][LG_DGRAM];
+  static __thread char control[LG_RECV_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+  struct mmsghdr msg[LG_RECV_BATCH];
+  struct iovec iov[LG_RECV_BATCH];
+
+  memset(msg, 0, sizeof(msg));
+  for (i=0; i<LG_RECV_BATCH; i++){
+    iov[i].iov_base = buf[i];
+    iov[i].iov_len = LG_DGRAM;
+    msg[i].msg_hdr.msg_iov = &iov[i];
+    msg[i].msg_hdr.msg_iovlen = 1;
+    msg[i].msg_hdr.msg_control = control[i];
+    msg[i].msg_hdr.msg_controllen = sizeof(control[i]);
+  }
+  do {
+    n = recvmmsg(s->s_udp, msg, LG_RECV_BATCH, MSG_DONTWAIT, NULL);
+    if (n == -1){
+      return;
+    }
+    for (i=0; i<n; i++){
+      clock_gettime(CLOCK_REALTIME, &ts);
+      arrival = realtime_ns(&ts);
+      for (cmsg = CMSG_FIRSTHDR(&msg[i].msg_hdr); cmsg != NULL;
+           cmsg = CMSG_NXTHDR(&msg[i].msg_hdr, cmsg)){
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_TIMESTAMPNS){
+          memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+          arrival = realtime_ns(&ts);
+        }
+      }
+      datagram(w, s, buf[i], msg[i].msg_len, arrival);
+      msg[i].msg_hdr.msg_controllen = sizeof(control[i]);
+    }
+  } while (n == LG_RECV_BATCH);
+  return;
+}
+
+static void *worker_loop(struct lg_worker_t *w){
+  int i, n, idx;
+  int64_t now, next_scan;
+  struct session_t *s;
+  struct epoll_event events[LG_MAX_EVENTS];
+
+  next_scan = 0;
+  while (running){
+    n = epoll_wait(w->epfd, events, LG_MAX_EVENTS, LG_TICK_MS);
+    if (n == -1 && errno != EINTR){
+      perror("epoll_wait()");
+      exit(-1);
+    }
+
+    // the low bit of each event tells the session's UDP sink from its
+    // TCP connection
+
+    for (i=0; i<n; i++){
+      idx = events[i].data.u64 >> 1;
+      s = &w->session[idx];
+      if (s->s_tcp == SESSION_CLOSED){
+        continue;
+      }
+      if (events[i].data.u64 & 1){
+        udp_readable(w, s);
+      }
+      else {
+        tcp_readable(w, s);
+      }
+    }
+
+    now = now_ns();
+    if (zap_ms > 0 && now >= next_scan){
+      for (i=0; i<w->num; i++){
+        s = &w->session[i];
+        if (s->station != -1 && s->zap_ns <= now){
+          w->zaps++;
+          tune(w, s, pick_station(s->station), now);
+        }
+      }
+      next_scan = now + LG_TICK_MS * 1000000LL;
+    }
+  }
+  return NULL;
+}
+
+// connect one session and say HELLO; returns -1 if it couldn't
+
+static int session_open(struct lg_worker_t *w, int idx,
+                        const struct sockaddr_in *server){
+  int one, ret;
+  uint8_t msg[5];
+  uint16_t uint16_tmp;
+  struct sockaddr_in addr;
+  socklen_t addr_len;
+  struct epoll_event ev;
+  struct session_t *s;
+
+  s = &w->session[idx];
+  s->s_udp = socket(AF_INET, SOCK_DGRAM, 0);
+  if (s->s_udp == -1){
+    perror("socket()");
+    return -1;
+  }
+  one = 1;
+  setsockopt(s->s_udp, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr = server->sin_addr;
+  addr_len = sizeof(addr);
+  if (bind(s->s_udp, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      getsockname(s->s_udp, (struct sockaddr *)&addr, &addr_len) == -1){
+    perror("bind()");
+    close(s->s_udp);
+    return -1;
+  }
+
+  s->s_tcp = socket(AF_INET, SOCK_STREAM, 0);
+  if (s->s_tcp == -1){
+    perror("socket()");
+    close(s->s_udp);
+    return -1;
+  }
+  ret = connect(s->s_tcp, (const struct sockaddr *)server, sizeof(*server));
+  if (ret == -1){
+    perror("connect()");
+    close(s->s_tcp);
+    close(s->s_udp);
+    s->s_tcp = SESSION_CLOSED;
+    return -1;
+  }
+  setsockopt(s->s_tcp, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  if (framed){
+    msg[0] = TYPE_CMD_HELLO_EXT;
+    uint16_tmp = addr.sin_port; // already network order
+    memcpy(&msg[1], &uint16_tmp, sizeof(uint16_tmp));
+    uint16_tmp = htons(FEATURE_FRAMING);
+    memcpy(&msg[3], &uint16_tmp, sizeof(uint16_tmp));
+    ret = send(s->s_tcp, msg, 5, MSG_NOSIGNAL);
+  }
+  else {
+    msg[0] = TYPE_CMD_HELLO;
+    memcpy(&msg[1], &addr.sin_port, sizeof(addr.sin_port));
+    ret = send(s->s_tcp, msg, 3, MSG_NOSIGNAL);
+  }
+  if (ret == -1){
+    perror("send()");
+    close(s->s_tcp);
+    close(s->s_udp);
+    s->s_tcp = SESSION_CLOSED;
+    return -1;
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.u64 = (uint64_t)idx << 1;
+  epoll_ctl(w->epfd, EPOLL_CTL_ADD, s->s_tcp, &ev);
+  ev.data.u64 = ((uint64_t)idx << 1) | 1;
+  epoll_ctl(w->epfd, EPOLL_CTL_ADD, s->s_udp, &ev);
+  return 0;
+}
+
+static int cmp_double(const void *a, const void *b){
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static void print_percentiles(const char *what, double *v, int n){
+  if (n == 0){
+    printf("%-22s no samples\n", what);
+    return;
+  }
+  qsort(v, n, sizeof(double), cmp_double);
+  printf("%-22s p50 %.2f  p90 %.2f  p99 %.2f  max %.2f  (n=%d)\n", what,
+         v[n / 2], v[n * 9 / 10], v[n * 99 / 100], v[n - 1], n);
+  return;
+}
+
+static double gap_percentile(const uint64_t *gaps, uint64_t total, double q){
+  int i;
+  uint64_t seen;
+
+  seen = 0;
+  for (i=0; i<LG_GAP_BUCKETS; i++){
+    seen += gaps[i];
+    if (seen > total * q){
+      break;
+    }
+  }
+  return (i + 1) * LG_GAP_BUCKET_US / 1000.0;
+}
+
+struct totals_t {
+  uint64_t bytes, datagrams, lost, reordered, stale, zaps, welcomed, joins,
+           closed;
+};
+
+static void sum_workers(struct totals_t *t){
+  int i;
+
+  memset(t, 0, sizeof(*t));
+  for (i=0; i<num_workers; i++){
+    t->bytes += __atomic_load_n(&workers[i].bytes, __ATOMIC_RELAXED);
+    t->datagrams += __atomic_load_n(&workers[i].datagrams, __ATOMIC_RELAXED);
+    t->lost += __atomic_load_n(&workers[i].lost, __ATOMIC_RELAXED);
+    t->reordered += __atomic_load_n(&workers[i].reordered, __ATOMIC_RELAXED);
+    t->stale += __atomic_load_n(&workers[i].stale, __ATOMIC_RELAXED);
+    t->zaps += __atomic_load_n(&workers[i].zaps, __ATOMIC_RELAXED);
+    t->welcomed += __atomic_load_n(&workers[i].welcomed, __ATOMIC_RELAXED);
+    t->joins += __atomic_load_n(&workers[i].joins, __ATOMIC_RELAXED);
+    t->closed += __atomic_load_n(&workers[i].closed, __ATOMIC_RELAXED);
+  }
+  return;
+}
+
+static void usage(char *argv0){
+  fprintf(stderr, "usage: %s [-h server_ip] [-p port] [-n sessions] [-T threads] [-t seconds]\n"
+          "          [-r sessions_per_second] [-z zap_ms] [-S station] [-P server_pid] [-u]\n"
+          "  -h  server address (127.0.0.1); sinks bind to the same address\n"
+          "  -p  server TCP port (12345)\n"
+          "  -n  simulated clients (1000)\n"
+          "  -T  receiving threads (2)\n"
+          "  -t  seconds to run once every client is connected (10)\n"
+          "  -r  connect this many clients per second (0: as fast as possible)\n"
+          "  -z  mean milliseconds between station changes per client (0: never)\n"
+          "  -S  put every client on this station instead of random ones\n"
+          "  -P  server pid, to report its CPU use from /proc\n"
+          "  -u  don't ask for framing; drops and sender-side jitter go unmeasured\n",
+          argv0);
+  return;
+}
+
+int main(int argc, char **argv){
+  int i, opt, num_sessions, rate, pid, ok, n, num_jitter;
+  double secs, elapsed, mb;
+  int64_t start, next_progress, end;
+  long long cpu_start, cpu_end, user_start, sys_start, user_end, sys_end;
+  uint64_t total_gaps;
+  uint64_t *gaps;
+  double *join, *jitter;
+  struct totals_t t, last;
+  struct sockaddr_in server;
+  struct rlimit rl;
+  struct session_t *s;
+
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  server.sin_port = htons(12345);
+  num_sessions = 1000;
+  num_workers = 2;
+  secs = 10;
+  rate = 0;
+  pid = 0;
+  while ((opt = getopt(argc, argv, "h:p:n:T:t:r:z:S:P:u")) != -1){
+    switch (opt){
+      case 'h':
+        if (inet_pton(AF_INET, optarg, &server.sin_addr) != 1){
+          usage(argv[0]);
+          return -1;
+        }
+        break;
+      case 'p':
+        server.sin_port = htons(atoi(optarg));
+        break;
+      case 'n':
+        num_sessions = atoi(optarg);
+        break;
+      case 'T':
+        num_workers = atoi(optarg);
+        break;
+      case 't':
+        secs = atof(optarg);
+        break;
+      case 'r':
+        rate = atoi(optarg);
+        break;
+      case 'z':
+        zap_ms = atoi(optarg);
+        break;
+      case 'S':
+        fixed_station = atoi(optarg);
+        break;
+      case 'P':
+        pid = atoi(optarg);
+        break;
+      case 'u':
+        framed = 0;
+        break;
+      default:
+        usage(argv[0]);
+        return -1;
+    }
+  }
+  if (num_sessions <= 0 || num_workers <= 0 || secs <= 0 || rate < 0 ||
+      zap_ms < 0){
+    usage(argv[0]);
+    return -1;
+  }
+  srand(getpid());
+
+  // two descriptors per client, so lift the soft limit as far as allowed
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0){
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < (rlim_t)num_sessions * 2 + 64){
+      fprintf(stderr, "warning: descriptor limit %llu is too low for %d clients\n",
+              (unsigned long long)rl.rlim_cur, num_sessions);
+    }
+  }
+
+  // clients are dealt to the workers round robin
+
+  workers = (struct lg_worker_t *)calloc(num_workers, sizeof(struct lg_worker_t));
+  if (workers == NULL){
+    perror("calloc()");
+    return -1;
+  }
+  for (i=0; i<num_workers; i++){
+    workers[i].num = num_sessions / num_workers +
+                     (i < num_sessions % num_workers);
+    workers[i].session = (struct session_t *)calloc(workers[i].num + 1,
+                                                    sizeof(struct session_t));
+    workers[i].gaps = (uint64_t *)calloc(LG_GAP_BUCKETS, sizeof(uint64_t));
+    workers[i].epfd = epoll_create1(0);
+    if (workers[i].session == NULL || workers[i].gaps == NULL ||
+        workers[i].epfd == -1){
+      perror("worker");
+      return -1;
+    }
+    for (n=0; n<workers[i].num; n++){
+      workers[i].session[n].s_tcp = SESSION_CLOSED;
+      workers[i].session[n].station = -1;
+    }
+    pthread_create(&workers[i].thread, NULL,
+                   (void *(*)(void *))worker_loop, &workers[i]);
+  }
+
+  cpu_start = pid ? proc_cpu_ticks(pid, &user_start, &sys_start) : -1;
+  if (pid && cpu_start == -1){
+    fprintf(stderr, "can't read /proc/%d/stat; server CPU won't be reported\n", pid);
+  }
+  start = now_ns();
+
+  // connect everyone, at the -r rate if given
+
+  ok = 0;
+  for (i=0; i<num_sessions; i++){
+    if (session_open(&workers[i % num_workers], i / num_workers, &server) == 0){
+      ok++;
+    }
+    if (rate > 0){
+      end = start + (int64_t)(i + 1) * 1000000000LL / rate;
+      while (now_ns() < end){
+        usleep(1000);
+      }
+    }
+  }
+  fprintf(stderr, "%d of %d clients connected in %.2f s\n", ok, num_sessions,
+          (now_ns() - start) / 1e9);
+
+  // run, with a progress line every second
+
+  end = now_ns() + secs * 1e9;
+  next_progress = now_ns() + 1000000000LL;
+  memset(&last, 0, sizeof(last));
+  while (now_ns() < end){
+    usleep(10000);
+    if (now_ns() >= next_progress){
+      sum_workers(&t);
+      fprintf(stderr, "%6.1f s: %.2f MB/s, %llu datagrams/s, %llu lost, %llu zaps, %llu welcomed, %llu playing, %llu closed\n",
+              (now_ns() - start) / 1e9, (t.bytes - last.bytes) / 1e6,
+              (unsigned long long)(t.datagrams - last.datagrams),
+              (unsigned long long)(t.lost - last.lost),
+              (unsigned long long)(t.zaps - last.zaps),
+              (unsigned long long)t.welcomed,
+              (unsigned long long)(t.joins - t.zaps),
+              (unsigned long long)t.closed);
+      last = t;
+      next_progress += 1000000000LL;
+    }
+  }
+  running = 0;
+  for (i=0; i<num_workers; i++){
+    pthread_join(workers[i].thread, NULL);
+  }
+  elapsed = (now_ns() - start) / 1e9;
+  cpu_end = cpu_start != -1 ? proc_cpu_ticks(pid, &user_end, &sys_end) : -1;
+
+  // gather the per-worker samples
+
+  sum_workers(&t);
+  gaps = (uint64_t *)calloc(LG_GAP_BUCKETS, sizeof(uint64_t));
+  jitter = (double *)malloc((num_sessions + 1) * sizeof(double));
+  n = 0;
+  for (i=0; i<num_workers; i++){
+    n += workers[i].num_join;
+  }
+  join = (double *)malloc((n + 1) * sizeof(double));
+  if (gaps == NULL || jitter == NULL || join == NULL){
+    perror("malloc()");
+    return -1;
+  }
+  n = 0;
+  num_jitter = 0;
+  total_gaps = 0;
+  for (i=0; i<num_workers; i++){
+    memcpy(join + n, workers[i].join_ms, workers[i].num_join * sizeof(double));
+    n += workers[i].num_join;
+    for (opt=0; opt<LG_GAP_BUCKETS; opt++){
+      gaps[opt] += workers[i].gaps[opt];
+      total_gaps += workers[i].gaps[opt];
+    }
+    for (opt=0; opt<workers[i].num; opt++){
+      s = &workers[i].session[opt];
+      if (s->jitter_samples >= LG_JITTER_MIN_DATAGRAMS){
+        jitter[num_jitter++] = s->jitter_ns / 1e6;
+      }
+    }
+  }
+
+  mb = t.bytes / 1e6;
+  printf("%d clients (%d connected, %llu dropped by the server), %d stations, %.1f s\n",
+         num_sessions, ok, (unsigned long long)t.closed, num_stations, elapsed);
+  printf("throughput             %.2f MB/s, %.0f datagrams/s\n", mb / elapsed,
+         t.datagrams / elapsed);
+  if (framed){
+    printf("drops                  %.4f%% (%llu lost, %llu reordered, %llu from a previous station)\n",
+           t.datagrams + t.lost > 0 ? 100.0 * t.lost / (t.datagrams + t.lost) : 0.0,
+           (unsigned long long)t.lost, (unsigned long long)t.reordered,
+           (unsigned long long)t.stale);
+  }
+  printf("zaps                   %llu\n", (unsigned long long)t.zaps);
+  print_percentiles("join latency ms", join, n);
+  print_percentiles("client jitter ms", jitter, num_jitter);
+  if (total_gaps > 0){
+    printf("%-22s p50 %.2f  p90 %.2f  p99 %.2f  p99.9 %.2f  (n=%llu)\n",
+           "inter-arrival ms", gap_percentile(gaps, total_gaps, 0.5),
+           gap_percentile(gaps, total_gaps, 0.9),
+           gap_percentile(gaps, total_gaps, 0.99),
+           gap_percentile(gaps, total_gaps, 0.999),
+           (unsigned long long)total_gaps);
+  }
+  // on a small host the generator competes with the server for CPU, and
+  // once it is saturated its numbers describe itself more than the server
+
+  printf("load generator CPU     %.1f%% of a core\n",
+         self_cpu_ms() / 10.0 / elapsed);
+  if (cpu_end != -1){
+    printf("server CPU             %.1f%% of a core (user %.1f%%, system %.1f%%), %.2f ms per MB\n",
+           100.0 * (cpu_end - cpu_start) / sysconf(_SC_CLK_TCK) / elapsed,
+           100.0 * (user_end - user_start) / sysconf(_SC_CLK_TCK) / elapsed,
+           100.0 * (sys_end - sys_start) / sysconf(_SC_CLK_TCK) / elapsed,
+           mb > 0 ? 1000.0 * (cpu_end - cpu_start) / sysconf(_SC_CLK_TCK) / mb : 0.0);
+  }
+
+  for (i=0; i<num_workers; i++){
+    for (opt=0; opt<workers[i].num; opt++){
+      if (workers[i].session[opt].s_tcp != SESSION_CLOSED){
+        close(workers[i].session[opt].s_tcp);
+        close(workers[i].session[opt].s_udp);
+      }
+    }
+    close(workers[i].epfd);
+    free(workers[i].session);
+    free(workers[i].gaps);
+    free(workers[i].join_ms);
+  }
+  free(workers);
+  free(gaps);
+  free(jitter);
+  free(join);
+  return 0;
+}
@@ -0,0 +1,277 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "log.h"
+#include "pacer.h"
+
+int log_level = LOG_INFO;
+struct log_stats_t log_stats;
+
+static const char *level_names[] = {"debug", "info", "warn", "error"};
+
+struct log_record_t {
+  int64_t time_ns; // CLOCK_REALTIME
+  int level;
+  char text[LOG_LINE_SIZE];
+};
+
+// one thread's messages: it alone moves head, the flusher alone moves
+// tail, and each publishes its side with a release store
+
+struct log_ring_t {
+  uint64_t head;      // next record the thread fills
+  uint64_t tail;      // next record the flusher writes out
+  uint64_t flush_end; // head, as of the flush in progress
+  int tid;
+  struct log_ring_t *next;
+  struct log_record_t rec[LOG_RING_SLOTS];
+};
+
+static __thread struct log_ring_t *my_ring;
+
+// every thread's ring, newest first; rings are never freed, since a
+// message may still be waiting in one after its thread exited
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring_t *rings;
+
+// held by whoever is writing the rings out, the flusher or log_flush()
+
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static int log_format = LOG_TEXT;
+static uint64_t reported_dropped;
+
+static struct log_ring_t *get_ring(void){
+  struct log_ring_t *r;
+
+  if (my_ring != NULL){
+    return my_ring;
+  }
+  r = (struct log_ring_t *)calloc(1, sizeof(struct log_ring_t));
+  if (r == NULL){
+    return NULL;
+  }
+  r->tid = syscall(SYS_gettid);
+  pthread_mutex_lock(&rings_lock);
+  r->next = rings;
+  __atomic_store_n(&rings, r, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&rings_lock);
+  my_ring = r;
+  return r;
+}
+
+// whether the site may log another message now; if so, *skipped is how
+// many it was kept from logging since the last one
+
+static int admit(struct log_site_t *site, int64_t now_ns, uint64_t *skipped){
+  int64_t window_ns;
+
+  window_ns = __atomic_load_n(&site->window_ns, __ATOMIC_RELAXED);
+  if (now_ns - window_ns >= LOG_WINDOW_NS &&
+      __atomic_compare_exchange_n(&site->window_ns, &window_ns, now_ns, 0,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+    __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+  }
+  if (__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED) >= LOG_BURST){
+    __atomic_fetch_add(&site->skipped, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  *skipped = __atomic_exchange_n(&site->skipped, 0, __ATOMIC_RELAXED);
+  return 1;
+}
+
+void log_write(struct log_site_t *site, int level, const char *fmt, ...){
+  int len, saved_errno;
+  uint64_t head, skipped;
+  struct timespec now;
+  struct log_ring_t *r;
+  struct log_record_t *rec;
+  va_list ap;
+
+  saved_errno = errno; // for %m, whatever happens on the way
+  clock_gettime(CLOCK_REALTIME, &now);
+  skipped = 0;
+  if (level >= LOG_WARN && !admit(site, ts_to_ns(&now), &skipped)){
+    __atomic_fetch_add(&log_stats.suppressed, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  r = get_ring();
+  if (r == NULL){
+    __atomic_fetch_add(&log_stats.dropped, 1, __ATOMIC_RELAXED);
+    errno = saved_errno;
+    return;
+  }
+  head = r->head;
+  if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS){
+    __atomic_fetch_add(&log_stats.dropped, 1, __ATOMIC_RELAXED);
+    errno = saved_errno;
+    return;
+  }
+
+  rec = &r->rec[head % LOG_RING_SLOTS];
+  rec->time_ns = ts_to_ns(&now);
+  rec->level = level;
+  errno = saved_errno;
+  va_start(ap, fmt);
+  len = vsnprintf(rec->text, sizeof(rec->text), fmt, ap);
+  va_end(ap);
+  if (len < 0){
+    rec->text[0] = '\0';
+    len = 0;
+  }
+  if (len >= (int)sizeof(rec->text)){
+    len = sizeof(rec->text) - 1;
+  }
+  if (skipped > 0){
+    snprintf(rec->text + len, sizeof(rec->text) - len,
+             " (%llu more like this not logged)", (unsigned long long)skipped);
+  }
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+  errno = saved_errno;
+  return;
+}
+
+static void write_json_string(FILE *f, const char *s){
+  fputc('"', f);
+  for (; *s != '\0'; s++){
+    if (*s == '"' || *s == '\\'){
+      fprintf(f, "\\%c", *s);
+    }
+    else if ((unsigned char)*s < 0x20){
+      fprintf(f, "\\u%04x", *s);
+    }
+    else {
+      fputc(*s, f);
+    }
+  }
+  fputc('"', f);
+  return;
+}
+
+static void write_record(FILE *f, const struct log_record_t *rec, int tid){
+  if (log_format == LOG_JSON){
+    fprintf(f, "{\"time\": %lld.%06lld, \"level\": \"%s\", \"tid\": %d, "
+            "\"msg\": ", (long long)(rec->time_ns / NSEC_PER_SEC),
+            (long long)(rec->time_ns % NSEC_PER_SEC / 1000),
+            level_names[rec->level], tid);
+    write_json_string(f, rec->text);
+    fprintf(f, "}\n");
+  }
+  else {
+    fprintf(f, "%s\n", rec->text);
+  }
+  return;
+}
+
+// write out everything logged so far, oldest first across the threads;
+// the caller holds flush_lock
+
+static void drain(FILE *f){
+  int64_t oldest_ns;
+  uint64_t n, dropped;
+  struct log_ring_t *r, *first, *oldest;
+  struct log_record_t rec;
+  struct timespec now;
+
+  first = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+  for (r=first; r!=NULL; r=r->next){
+    r->flush_end = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  }
+  n = 0;
+  while (1){
+    oldest = NULL;
+    oldest_ns = 0;
+    for (r=first; r!=NULL; r=r->next){
+      if (r->tail != r->flush_end &&
+          (oldest == NULL ||
+           r->rec[r->tail % LOG_RING_SLOTS].time_ns < oldest_ns)){
+        oldest = r;
+        oldest_ns = r->rec[r->tail % LOG_RING_SLOTS].time_ns;
+      }
+    }
+    if (oldest == NULL){
+      break;
+    }
+
+    // copy the record out and hand its slot back before the write, so a
+    // stalled stderr holds up as little of the ring as possible
+
+    rec = oldest->rec[oldest->tail % LOG_RING_SLOTS];
+    __atomic_store_n(&oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE);
+    write_record(f, &rec, oldest->tid);
+    n++;
+  }
+  __atomic_fetch_add(&log_stats.written, n, __ATOMIC_RELAXED);
+
+  dropped = __atomic_load_n(&log_stats.dropped, __ATOMIC_RELAXED);
+  if (dropped != reported_dropped){
+    clock_gettime(CLOCK_REALTIME, &now);
+    rec.time_ns = ts_to_ns(&now);
+    rec.level = LOG_WARN;
+    snprintf(rec.text, sizeof(rec.text), "log: %llu messages dropped",
+             (unsigned long long)(dropped - reported_dropped));
+    write_record(f, &rec, syscall(SYS_gettid));
+    reported_dropped = dropped;
+  }
+  fflush(f);
+  return;
+}
+
+void log_flush(void){
+  pthread_mutex_lock(&flush_lock);
+  drain(stderr);
+  pthread_mutex_unlock(&flush_lock);
+  return;
+}
+
+static void *flush_loop(void *arg){
+  struct timespec interval;
+
+  (void) arg;
+  interval.tv_sec = 0;
+  interval.tv_nsec = LOG_FLUSH_MS * 1000000L;
+  while (1){
+    nanosleep(&interval, NULL);
+    log_flush();
+  }
+  return NULL;
+}
+
+// "debug", "info", "warn" or "error"; -1 if it is none of them
+
+int log_parse_level(const char *name){
+  int i;
+
+  for (i=LOG_DEBUG; i<=LOG_ERROR; i++){
+    if (strcmp(name, level_names[i]) == 0){
+      return i;
+    }
+  }
+  return -1;
+}
+
+// log messages at level and above in format, from now on; whatever is
+// still waiting at exit() is written out then
+
+void log_init(int level, int format){
+  int ret;
+  pthread_t t_flush;
+
+  log_level = level;
+  log_format = format;
+  atexit(log_flush);
+  ret = pthread_create(&t_flush, NULL, flush_loop, NULL);
+  if (ret != 0){
+    perror("pthread_create()");
+    exit(-1);
+  }
+  pthread_detach(t_flush);
+  return;
+}
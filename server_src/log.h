@@ -0,0 +1,62 @@
+#ifndef _LOG_H
+#define _LOG_H
+
+#include <stdint.h>
+
+#define LOG_DEBUG 0
+#define LOG_INFO 1
+#define LOG_WARN 2
+#define LOG_ERROR 3
+
+#define LOG_TEXT 0 // the message alone, one per line
+#define LOG_JSON 1 // one object per line, with time, level and thread
+
+#define LOG_RING_SLOTS 256 // messages a thread can have waiting
+#define LOG_LINE_SIZE 240  // longest message kept; the rest is cut off
+#define LOG_FLUSH_MS 20    // how often the flusher empties the rings
+#define LOG_BURST 10       // warnings and errors a call site may log
+#define LOG_WINDOW_NS 1000000000L // per this long
+
+// messages are formatted into a ring of the calling thread's own and
+// written out by a background thread, so logging never waits on stderr or
+// on another thread; if the ring is full, the message is dropped and
+// counted. Past LOG_BURST per LOG_WINDOW_NS, a call site's warnings and
+// errors are only counted, and the next one let through says how many
+// were left out. glibc's %m stands in for perror().
+
+// one call site's rate limit
+
+struct log_site_t {
+  int64_t window_ns; // when its current window began
+  int count;         // messages logged in it
+  uint64_t skipped;  // since the last one let through
+};
+
+struct log_stats_t {
+  uint64_t written;
+  uint64_t dropped;    // rings were full
+  uint64_t suppressed; // by the rate limit
+};
+
+extern int log_level;
+extern struct log_stats_t log_stats;
+
+#define log_at(level, ...) do { \
+    static struct log_site_t _log_site; \
+    if ((level) >= __atomic_load_n(&log_level, __ATOMIC_RELAXED)){ \
+      log_write(&_log_site, (level), __VA_ARGS__); \
+    } \
+  } while (0)
+
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...) log_at(LOG_INFO, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_WARN, __VA_ARGS__)
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+
+void log_write(struct log_site_t *, int, const char *, ...)
+  __attribute__((format(printf, 3, 4)));
+int log_parse_level(const char *);
+void log_init(int, int);
+void log_flush(void);
+
+#endif
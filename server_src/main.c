@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <string.h>
@@ -10,16 +11,37 @@
 #include "user_io.h"
 #include "station.h"
 #include "misc.h"
+#include "songstore.h"
+#include "pacer.h"
+#include "scheduler.h"
+#include "shard.h"
+#include "playlist.h"
+#include "stats.h"
+#include "log.h"
 
 struct ses_t ses;
 
+#define ACCEPT_PAUSE_US 100000 // after accept() runs out of fds or memory
+
+// a connection accept() can't take for lack of fds is taken into a spare
+// one kept for the purpose and closed straight away, rather than left to
+// wake accept() over and over; returns the spare, open again
+
+static int shed_connection(int s_listen, int spare){
+  int s_client;
+
+  close(spare);
+  s_client = accept(s_listen, NULL, NULL);
+  if (s_client != -1){
+    close(s_client);
+  }
+  return open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
 int listen_loop(int port){
-  int ret, s_client, s_listen, sock_reuse_val;
+  int ret, s_client, s_listen, sock_reuse_val, spare;
   struct sockaddr_in client_addr, listen_addr;
   socklen_t client_addr_size;
-//  pthread_attr_t tattr;
-  pthread_t t_client;
-  struct connection_info_t *connection_info;
 
   // prepare a socket for listening
 
@@ -49,32 +71,47 @@ int listen_loop(int port){
     perror("listen()");
     return -1;
   }
+  spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  if (spare == -1){
+    perror("open()");
+    return -1;
+  }
 
-  // accept connections forever
+  // accept connections forever, handing each to a connection worker. A
+  // client giving up before it is accepted, or running short of fds or
+  // memory for a while, only costs the clients turned away meanwhile.
 
   while (1){
     client_addr_size = sizeof(client_addr);
-    s_client = accept(s_listen, (struct sockaddr *)&client_addr,
-                      &client_addr_size);
+    s_client = accept4(s_listen, (struct sockaddr *)&client_addr,
+                       &client_addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
     if (s_client == -1){
+      switch (errno){
+        case EINTR:
+        case ECONNABORTED:
+        case EPROTO:
+          continue;
+        case EMFILE:
+        case ENFILE:
+          log_warn("accept(): %m; turning a client away");
+          if (spare != -1){
+            spare = shed_connection(s_listen, spare);
+          }
+          usleep(ACCEPT_PAUSE_US);
+          continue;
+        case ENOBUFS:
+        case ENOMEM:
+          log_warn("accept(): %m");
+          usleep(ACCEPT_PAUSE_US);
+          continue;
+      }
       perror("accept()");
       return -1;
     }
-    connection_info = (struct connection_info_t *)
-                      malloc(sizeof(struct connection_info_t));
-    if (connection_info == NULL){
-      perror("malloc()");
-      return -1;
-    }
-    connection_info->ip = ntohl(client_addr.sin_addr.s_addr);
-    connection_info->s_client = s_client;
-    ret = pthread_create(&t_client, NULL, (void *(*)(void *))connection_loop,
-                         connection_info); // XXX create detached
-    if (ret != 0){
-      perror("pthread_create()");
-      return -1;
+    ret = connection_add(s_client, ntohl(client_addr.sin_addr.s_addr));
+    if (ret == -1){
+      close(s_client);
     }
-    pthread_detach(t_client); // XXX create detached
   }
 
   close(s_listen);
@@ -87,14 +124,207 @@ void create_io_thread(){
 }
 
 
+// "group[:port]" for -m
+
+static int parse_group(const char *arg){
+  char buf[32];
+  char *port;
+  struct in_addr group;
+
+  snprintf(buf, sizeof(buf), "%s", arg);
+  ses.mcast_port = DEFAULT_MCAST_PORT;
+  port = strchr(buf, ':');
+  if (port != NULL){
+    *port++ = '\0';
+    if (atoi(port) <= 0 || atoi(port) > UINT16_MAX){
+      return -1;
+    }
+    ses.mcast_port = atoi(port);
+  }
+  if (inet_aton(buf, &group) == 0 || !IN_MULTICAST(ntohl(group.s_addr))){
+    return -1;
+  }
+  ses.mcast_group = ntohl(group.s_addr);
+  return 0;
+}
+
+void usage(char *argv0){
+  fprintf(stderr, "usage: %s [-p] [-l] [-H] [-r rate] [-w workers] [-t threads] [-m group[:port]] [-I addr] [-b chunks] [-B ms] [-S path] [-F shards[:dests]] [-R] [-E k[:p]] [-L level] [-J] port file1[@rate] [file2 [...]]\n"
+          "  a file may also be a directory or .m3u playlist of tracks to\n"
+          "  play in order\n"
+          "  -p  prefault song mappings (MAP_POPULATE)\n"
+          "  -l  preload songs into anonymous memory instead of mapping them\n"
+          "  -H  preload songs onto huge pages where available\n"
+          "  -r  default stream rate in bytes per second (%d); file@rate\n"
+          "      overrides it for one station\n"
+          "  -w  connection worker threads (default: one per core)\n"
+          "  -t  station scheduler threads (default: one per core)\n"
+          "  -m  offer multicast: station i streams to group+i on port (%d)\n"
+          "      to clients that ask for it\n"
+          "  -I  address of the interface to multicast out of\n"
+          "  -b  history chunks per tick a joining client catches up at (%d);\n"
+          "      0 starts it at the live edge\n"
+          "  -B  milliseconds of each station kept for joining clients (%d)\n"
+          "  -S  serve JSON snapshots of the server's counters on a unix\n"
+          "      socket at path\n"
+          "  -F  split ticks to dests (%d) or more destinations across\n"
+          "      this many extra fan-out threads\n"
+          "  -R  a station woken up after idling restarts its track, rather\n"
+          "      than picking up where it would have got to by now\n"
+          "  -E  send clients that ask for FEC p (1) XOR parity datagrams\n"
+          "      after every k data datagrams, for p/k overhead; p <= %d,\n"
+          "      k <= %d\n"
+          "  -L  log debug, info (the default), warn or error messages and up\n"
+          "  -J  log JSON lines with time, level and thread instead of text\n",
+          argv0, DEFAULT_BYTE_RATE, DEFAULT_MCAST_PORT, DEFAULT_BURST_CHUNKS,
+          DEFAULT_HISTORY_MS, SHARD_DEFAULT_THRESHOLD, FEC_MAX_PARITY,
+          FEC_MAX_GROUP);
+  return;
+}
+
 int main(int argc, char **argv){
-  if (argc < 3 || atoi(argv[1]) == 0){
-    fprintf(stderr, "usage: %s port file1 [file2 [file3 [...]]]\n", argv[0]);
+  int opt, num_workers, num_sched, num_shards, shard_dests;
+  int log_min, log_format;
+  char *stats_path, *p;
+  struct in_addr mcast_if;
+  ses.song_flags = 0;
+  ses.byte_rate = DEFAULT_BYTE_RATE;
+  ses.mcast_group = 0;
+  ses.mcast_if = 0;
+  ses.history_ms = DEFAULT_HISTORY_MS;
+  ses.burst_chunks = DEFAULT_BURST_CHUNKS;
+  ses.resume_at_start = 0;
+  ses.fec_k = 0;
+  ses.fec_p = 0;
+  num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  num_sched = num_workers;
+  stats_path = NULL;
+  num_shards = 0;
+  shard_dests = SHARD_DEFAULT_THRESHOLD;
+  log_min = LOG_INFO;
+  log_format = LOG_TEXT;
+  while ((opt = getopt(argc, argv, "plHr:w:t:m:I:b:B:S:F:RE:L:J")) != -1){
+    switch (opt){
+      case 'p':
+        ses.song_flags |= SONG_POPULATE;
+        break;
+      case 'l':
+        ses.song_flags |= SONG_PRELOAD;
+        break;
+      case 'H':
+        ses.song_flags |= SONG_PRELOAD | SONG_HUGEPAGES;
+        break;
+      case 'r':
+        ses.byte_rate = atol(optarg);
+        if (ses.byte_rate <= 0){
+          usage(argv[0]);
+          return -1;
+        }
+        break;
+      case 'w':
+        num_workers = atoi(optarg);
+        if (num_workers <= 0){
+          usage(argv[0]);
+          return -1;
+        }
+        break;
+      case 't':
+        num_sched = atoi(optarg);
+        if (num_sched <= 0){
+          usage(argv[0]);
+          return -1;
+        }
+        break;
+      case 'm':
+        if (parse_group(optarg) == -1){
+          usage(argv[0]);
+          return -1;
+        }
+        break;
+      case 'I':
+        if (inet_aton(optarg, &mcast_if) == 0){
+          usage(argv[0]);
+          return -1;
+        }
+        ses.mcast_if = ntohl(mcast_if.s_addr);
+        break;
+      case 'b':
+        ses.burst_chunks = atoi(optarg);
+        if (ses.burst_chunks < 0 || ses.burst_chunks > HISTORY_MAX_BURST){
+          usage(argv[0]);
+          return -1;
+        }
+        break;
+      case 'B':
+        ses.history_ms = atoi(optarg);
+        if (ses.history_ms <= 0){
+          usage(argv[0]);
+          return -1;
+        }
+        break;
+      case 'S':
+        stats_path = optarg;
+        break;
+      case 'R':
+        ses.resume_at_start = 1;
+        break;
+      case 'E':
+        ses.fec_k = atoi(optarg);
+        p = strchr(optarg, ':');
+        ses.fec_p = p != NULL ? atoi(p + 1) : 1;
+        if (ses.fec_k <= 0 || ses.fec_k > FEC_MAX_GROUP || ses.fec_p <= 0 ||
+            ses.fec_p > FEC_MAX_PARITY || ses.fec_p > ses.fec_k){
+          usage(argv[0]);
+          return -1;
+        }
+        break;
+      case 'L':
+        log_min = log_parse_level(optarg);
+        if (log_min == -1){
+          usage(argv[0]);
+          return -1;
+        }
+        break;
+      case 'J':
+        log_format = LOG_JSON;
+        break;
+      case 'F':
+        num_shards = atoi(optarg);
+        p = strchr(optarg, ':');
+        if (p != NULL){
+          shard_dests = atoi(p + 1);
+        }
+        if (num_shards <= 0 || shard_dests <= 0){
+          usage(argv[0]);
+          return -1;
+        }
+        break;
+      default:
+        usage(argv[0]);
+        return -1;
+    }
+  }
+  if (argc - optind < 2 || atoi(argv[optind]) == 0){
+    usage(argv[0]);
+    return -1;
+  }
+  if (num_workers <= 0){
+    num_workers = 1;
+    num_sched = 1;
+  }
+  log_init(log_min, log_format);
+  if (num_shards > 0){
+    create_shards(num_shards, shard_dests);
+  }
+  create_sched_workers(num_sched);
+  create_prefetch_thread();
+  create_stations(argc-optind-1, argv+optind+1);
+  create_connection_workers(num_workers);
+  if (stats_path != NULL && stats_listen(stats_path) == -1){
     return -1;
   }
-  create_stations(argc-2, argv+2);
   create_io_thread();
-  listen_loop(atoi(argv[1]));
+  listen_loop(atoi(argv[optind]));
   destroy_stations();
   return 0;
 }
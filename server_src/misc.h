@@ -1,9 +1,21 @@
 #ifndef _MISC_H
 #define _MISC_H
 
+#include <stdint.h>
+
 struct ses_t {
-  int num_stations;
-  struct station_t *station;
+  int num_stations; // station numbers handed out so far; only grows
+  int song_flags; // SONG_* flags for the song store
+  long byte_rate; // default stream rate, bytes per second
+  uint32_t mcast_group; // group of station 0, the rest follow; 0 if off
+  uint16_t mcast_port;
+  uint32_t mcast_if;    // interface address to send groups out of, or 0
+  int history_ms;       // of each station kept for joining clients
+  int burst_chunks;     // history chunks per tick to a joining client, or 0
+  int resume_at_start;  // a woken station restarts its track, rather than
+                        // picking up where it would have got to by now
+  int fec_k;            // FEC clients get fec_p parity datagrams per fec_k
+  int fec_p;            // data datagrams; 0 if FEC is off
 };
 
 #endif
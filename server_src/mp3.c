@@ -0,0 +1,349 @@
+#include <stdlib.h>
+#include <string.h>
+#include "mp3.h"
+#include "pacer.h"
+
+#define MPEG1 3
+#define MPEG2 2
+#define MPEG25 0
+
+#define LAYER1 3
+#define LAYER2 2
+#define LAYER3 1
+
+struct frame_t {
+  int version;
+  int layer;
+  int bitrate;     // bits per second
+  int sample_rate;
+  int samples;     // per frame
+  int mono;
+  size_t length;   // bytes, header included
+};
+
+// kbit/s, indexed by [MPEG1 ? 0 : 1][layer][bitrate index]
+
+static const int bitrates[2][4][16] = {
+  {
+    {0},
+    {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0},
+    {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 0},
+    {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0}
+  },
+  {
+    {0},
+    {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},
+    {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},
+    {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0}
+  }
+};
+
+static const int sample_rates[3] = {44100, 48000, 32000};
+
+// decode the 4-byte frame header at p; returns 0 if it isn't one we can time
+
+static int parse_header(const unsigned char *p, struct frame_t *f){
+  int bitrate_index, rate_index, padding;
+
+  if (p[0] != 0xff || (p[1] & 0xe0) != 0xe0){
+    return 0;
+  }
+  f->version = (p[1] >> 3) & 3;
+  f->layer = (p[1] >> 1) & 3;
+  bitrate_index = p[2] >> 4;
+  rate_index = (p[2] >> 2) & 3;
+  padding = (p[2] >> 1) & 1;
+  f->mono = (p[3] >> 6) == 3;
+
+  // reserved version/layer/rate, and free-format or bad bitrates
+
+  if (f->version == 1 || f->layer == 0 || rate_index == 3 ||
+      bitrate_index == 0 || bitrate_index == 15){
+    return 0;
+  }
+
+  f->bitrate = bitrates[f->version != MPEG1][f->layer][bitrate_index] * 1000;
+  f->sample_rate = sample_rates[rate_index];
+  if (f->version == MPEG2){
+    f->sample_rate /= 2;
+  }
+  else if (f->version == MPEG25){
+    f->sample_rate /= 4;
+  }
+
+  switch (f->layer){
+    case LAYER1:
+      f->samples = 384;
+      f->length = (12 * f->bitrate / f->sample_rate + padding) * 4;
+      break;
+    case LAYER2:
+      f->samples = 1152;
+      f->length = 144 * f->bitrate / f->sample_rate + padding;
+      break;
+    default:
+      f->samples = f->version == MPEG1 ? 1152 : 576;
+      f->length = (f->samples / 8) * f->bitrate / f->sample_rate + padding;
+      break;
+  }
+  return 1;
+}
+
+static uint32_t be32(const unsigned char *p){
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+         (uint32_t)p[2] << 8 | p[3];
+}
+
+// if the frame at p is a Xing/Info or VBRI header rather than audio, return
+// the total frame count it declares (0 if it declares none); else -1
+
+static int64_t vbr_header_frames(const unsigned char *p,
+                                 const struct frame_t *f){
+  size_t side_info;
+  const unsigned char *x;
+
+  if (f->layer != LAYER3){
+    return -1;
+  }
+  if (f->version == MPEG1){
+    side_info = f->mono ? 17 : 32;
+  }
+  else {
+    side_info = f->mono ? 9 : 17;
+  }
+
+  x = p + 4 + side_info;
+  if (4 + side_info + 12 <= f->length &&
+      (memcmp(x, "Xing", 4) == 0 || memcmp(x, "Info", 4) == 0)){
+    return be32(x + 4) & 1 ? be32(x + 8) : 0;
+  }
+
+  x = p + 4 + 32;
+  if (4 + 32 + 18 <= f->length && memcmp(x, "VBRI", 4) == 0){
+    return be32(x + 14);
+  }
+  return -1;
+}
+
+// is there a chain of MP3_MIN_FRAMES valid frames starting at pos?
+
+static int frames_chain(const unsigned char *data, size_t size, size_t pos){
+  int i;
+  struct frame_t f;
+
+  for (i=0; i<MP3_MIN_FRAMES; i++){
+    if (pos + 4 > size || !parse_header(data + pos, &f)){
+      return 0;
+    }
+    pos += f.length;
+  }
+  return pos <= size;
+}
+
+static int resize(struct mp3_timing_t *t, int *size, int new_size){
+  void *p;
+
+  p = realloc(t->offset, new_size * sizeof(*t->offset));
+  if (p == NULL){
+    return -1;
+  }
+  t->offset = p;
+  p = realloc(t->time_ns, new_size * sizeof(*t->time_ns));
+  if (p == NULL){
+    return -1;
+  }
+  t->time_ns = p;
+  *size = new_size;
+  return 0;
+}
+
+static int append(struct mp3_timing_t *t, int *size, size_t offset,
+                  int64_t time_ns){
+  if (t->num_frames >= *size &&
+      resize(t, size, *size ? *size * 2 : 1024) == -1){
+    return -1;
+  }
+  t->offset[t->num_frames] = offset;
+  t->time_ns[t->num_frames] = time_ns;
+  t->num_frames++;
+  return 0;
+}
+
+// build the frame timing table of an MP3 file, or return NULL if data
+// doesn't look like one
+
+struct mp3_timing_t *mp3_scan(const unsigned char *data, size_t size){
+  int i, size_table, first_bitrate;
+  size_t pos, end;
+  int64_t samples, xing, lead_ns;
+  struct frame_t f;
+  struct mp3_timing_t *t;
+
+  // skip an ID3v2 tag (10 byte header, syncsafe size, optional footer)
+
+  pos = 0;
+  if (size >= 10 && memcmp(data, "ID3", 3) == 0){
+    pos = 10 + ((data[6] & 0x7f) << 21 | (data[7] & 0x7f) << 14 |
+                (data[8] & 0x7f) << 7 | (data[9] & 0x7f));
+    if (data[5] & 0x10){
+      pos += 10;
+    }
+  }
+
+  // find the first frame that starts a believable chain
+
+  while (pos + 4 <= size && !frames_chain(data, size, pos)){
+    pos++;
+  }
+  if (pos + 4 > size){
+    return NULL;
+  }
+
+  t = (struct mp3_timing_t *)calloc(1, sizeof(struct mp3_timing_t));
+  if (t == NULL){
+    return NULL;
+  }
+  size_table = 0;
+  samples = 0;
+  first_bitrate = 0;
+
+  // a Xing/Info/VBRI frame decodes to nothing, so it takes no time
+
+  parse_header(data + pos, &f);
+  t->sample_rate = f.sample_rate;
+  xing = vbr_header_frames(data + pos, &f);
+  if (xing != -1){
+
+    // size the table from the frame count it declares (plus itself and
+    // the sentinel), so a long file isn't copied over as the table
+    // doubles; a count no file this size could hold is ignored
+
+    if (xing > 0 && xing <= (int64_t)(size / MP3_MIN_FRAME_BYTES) &&
+        resize(t, &size_table, xing + 2) == -1){
+      goto fail;
+    }
+    if (append(t, &size_table, pos, 0) == -1){
+      goto fail;
+    }
+    pos += f.length;
+  }
+  end = pos;
+
+  while (pos + 4 <= size){
+    if (!parse_header(data + pos, &f) || pos + f.length > size){
+
+      // garbage between frames: resynchronise on the next solid chain
+
+      pos++;
+      while (pos + 4 <= size && !frames_chain(data, size, pos)){
+        pos++;
+      }
+      continue;
+    }
+    if (first_bitrate == 0){
+      first_bitrate = f.bitrate;
+    }
+    else if (f.bitrate != first_bitrate){
+      t->vbr = 1;
+    }
+    if (append(t, &size_table, pos, samples * NSEC_PER_SEC /
+                                    t->sample_rate) == -1){
+      goto fail;
+    }
+    samples += f.samples;
+    pos += f.length;
+    end = pos;
+  }
+
+  // trailing tags (ID3v1 and friends) come after the last frame ends
+
+  if (t->num_frames == 0 ||
+      append(t, &size_table, end, samples * NSEC_PER_SEC /
+                                  t->sample_rate) == -1){
+    goto fail;
+  }
+  t->num_frames--; // the sentinel isn't a frame
+  if (samples == 0){
+    goto fail;
+  }
+
+  // a leading tag decodes to nothing but may be large (cover art), so give
+  // it the file's average bitrate rather than sending it as one burst
+
+  lead_ns = (int64_t)t->offset[0] * t->time_ns[t->num_frames] /
+            (int64_t)(end - t->offset[0]);
+  for (i=0; i<=t->num_frames; i++){
+    t->time_ns[i] += lead_ns;
+  }
+  return t;
+
+fail:
+  mp3_free(t);
+  return NULL;
+}
+
+void mp3_free(struct mp3_timing_t *t){
+  if (t == NULL){
+    return;
+  }
+  free(t->offset);
+  free(t->time_ns);
+  free(t);
+  return;
+}
+
+// playback time at byte offset, interpolated within its frame (or within
+// the leading tag)
+
+int64_t mp3_time_ns(const struct mp3_timing_t *t, size_t offset){
+  int lo, hi, mid;
+
+  if (offset < t->offset[0]){
+    return t->time_ns[0] * (int64_t)offset / (int64_t)t->offset[0];
+  }
+  if (offset >= t->offset[t->num_frames]){
+    return t->time_ns[t->num_frames];
+  }
+
+  // find the frame with offset[lo] <= offset < offset[lo+1]
+
+  lo = 0;
+  hi = t->num_frames;
+  while (hi - lo > 1){
+    mid = (lo + hi) / 2;
+    if (t->offset[mid] <= offset){
+      lo = mid;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  return t->time_ns[lo] + (t->time_ns[lo+1] - t->time_ns[lo]) *
+         (int64_t)(offset - t->offset[lo]) /
+         (int64_t)(t->offset[lo+1] - t->offset[lo]);
+}
+
+// byte offset of the frame playing at time ns; 0 within the leading tag,
+// the end of the file past its last frame
+
+size_t mp3_offset(const struct mp3_timing_t *t, int64_t ns){
+  int lo, hi, mid;
+
+  if (ns < t->time_ns[0]){
+    return 0;
+  }
+  if (ns >= t->time_ns[t->num_frames]){
+    return t->offset[t->num_frames];
+  }
+  lo = 0;
+  hi = t->num_frames;
+  while (hi - lo > 1){
+    mid = (lo + hi) / 2;
+    if (t->time_ns[mid] <= ns){
+      lo = mid;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  return t->offset[lo];
+}
@@ -0,0 +1,27 @@
+#ifndef _MP3_H
+#define _MP3_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MP3_MIN_FRAMES 4 // consecutive frames needed to call a file MP3
+#define MP3_MIN_FRAME_BYTES 24 // shortest frame: MPEG-2 layer III, 8 kb/s
+
+// playback timing of every frame in an MP3 file; frame i covers bytes
+// [offset[i], offset[i+1]) and plays from time_ns[i] to time_ns[i+1], and
+// any leading tag plays from 0 to time_ns[0]
+
+struct mp3_timing_t {
+  int num_frames;
+  size_t *offset;       // num_frames + 1 entries
+  int64_t *time_ns;     // num_frames + 1 entries
+  int sample_rate;      // of the first audio frame
+  int vbr;              // bitrate changes between frames
+};
+
+struct mp3_timing_t *mp3_scan(const unsigned char *, size_t);
+void mp3_free(struct mp3_timing_t *);
+int64_t mp3_time_ns(const struct mp3_timing_t *, size_t);
+size_t mp3_offset(const struct mp3_timing_t *, int64_t);
+
+#endif
@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "netio.h"
+
+// plain syscall backend: every station due in a tick shares sendmmsg()
+// calls, FANOUT_MAX_BATCH datagrams at a time
+
+struct netio_t {
+  int s_udp;
+  struct fanout_batch_t batch;
+};
+
+struct netio_t *netio_create(int s_udp){
+  struct netio_t *io;
+
+  io = (struct netio_t *)malloc(sizeof(struct netio_t));
+  if (io == NULL){
+    perror("malloc()");
+    return NULL;
+  }
+  io->s_udp = s_udp;
+  fanout_batch_init(&io->batch);
+  return io;
+}
+
+void netio_destroy(struct netio_t *io){
+  fanout_batch_destroy(&io->batch);
+  close(io->s_udp);
+  free(io);
+  return;
+}
+
+// send each fan-out the chunk (and header) in its iovs; fills in every
+// fan-out's status[] and returns the number of failed entries
+
+int netio_send(struct netio_t *io, struct fanout_t **fo, int n,
+               int *failed_each){
+  return fanout_send_batch(io->s_udp, &io->batch, fo, n, failed_each);
+}
+
+uint64_t netio_syscalls(const struct netio_t *io){
+  return io->batch.calls;
+}
+
+const char *netio_backend(void){
+  return "sendmmsg";
+}
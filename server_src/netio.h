@@ -0,0 +1,24 @@
+#ifndef _NETIO_H
+#define _NETIO_H
+
+#include <stdint.h>
+#include "fanout.h"
+
+#define NETIO_RING_ENTRIES 1024 // io_uring submission queue size
+
+// how a scheduler worker puts a tick's datagrams on the wire. The backend
+// is chosen at build time: plain sendmmsg() calls (netio.c), or io_uring
+// with the socket registered with the ring (netio_uring.c, built with
+// make IO_BACKEND=uring). netio_send() fills in every fan-out's status[],
+// and its number of failed entries in the array given, if any, and
+// returns the total.
+
+struct netio_t;
+
+struct netio_t *netio_create(int);
+void netio_destroy(struct netio_t *);
+int netio_send(struct netio_t *, struct fanout_t **, int, int *);
+uint64_t netio_syscalls(const struct netio_t *);
+const char *netio_backend(void);
+
+#endif
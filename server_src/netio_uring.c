@@ -0,0 +1,283 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "netio.h"
+
+// io_uring backend: a tick's whole fan-out becomes one SENDMSG entry per
+// destination, submitted and reaped NETIO_RING_ENTRIES at a time by a
+// single io_uring_enter(). The socket is registered with the ring, so the
+// kernel doesn't look it up per datagram. The song chunks are not
+// registered buffers: SENDMSG can't use them, and zero-copy sends cost
+// more than they save on datagrams this small.
+
+struct netio_t {
+  int s_udp;
+  int ring_fd;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  struct io_uring_sqe *sqes;
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  void *cq_ring;
+  size_t sq_ring_size;
+  size_t cq_ring_size;
+  size_t sqes_size;
+
+  int *status;      // flat per-destination results of the current send
+  int status_size;
+  uint64_t syscalls;
+};
+
+static int ring_setup(unsigned entries, struct io_uring_params *p){
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int ring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                      unsigned flags){
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                 NULL, 0);
+}
+
+static int ring_register(int fd, unsigned opcode, void *arg, unsigned n){
+  return syscall(__NR_io_uring_register, fd, opcode, arg, n);
+}
+
+static void ring_unmap(struct netio_t *io){
+  if (io->sqes != NULL && io->sqes != MAP_FAILED){
+    munmap(io->sqes, io->sqes_size);
+  }
+  if (io->cq_ring != NULL && io->cq_ring != MAP_FAILED &&
+      io->cq_ring != io->sq_ring){
+    munmap(io->cq_ring, io->cq_ring_size);
+  }
+  if (io->sq_ring != NULL && io->sq_ring != MAP_FAILED){
+    munmap(io->sq_ring, io->sq_ring_size);
+  }
+  return;
+}
+
+struct netio_t *netio_create(int s_udp){
+  unsigned i;
+  struct netio_t *io;
+  struct io_uring_params p;
+
+  io = (struct netio_t *)calloc(1, sizeof(struct netio_t));
+  if (io == NULL){
+    perror("calloc()");
+    return NULL;
+  }
+  io->s_udp = s_udp;
+
+  memset(&p, 0, sizeof(p));
+  io->ring_fd = ring_setup(NETIO_RING_ENTRIES, &p);
+  if (io->ring_fd == -1){
+    perror("io_uring_setup()");
+    free(io);
+    return NULL;
+  }
+
+  // map the submission and completion rings (one mapping on any kernel
+  // that can share it) and the submission entries
+
+  io->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  io->cq_ring_size = p.cq_off.cqes +
+                     p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP){
+    if (io->cq_ring_size > io->sq_ring_size){
+      io->sq_ring_size = io->cq_ring_size;
+    }
+    io->cq_ring_size = io->sq_ring_size;
+  }
+  io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, io->ring_fd,
+                     IORING_OFF_SQ_RING);
+  if (io->sq_ring == MAP_FAILED){
+    perror("mmap()");
+    goto fail;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP){
+    io->cq_ring = io->sq_ring;
+  }
+  else {
+    io->cq_ring = mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, io->ring_fd,
+                       IORING_OFF_CQ_RING);
+    if (io->cq_ring == MAP_FAILED){
+      perror("mmap()");
+      goto fail;
+    }
+  }
+  io->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQES);
+  if (io->sqes == MAP_FAILED){
+    perror("mmap()");
+    goto fail;
+  }
+
+  io->sq_head = (unsigned *)((char *)io->sq_ring + p.sq_off.head);
+  io->sq_tail = (unsigned *)((char *)io->sq_ring + p.sq_off.tail);
+  io->sq_mask = *(unsigned *)((char *)io->sq_ring + p.sq_off.ring_mask);
+  io->sq_entries = p.sq_entries;
+  io->cq_head = (unsigned *)((char *)io->cq_ring + p.cq_off.head);
+  io->cq_tail = (unsigned *)((char *)io->cq_ring + p.cq_off.tail);
+  io->cq_mask = *(unsigned *)((char *)io->cq_ring + p.cq_off.ring_mask);
+  io->cqes = (struct io_uring_cqe *)((char *)io->cq_ring + p.cq_off.cqes);
+
+  // entries are always filled in ring order, so the index array is fixed
+
+  for (i=0; i<io->sq_entries; i++){
+    ((unsigned *)((char *)io->sq_ring + p.sq_off.array))[i] = i;
+  }
+
+  if (ring_register(io->ring_fd, IORING_REGISTER_FILES, &io->s_udp, 1) == -1){
+    perror("io_uring_register()");
+    goto fail;
+  }
+  return io;
+
+fail:
+  ring_unmap(io);
+  close(io->ring_fd);
+  free(io);
+  return NULL;
+}
+
+void netio_destroy(struct netio_t *io){
+  ring_unmap(io);
+  close(io->ring_fd);
+  close(io->s_udp);
+  free(io->status);
+  free(io);
+  return;
+}
+
+// move every completion into status[]; returns how many were reaped
+
+static int reap(struct netio_t *io, int *failed){
+  unsigned head, tail;
+  struct io_uring_cqe *cqe;
+  int n;
+
+  n = 0;
+  head = *io->cq_head;
+  tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail){
+    cqe = &io->cqes[head & io->cq_mask];
+    io->status[cqe->user_data] = cqe->res < 0 ? -cqe->res : 0;
+    if (cqe->res < 0){
+      (*failed)++;
+    }
+    head++;
+    n++;
+  }
+  __atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+  return n;
+}
+
+// send each fan-out the chunk (and header) in its iovs; fills in every
+// fan-out's status[] and returns the number of failed entries
+
+int netio_send(struct netio_t *io, struct fanout_t **fo, int n,
+               int *failed_each){
+  int i, j, k, ret, total, queued, done, failed;
+  unsigned tail, to_submit;
+  struct io_uring_sqe *sqe;
+  void *p;
+
+  total = 0;
+  for (i=0; i<n; i++){
+    total += fo[i]->num;
+  }
+  if (total > io->status_size){
+    p = realloc(io->status, total * sizeof(*io->status));
+    if (p == NULL){
+      perror("realloc()");
+      exit(-1);
+    }
+    io->status = p;
+    io->status_size = total;
+  }
+
+  failed = 0;
+  done = 0;
+  i = 0;
+  j = 0;
+  k = 0;
+  while (done < total){
+
+    // queue the next ring's worth of destinations; the messages already
+    // carry their address and chunk, so each entry only points at one
+
+    queued = 0;
+    tail = *io->sq_tail;
+    while (k < total && queued < (int)io->sq_entries){
+      while (j == fo[i]->num){
+        i++;
+        j = 0;
+      }
+      sqe = &io->sqes[tail & io->sq_mask];
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->flags = IOSQE_FIXED_FILE;
+      sqe->fd = 0; // index into the registered files
+      sqe->addr = (uintptr_t)&fo[i]->msg[j].msg_hdr;
+      sqe->len = 1;
+      sqe->user_data = k;
+      tail++;
+      j++;
+      k++;
+      queued++;
+    }
+    __atomic_store_n(io->sq_tail, tail, __ATOMIC_RELEASE);
+
+    // submit them and wait for all of their completions in one call
+
+    to_submit = queued;
+    while (queued > 0){
+      ret = ring_enter(io->ring_fd, to_submit, queued, IORING_ENTER_GETEVENTS);
+      io->syscalls++;
+      if (ret == -1 && errno != EINTR && errno != EAGAIN){
+        perror("io_uring_enter()");
+        exit(-1);
+      }
+      to_submit = *io->sq_tail - __atomic_load_n(io->sq_head, __ATOMIC_ACQUIRE);
+      ret = reap(io, &failed);
+      queued -= ret;
+      done += ret;
+    }
+  }
+
+  // hand the results back to each fan-out
+
+  k = 0;
+  for (i=0; i<n; i++){
+    memcpy(fo[i]->status, io->status + k, fo[i]->num * sizeof(*io->status));
+    k += fo[i]->num;
+    if (failed_each != NULL){
+      failed_each[i] = fanout_count_failed(fo[i], failed > 0);
+    }
+  }
+  return failed;
+}
+
+uint64_t netio_syscalls(const struct netio_t *io){
+  return io->syscalls;
+}
+
+const char *netio_backend(void){
+  return "io_uring";
+}
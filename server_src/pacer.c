@@ -0,0 +1,79 @@
+#include "pacer.h"
+
+int64_t ts_to_ns(const struct timespec *ts){
+  return (int64_t)ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+static void ns_to_ts(int64_t ns, struct timespec *ts){
+  ts->tv_sec = ns / NSEC_PER_SEC;
+  ts->tv_nsec = ns % NSEC_PER_SEC;
+}
+
+void pacer_init(struct pacer_t *p, int64_t max_lag_ns){
+  clock_gettime(CLOCK_MONOTONIC, &p->start);
+  p->deadline = p->start;
+  p->media_ns = 0;
+  p->max_lag_ns = max_lag_ns;
+  p->ticks = 0;
+  p->late_ticks = 0;
+  p->resyncs = 0;
+  p->lateness_ns = 0;
+  p->max_lateness_ns = 0;
+  p->drift_ns = 0;
+  return;
+}
+
+// start pacing again from now after a pause, keeping the counters
+
+void pacer_resume(struct pacer_t *p){
+  clock_gettime(CLOCK_MONOTONIC, &p->start);
+  p->deadline = p->start;
+  p->media_ns = 0;
+  p->drift_ns = 0;
+  return;
+}
+
+// account for a tick the scheduler ran at now; a late tick fires
+// immediately so the stream catches up, unless it is so late that the
+// backlog is dropped
+
+void pacer_tick(struct pacer_t *p, const struct timespec *now){
+  int64_t now_ns, deadline_ns;
+
+  now_ns = ts_to_ns(now);
+  deadline_ns = ts_to_ns(&p->deadline);
+
+  p->ticks++;
+  p->lateness_ns = now_ns - deadline_ns;
+  if (p->lateness_ns > PACER_LATE_NS){
+    p->late_ticks++;
+  }
+  if (p->lateness_ns > p->max_lateness_ns){
+    p->max_lateness_ns = p->lateness_ns;
+  }
+  if (p->lateness_ns > p->max_lag_ns){
+
+    // the dropped backlog is skipped, not played late, so it doesn't
+    // count as drift either
+
+    p->resyncs++;
+    p->deadline = *now;
+    ns_to_ts(ts_to_ns(&p->start) + p->lateness_ns, &p->start);
+  }
+  p->drift_ns = now_ns - ts_to_ns(&p->start) - p->media_ns;
+  return;
+}
+
+// move the deadline on by the playback time of what was just sent
+
+void pacer_advance(struct pacer_t *p, int64_t ns){
+  p->media_ns += ns;
+  ns_to_ts(ts_to_ns(&p->deadline) + ns, &p->deadline);
+  return;
+}
+
+// playback time of len bytes at byte_rate bytes per second
+
+int64_t pacer_bytes_ns(size_t len, long byte_rate){
+  return (int64_t)len * NSEC_PER_SEC / byte_rate;
+}
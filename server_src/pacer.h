@@ -0,0 +1,38 @@
+#ifndef _PACER_H
+#define _PACER_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define NSEC_PER_SEC 1000000000L
+
+#define DEFAULT_BYTE_RATE 16384         // 1024 bytes every 62.5 ms
+#define PACER_MAX_LAG_NS 500000000L     // give up catching up past this
+#define PACER_LATE_NS 1000000L          // wakeup slack still counted on time
+
+// absolute-deadline pacing for one station: deadlines advance by the
+// nominal duration of whatever was sent, never by how long sending took
+
+struct pacer_t {
+  struct timespec start;     // of the first tick, plus resync skips
+  struct timespec deadline;  // CLOCK_MONOTONIC time of the next tick
+  int64_t media_ns;          // nominal stream time scheduled so far
+  int64_t max_lag_ns;
+
+  // written only by the worker running the tick; readers get a best-effort view
+  uint64_t ticks;
+  uint64_t late_ticks;       // ticks that woke PACER_LATE_NS past deadline
+  uint64_t resyncs;          // times the backlog exceeded max_lag_ns
+  int64_t lateness_ns;       // of the latest tick
+  int64_t max_lateness_ns;
+  int64_t drift_ns;          // elapsed wall time minus media_ns
+};
+
+int64_t ts_to_ns(const struct timespec *);
+void pacer_init(struct pacer_t *, int64_t);
+void pacer_resume(struct pacer_t *);
+void pacer_tick(struct pacer_t *, const struct timespec *);
+void pacer_advance(struct pacer_t *, int64_t);
+int64_t pacer_bytes_ns(size_t, long);
+
+#endif
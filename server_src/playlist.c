@@ -0,0 +1,490 @@
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "misc.h"
+#include "log.h"
+#include "playlist.h"
+#include "station.h"
+
+extern struct ses_t ses;
+
+// stations waiting for their next track to be opened, and the hand-over of
+// the result; a station's prefetch_state, next_media and next_track are
+// only touched under prefetch_lock
+
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+static struct station_t *queue_head, *queue_tail;
+
+static int has_suffix(const char *s, const char *suffix){
+  size_t len, suffix_len;
+
+  len = strlen(s);
+  suffix_len = strlen(suffix);
+  return len >= suffix_len && strcasecmp(s + len - suffix_len, suffix) == 0;
+}
+
+// "dir/name", or name itself if it is absolute or dir is empty
+
+static char *join_path(const char *dir, size_t dir_len, const char *name){
+  char *path;
+
+  if (name[0] == '/' || dir_len == 0){
+    path = strdup(name);
+  }
+  else if (asprintf(&path, "%.*s/%s", (int)dir_len, dir, name) == -1){
+    path = NULL;
+  }
+  if (path == NULL){
+    perror("malloc()");
+    exit(-1);
+  }
+  return path;
+}
+
+static int append(char ***tracks, int *num, int *size, char *path){
+  void *p;
+
+  if (*num == *size){
+    *size = *size ? *size * 2 : 16;
+    p = realloc(*tracks, *size * sizeof(**tracks));
+    if (p == NULL){
+      perror("realloc()");
+      exit(-1);
+    }
+    *tracks = p;
+  }
+  (*tracks)[(*num)++] = path;
+  return 0;
+}
+
+// what a directory's tracks are told apart from its cover art, playlists
+// and notes by
+
+static int is_audio(const char *name){
+  return has_suffix(name, ".mp3") || has_suffix(name, ".mp2") ||
+         has_suffix(name, ".mpa");
+}
+
+static int load_dir(const char *dir, char ***tracks){
+  int i, n, num, size;
+  char *path;
+  struct dirent **names;
+  struct stat st;
+
+  n = scandir(dir, &names, NULL, alphasort);
+  if (n == -1){
+    log_error("%s: %m", dir);
+    return -1;
+  }
+  num = 0;
+  size = 0;
+  for (i=0; i<n; i++){
+    path = join_path(dir, strlen(dir), names[i]->d_name);
+    if (names[i]->d_name[0] != '.' && is_audio(names[i]->d_name) &&
+        stat(path, &st) == 0 &&
+        S_ISREG(st.st_mode) && st.st_size > 0){
+      append(tracks, &num, &size, path);
+    }
+    else {
+      free(path);
+    }
+    free(names[i]);
+  }
+  free(names);
+  return num;
+}
+
+// one path per line, relative to the playlist's directory; blank lines
+// and #comments (#EXTM3U, #EXTINF, ...) are skipped
+
+static int load_m3u(const char *list, char ***tracks){
+  int num, size;
+  char *line, *end, *slash;
+  size_t line_size;
+  FILE *f;
+
+  f = fopen(list, "r");
+  if (f == NULL){
+    log_error("%s: %m", list);
+    return -1;
+  }
+  slash = strrchr(list, '/');
+  line = NULL;
+  line_size = 0;
+  num = 0;
+  size = 0;
+  while (getline(&line, &line_size, f) != -1){
+    end = line + strcspn(line, "\r\n");
+    *end = '\0';
+    if (line[0] == '\0' || line[0] == '#'){
+      continue;
+    }
+    append(tracks, &num, &size,
+           join_path(list, slash != NULL ? (size_t)(slash - list) : 0, line));
+  }
+  free(line);
+  fclose(f);
+  return num;
+}
+
+// the tracks path stands for, in play order; returns how many, or -1
+
+int playlist_load(const char *path, char ***tracks){
+  struct stat st;
+
+  *tracks = NULL;
+  if (stat(path, &st) == -1){
+    log_error("%s: %m", path);
+    return -1;
+  }
+  if (S_ISDIR(st.st_mode)){
+    return load_dir(path, tracks);
+  }
+  if (has_suffix(path, ".m3u") || has_suffix(path, ".m3u8")){
+    return load_m3u(path, tracks);
+  }
+  *tracks = (char **)malloc(sizeof(**tracks));
+  if (*tracks == NULL){
+    perror("malloc()");
+    exit(-1);
+  }
+  (*tracks)[0] = join_path("", 0, path);
+  return 1;
+}
+
+void playlist_free(char **tracks, int num){
+  int i;
+
+  for (i=0; i<num; i++){
+    free(tracks[i]);
+  }
+  free(tracks);
+  return;
+}
+
+// open the first track after track from that opens at all (coming back
+// round to from itself if nothing else does). A cancelled prefetch may
+// still be in here when the station's tracks are replaced, so each path
+// is copied out under the station set's read lock.
+
+static struct song_t *open_after(struct station_t *station, int from,
+                                 int *track){
+  int i, num_tracks;
+  char *path;
+  struct song_t *song;
+
+  for (i=1; ; i++){
+    path = NULL;
+    stations_read_lock();
+    num_tracks = station->num_tracks;
+    if (i <= num_tracks){
+      *track = (from + i) % num_tracks;
+      path = strdup(station->tracks[*track]);
+    }
+    stations_read_unlock();
+    if (path == NULL){
+      return NULL;
+    }
+    song = song_open(path, ses.song_flags);
+    if (song != NULL){
+      free(path);
+      return song;
+    }
+    log_warn("station %d: skipping %s", station->id, path);
+    free(path);
+  }
+}
+
+// open the track after the current one, and have the kernel start reading
+// its first PLAYLIST_WARM_NS
+
+static struct song_t *open_next(struct station_t *station, int *track){
+  size_t warm;
+  int64_t song_ns;
+  struct song_t *song;
+
+  song = open_after(station, station->track, track);
+  if (song == NULL){
+    return NULL;
+  }
+
+  song_ns = station_song_ns(station, song);
+  warm = song->size;
+  if (song_ns > PLAYLIST_WARM_NS){
+    warm = (double)song->size * PLAYLIST_WARM_NS / song_ns;
+  }
+  (void) madvise((void *)song->data, warm, MADV_WILLNEED);
+  return song;
+}
+
+// open the track a parked station would be playing *pos_ns into the one
+// it was parked in, going round the playlist as often as it takes, and
+// leave *pos_ns as the position within it
+
+static struct song_t *open_at(struct station_t *station, int *track,
+                              int64_t *pos_ns){
+  int seen;
+  int64_t song_ns, cycle_ns;
+  char *path;
+  struct song_t *song;
+
+  // the tracks can be replaced meanwhile, as in open_after()
+
+  path = NULL;
+  stations_read_lock();
+  *track = station->track;
+  if (*track < station->num_tracks){
+    path = strdup(station->tracks[*track]);
+  }
+  stations_read_unlock();
+  song = NULL;
+  if (path != NULL){
+    song = song_open(path, ses.song_flags);
+    free(path);
+  }
+  if (song == NULL){
+    song = open_after(station, *track, track);
+  }
+  seen = 0;
+  cycle_ns = 0;
+  while (song != NULL){
+    song_ns = station_song_ns(station, song);
+    if (*pos_ns < song_ns || *pos_ns == 0){
+      break;
+    }
+    *pos_ns -= song_ns;
+    cycle_ns += song_ns;
+
+    // once every track has been through, whole laps of the playlist can
+    // be skipped at once
+
+    if (++seen == station->num_tracks){
+      *pos_ns = cycle_ns > 0 ? *pos_ns % cycle_ns : 0;
+    }
+    song_close(song);
+    song = open_after(station, *track, track);
+  }
+  return song;
+}
+
+// the track and position a woken station resumes at; a replacement handed
+// over while it was parked is started from the top by station_resume()
+// instead
+
+static void resume(struct station_t *station){
+  int track;
+  int64_t pos_ns;
+  struct timespec now;
+  struct song_t *song;
+
+  song = NULL;
+  track = station->track;
+  pos_ns = 0;
+  if (__atomic_load_n(&station->swap, __ATOMIC_ACQUIRE) == NULL){
+    if (!ses.resume_at_start){
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      pos_ns = station->parked_pos_ns + ts_to_ns(&now) - station->parked_ns;
+    }
+    song = open_at(station, &track, &pos_ns);
+  }
+  station_resume(station, song, track, pos_ns);
+  return;
+}
+
+static void request(struct station_t *station, int state){
+  station->prefetch_state = state;
+  station->prefetch_next = NULL;
+  if (queue_tail != NULL){
+    queue_tail->prefetch_next = station;
+  }
+  else {
+    queue_head = station;
+  }
+  queue_tail = station;
+  pthread_cond_signal(&prefetch_cond);
+  return;
+}
+
+static void *prefetch_loop(void *arg){
+  int track, stop;
+  struct station_t *station;
+  struct song_t *song;
+
+  (void) arg;
+  pthread_mutex_lock(&prefetch_lock);
+  while (1){
+    while (queue_head == NULL){
+      pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+    }
+    station = queue_head;
+    queue_head = station->prefetch_next;
+    if (queue_head == NULL){
+      queue_tail = NULL;
+    }
+
+    // a woken station is handed straight back to the scheduler
+
+    if (station->prefetch_state == PREFETCH_RESUMING){
+      station->prefetch_state = PREFETCH_IDLE;
+      station->prefetch_cancel = 0;
+      pthread_mutex_unlock(&prefetch_lock);
+      resume(station);
+      pthread_mutex_lock(&prefetch_lock);
+      continue;
+    }
+
+    song = NULL;
+    if (!station->prefetch_cancel){
+      pthread_mutex_unlock(&prefetch_lock);
+      song = open_next(station, &track);
+      pthread_mutex_lock(&prefetch_lock);
+    }
+
+    // nobody wants a cancelled prefetch's track; a join that woke the
+    // station meanwhile gets it resumed now, and a removed station's slot
+    // is given up now that this thread is done with it
+
+    if (station->prefetch_cancel){
+      stop = station->prefetch_stop;
+      station->prefetch_cancel = 0;
+      station->prefetch_stop = 0;
+      if (station->prefetch_state == PREFETCH_RESUMING && !stop){
+        request(station, PREFETCH_RESUMING);
+      }
+      else {
+        station->prefetch_state = PREFETCH_IDLE;
+      }
+      pthread_mutex_unlock(&prefetch_lock);
+      if (song != NULL){
+        song_close(song);
+      }
+      if (stop){
+        station_free(station);
+      }
+      pthread_mutex_lock(&prefetch_lock);
+      continue;
+    }
+    station->next_media = song;
+    station->next_track = track;
+    station->prefetch_state = PREFETCH_READY;
+  }
+
+  return NULL;
+}
+
+void create_prefetch_thread(void){
+  int ret;
+  pthread_t t_prefetch;
+
+  ret = pthread_create(&t_prefetch, NULL, prefetch_loop, NULL);
+  if (ret != 0){
+    perror("pthread_create()");
+    exit(-1);
+  }
+  pthread_detach(t_prefetch);
+  return;
+}
+
+// have the station's next track opened in the background
+
+void playlist_prefetch(struct station_t *station){
+  pthread_mutex_lock(&prefetch_lock);
+  if (station->prefetch_state == PREFETCH_IDLE){
+    request(station, PREFETCH_REQUESTED);
+  }
+  pthread_mutex_unlock(&prefetch_lock);
+  return;
+}
+
+// the station's next track, if the prefetch has opened it: returns 1 with
+// the track in *song (NULL if none would open) and its number in *track,
+// or 0 if it isn't open yet, asking for it if nobody has. It never waits,
+// so the prefetch thread being busy with other stations can't hold up a
+// tick.
+
+int playlist_poll(struct station_t *station, struct song_t **song,
+                  int *track){
+  int ready;
+
+  pthread_mutex_lock(&prefetch_lock);
+  if (station->prefetch_state == PREFETCH_IDLE){
+    request(station, PREFETCH_REQUESTED);
+  }
+  ready = station->prefetch_state == PREFETCH_READY;
+  if (ready){
+    station->prefetch_state = PREFETCH_IDLE;
+    *song = station->next_media;
+    *track = station->next_track;
+    station->next_media = NULL;
+  }
+  pthread_mutex_unlock(&prefetch_lock);
+  return ready;
+}
+
+// let go of the station's prefetch: an opened track is closed now, and one
+// still being opened by the prefetch thread once it is. With stop, the
+// station has been torn down and its slot is given up by station_free(),
+// here if the prefetch thread has nothing of it or by that thread once it
+// is done with it; nobody waits on the prefetch thread either way, so a
+// slow disk can't hold up the scheduler worker stopping the station.
+
+void playlist_cancel(struct station_t *station, int stop){
+  struct song_t *song;
+
+  song = NULL;
+  pthread_mutex_lock(&prefetch_lock);
+  if (station->prefetch_state == PREFETCH_READY){
+    song = station->next_media;
+    station->next_media = NULL;
+    station->prefetch_state = PREFETCH_IDLE;
+  }
+  else if (station->prefetch_state == PREFETCH_REQUESTED){
+    station->prefetch_cancel = 1;
+    station->prefetch_stop = stop;
+    stop = 0;
+  }
+  pthread_mutex_unlock(&prefetch_lock);
+  if (song != NULL){
+    song_close(song);
+  }
+  if (stop){
+    station_free(station);
+  }
+  return;
+}
+
+// clear a freshly started station's hand-over; its slot was only given up
+// once the prefetch thread was done with it
+
+void playlist_reset(struct station_t *station){
+  pthread_mutex_lock(&prefetch_lock);
+  station->prefetch_state = PREFETCH_IDLE;
+  station->prefetch_cancel = 0;
+  station->prefetch_stop = 0;
+  station->next_media = NULL;
+  pthread_mutex_unlock(&prefetch_lock);
+  return;
+}
+
+// have a woken station's track opened, at the position it resumes from,
+// and the station put back on the scheduler; the caller has just moved it
+// from STATION_PARKED to STATION_WAKING. A prefetch cancelled when it
+// parked may still be being opened, and then the resume follows it.
+
+void playlist_resume(struct station_t *station){
+  pthread_mutex_lock(&prefetch_lock);
+  if (station->prefetch_state == PREFETCH_REQUESTED){
+    station->prefetch_state = PREFETCH_RESUMING;
+  }
+  else {
+    request(station, PREFETCH_RESUMING);
+  }
+  pthread_mutex_unlock(&prefetch_lock);
+  return;
+}
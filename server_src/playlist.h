@@ -0,0 +1,34 @@
+#ifndef _PLAYLIST_H
+#define _PLAYLIST_H
+
+#include "pacer.h"
+#include "songstore.h"
+
+#define PLAYLIST_LEAD_NS (10 * NSEC_PER_SEC) // open the next track this early
+#define PLAYLIST_WARM_NS (5 * NSEC_PER_SEC)  // of it to read ahead
+
+#define PREFETCH_IDLE 0
+#define PREFETCH_REQUESTED 1
+#define PREFETCH_READY 2
+#define PREFETCH_RESUMING 3 // opening a woken station's track
+
+struct station_t;
+
+// a station plays a list of tracks: every MPEG audio file in a directory,
+// in name order, the entries of an .m3u playlist, or a single file. The
+// next track is opened and its start read ahead by a background thread
+// before the current one ends, so the tick at a track boundary never
+// waits on the disk; if it isn't open in time, the station plays on and
+// changes track as soon as it is. The same thread opens a parked
+// station's track when a join wakes it.
+
+int playlist_load(const char *, char ***);
+void playlist_free(char **, int);
+void create_prefetch_thread(void);
+void playlist_prefetch(struct station_t *);
+int playlist_poll(struct station_t *, struct song_t **, int *);
+void playlist_cancel(struct station_t *, int);
+void playlist_reset(struct station_t *);
+void playlist_resume(struct station_t *);
+
+#endif
@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "registry.h"
+
+static void snapshot_free(struct snapshot_t *snap){
+  fanout_destroy(&snap->fanout);
+  fanout_destroy(&snap->parity);
+  free(snap);
+  return;
+}
+
+// free every retired snapshot, provided no reader is inside one; the caller
+// holds the station lock. A reader that arrives after the last swap can only
+// have seen the current snapshot, so readers == 0 is enough.
+
+void registry_reclaim(struct registry_t *reg){
+  struct snapshot_t *snap;
+
+  if (reg->retired == NULL ||
+      __atomic_load_n(&reg->readers, __ATOMIC_SEQ_CST) != 0){
+    return;
+  }
+  while (reg->retired != NULL){
+    snap = reg->retired;
+    reg->retired = snap->next;
+    snapshot_free(snap);
+  }
+  return;
+}
+
+// copy the live subscriber set into a fresh snapshot and swap it in, if it
+// changed since the last one; the caller holds the station lock. Returns
+// -1, keeping the old snapshot and the change pending, if there is no
+// memory for the new one.
+
+int registry_publish(struct registry_t *reg){
+  int i;
+  struct snapshot_t *snap;
+
+  if (!reg->dirty){
+    return 0;
+  }
+  snap = (struct snapshot_t *)malloc(sizeof(struct snapshot_t));
+  if (snap == NULL){
+    return -1;
+  }
+  fanout_init(&snap->fanout);
+  fanout_init(&snap->parity);
+  if (fanout_reserve(&snap->fanout, reg->num + 1) == -1){
+    snapshot_free(snap);
+    return -1;
+  }
+  for (i=0; i<reg->num; i++){
+    if (!(reg->sub[i].mode & (SUB_MULTICAST | SUB_BURSTING))){
+      fanout_add(&snap->fanout, reg->sub[i].ip, reg->sub[i].udp_port,
+                 reg->sub[i].mode & SUB_FRAMED);
+      if (reg->sub[i].mode & SUB_FEC &&
+          fanout_add(&snap->parity, reg->sub[i].ip, reg->sub[i].udp_port,
+                     1) == -1){
+        snapshot_free(snap);
+        return -1;
+      }
+    }
+  }
+
+  // one datagram per tick reaches every multicast listener; the group
+  // stream is always raw
+
+  if (reg->num_multicast > 0){
+    fanout_add(&snap->fanout, reg->group_ip, reg->group_port, 0);
+  }
+
+  snap = __atomic_exchange_n(&reg->snap, snap, __ATOMIC_SEQ_CST);
+  if (snap != NULL){
+    snap->next = reg->retired;
+    reg->retired = snap;
+  }
+  __atomic_store_n(&reg->dirty, 0, __ATOMIC_RELAXED);
+  registry_reclaim(reg);
+  return 0;
+}
+
+void registry_init(struct registry_t *reg){
+  memset(reg, 0, sizeof(*reg));
+  reg->free_handle = -1;
+  reg->dirty = 1;
+  if (registry_publish(reg) == -1){
+    perror("malloc()");
+    exit(-1);
+  }
+  return;
+}
+
+// only once no station thread or reader is left
+
+void registry_destroy(struct registry_t *reg){
+  registry_reclaim(reg);
+  if (reg->snap != NULL){
+    snapshot_free(reg->snap);
+  }
+  free(reg->sub);
+  free(reg->index);
+  free(reg->burst);
+  memset(reg, 0, sizeof(*reg));
+  reg->free_handle = -1;
+  return;
+}
+
+// send multicast subscribers to ip:port from now on; set before any join
+
+void registry_set_group(struct registry_t *reg, uint32_t ip, uint16_t port){
+  reg->group_ip = ip;
+  reg->group_port = port;
+  return;
+}
+
+// enter the current snapshot; it stays valid until snapshot_release()
+
+struct snapshot_t *snapshot_acquire(struct registry_t *reg){
+  __atomic_add_fetch(&reg->readers, 1, __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&reg->snap, __ATOMIC_SEQ_CST);
+}
+
+// leave the snapshot, and free retired ones if the lock happens to be free
+
+void snapshot_release(struct registry_t *reg, pthread_mutex_t *lock){
+  __atomic_sub_fetch(&reg->readers, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&reg->retired, __ATOMIC_RELAXED) != NULL &&
+      pthread_mutex_trylock(lock) == 0){
+    registry_reclaim(reg);
+    pthread_mutex_unlock(lock);
+  }
+  return;
+}
+
+// pop a free handle, growing the handle table if none is left
+
+static int alloc_handle(struct registry_t *reg){
+  int i, handle, num_handles;
+  void *p;
+
+  if (reg->free_handle == -1){
+    num_handles = reg->num_handles ? reg->num_handles * 2 :
+                                     REGISTRY_INITIAL_SIZE;
+    p = realloc(reg->index, num_handles * sizeof(*reg->index));
+    if (p == NULL){
+      return -1;
+    }
+    reg->index = p;
+    for (i=reg->num_handles; i<num_handles; i++){
+      reg->index[i] = i + 1 < num_handles ? i + 1 : -1;
+    }
+    reg->free_handle = reg->num_handles;
+    reg->num_handles = num_handles;
+  }
+  handle = reg->free_handle;
+  reg->free_handle = reg->index[handle];
+  return handle;
+}
+
+// add a subscriber with SUB_* mode bits in O(1) amortized; returns its
+// handle, or -1. It is in the snapshot from the next registry_publish().
+// A multicast subscriber needs a group set, and a bursting one its
+// burst_next.
+
+int registry_add(struct registry_t *reg, struct conn_t *conn, uint32_t ip,
+                 uint16_t udp_port, int mode){
+  int handle, size;
+  void *p;
+
+  if (mode & SUB_BURSTING && reg->num_burst == reg->burst_size){
+    size = reg->burst_size ? reg->burst_size * 2 : REGISTRY_INITIAL_SIZE;
+    p = realloc(reg->burst, size * sizeof(*reg->burst));
+    if (p == NULL){
+      return -1;
+    }
+    reg->burst = p;
+    reg->burst_size = size;
+  }
+
+  if (reg->num == reg->size){
+    size = reg->size ? reg->size * 2 : REGISTRY_INITIAL_SIZE;
+    p = realloc(reg->sub, size * sizeof(*reg->sub));
+    if (p == NULL){
+      return -1;
+    }
+    reg->sub = p;
+    reg->size = size;
+  }
+  handle = alloc_handle(reg);
+  if (handle == -1){
+    return -1;
+  }
+  reg->index[handle] = reg->num;
+  reg->sub[reg->num].flags = 0;
+  reg->sub[reg->num].conn = conn;
+  reg->sub[reg->num].ip = ip;
+  reg->sub[reg->num].udp_port = udp_port;
+  reg->sub[reg->num].handle = handle;
+  reg->sub[reg->num].mode = mode;
+  reg->sub[reg->num].burst_next = 0;
+  reg->sub[reg->num].burst_pos = -1;
+  if (mode & SUB_BURSTING){
+    reg->sub[reg->num].burst_pos = reg->num_burst;
+    reg->burst[reg->num_burst] = handle;
+    __atomic_store_n(&reg->num_burst, reg->num_burst + 1, __ATOMIC_RELEASE);
+  }
+  else if (mode & SUB_MULTICAST){
+    reg->num_multicast++;
+  }
+  reg->num++;
+  __atomic_store_n(&reg->dirty, 1, __ATOMIC_RELEASE);
+  return handle;
+}
+
+// take sub[i] off the burst list, moving the last entry into its place
+
+static void drop_burst(struct registry_t *reg, int i){
+  int pos, last;
+
+  pos = reg->sub[i].burst_pos;
+  last = reg->num_burst - 1;
+  if (pos != last){
+    reg->burst[pos] = reg->burst[last];
+    registry_get(reg, reg->burst[pos])->burst_pos = pos;
+  }
+  __atomic_store_n(&reg->num_burst, last, __ATOMIC_RELEASE);
+  reg->sub[i].burst_pos = -1;
+  return;
+}
+
+// remove a subscriber in O(1) by moving the last one into its place; it
+// is out of the snapshot from the next registry_publish()
+
+void registry_remove(struct registry_t *reg, int handle){
+  int i, last;
+  void *p;
+
+  i = reg->index[handle];
+  if (reg->sub[i].mode & SUB_BURSTING){
+    drop_burst(reg, i);
+  }
+  else if (reg->sub[i].mode & SUB_MULTICAST){
+    reg->num_multicast--;
+  }
+  last = --reg->num;
+  if (i != last){
+    reg->sub[i] = reg->sub[last];
+    reg->index[reg->sub[i].handle] = i;
+  }
+  reg->index[handle] = reg->free_handle;
+  reg->free_handle = handle;
+
+  // give memory back once the set is mostly empty
+
+  if (reg->size > REGISTRY_INITIAL_SIZE && reg->num < reg->size / 4){
+    p = realloc(reg->sub, reg->size / 2 * sizeof(*reg->sub));
+    if (p != NULL){
+      reg->sub = p;
+      reg->size /= 2;
+    }
+  }
+  __atomic_store_n(&reg->dirty, 1, __ATOMIC_RELEASE);
+  return;
+}
+
+// drop every subscriber at once, for a station being removed or parked,
+// and publish right away, since no tick may come to do it; the caller
+// holds the station lock. Returns the array they were in, *num long, for
+// the caller to free once done with them; the registry starts a new one
+// at the next registry_add().
+
+struct subscriber_t *registry_clear(struct registry_t *reg, int *num){
+  int i;
+  struct subscriber_t *sub;
+
+  for (i=0; i<reg->num; i++){
+    reg->index[reg->sub[i].handle] = reg->free_handle;
+    reg->free_handle = reg->sub[i].handle;
+  }
+  sub = reg->sub;
+  *num = reg->num;
+  reg->sub = NULL;
+  reg->size = 0;
+  reg->num = 0;
+  reg->num_multicast = 0;
+  __atomic_store_n(&reg->num_burst, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&reg->dirty, 1, __ATOMIC_RELEASE);
+  (void) registry_publish(reg);
+  return sub;
+}
+
+struct subscriber_t *registry_get(struct registry_t *reg, int handle){
+  return &reg->sub[reg->index[handle]];
+}
+
+// a bursting subscriber has caught up: it goes live with the next
+// registry_publish()
+
+void registry_end_burst(struct registry_t *reg, int handle){
+  int i;
+
+  i = reg->index[handle];
+  drop_burst(reg, i);
+  reg->sub[i].mode &= ~SUB_BURSTING;
+  if (reg->sub[i].mode & SUB_MULTICAST){
+    reg->num_multicast++;
+  }
+  __atomic_store_n(&reg->dirty, 1, __ATOMIC_RELEASE);
+  return;
+}
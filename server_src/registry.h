@@ -0,0 +1,83 @@
+#ifndef _REGISTRY_H
+#define _REGISTRY_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "fanout.h"
+
+#define REGISTRY_INITIAL_SIZE 16
+
+#define SUB_MULTICAST 1 // reached through the station's group, not udp_port
+#define SUB_BURSTING 2  // still catching up from history, not yet live
+#define SUB_FRAMED 4    // gets a frame header in front of every datagram
+#define SUB_FEC 8       // and parity datagrams after each group of them
+
+struct conn_t;
+
+// one listener of a station
+
+struct subscriber_t {
+  int flags;           // CLIENT_* flags
+  struct conn_t *conn; // valid while the station lock is held
+  uint32_t ip;         // host order
+  uint16_t udp_port;   // host order
+  int handle;          // the subscriber's stable handle
+  int mode;            // SUB_* bits
+  uint64_t burst_next; // next history tick to send while SUB_BURSTING
+  int burst_pos;       // position in the registry's burst list
+};
+
+// immutable copy of a station's destinations for the fan-out path; only
+// the reader touches the fanout's iov, status and msg_len scratch fields
+
+struct snapshot_t {
+  struct fanout_t fanout;
+  struct fanout_t parity;  // the SUB_FEC ones among them again
+  struct snapshot_t *next; // on the retired list
+};
+
+// growable subscriber set of one station, changed under the station lock;
+// sub[0..num) is dense while handles stay valid until removed. Changes
+// only mark it dirty, and the station's next tick publishes them all in a
+// new snapshot, which readers use without the lock, so a burst of joins
+// costs one copy of the list. Multicast subscribers share a single
+// snapshot entry for the group, and bursting ones are left out until they
+// have caught up.
+
+struct registry_t {
+  int num;
+  int size;
+  struct subscriber_t *sub;
+  int *index;        // handle -> position in sub, or next free handle
+  int num_handles;
+  int free_handle;   // head of the free handle list, or -1
+
+  struct snapshot_t *snap;    // current snapshot, swapped atomically
+  struct snapshot_t *retired; // replaced snapshots readers may still use
+  int readers;                // readers currently inside a snapshot
+  int dirty;                  // changed since the snapshot was taken
+
+  uint32_t group_ip;          // multicast group (host order), or 0
+  uint16_t group_port;
+  int num_multicast;          // live subscribers listening on the group
+
+  int *burst;                 // handles of SUB_BURSTING subscribers
+  int num_burst;
+  int burst_size;
+};
+
+void registry_init(struct registry_t *);
+void registry_destroy(struct registry_t *);
+void registry_set_group(struct registry_t *, uint32_t, uint16_t);
+int registry_add(struct registry_t *, struct conn_t *, uint32_t, uint16_t,
+                 int);
+void registry_remove(struct registry_t *, int);
+struct subscriber_t *registry_clear(struct registry_t *, int *);
+void registry_end_burst(struct registry_t *, int);
+int registry_publish(struct registry_t *);
+struct subscriber_t *registry_get(struct registry_t *, int);
+void registry_reclaim(struct registry_t *);
+struct snapshot_t *snapshot_acquire(struct registry_t *);
+void snapshot_release(struct registry_t *, pthread_mutex_t *);
+
+#endif
@@ -0,0 +1,229 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "scheduler.h"
+#include "station.h"
+#include "fanout.h"
+#include "netio.h"
+#include "pacer.h"
+#include "shard.h"
+#include "stats.h"
+
+// every station's next tick, in one min-heap on the deadline shared by all
+// workers; a station is either in the heap or being ticked by one worker
+
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond;
+static struct sched_entry_t *heap;
+static int heap_num, heap_size;
+
+static void heap_push(struct station_t *station){
+  int i, parent;
+  struct sched_entry_t e;
+
+  if (heap_num == heap_size){
+    heap_size = heap_size ? heap_size * 2 : SCHED_INITIAL_SIZE;
+    heap = realloc(heap, heap_size * sizeof(*heap));
+    if (heap == NULL){
+      perror("realloc()");
+      exit(-1);
+    }
+  }
+  e.deadline_ns = ts_to_ns(&station->pacer.deadline);
+  e.station = station;
+
+  for (i=heap_num++; i>0; i=parent){
+    parent = (i - 1) / 2;
+    if (heap[parent].deadline_ns <= e.deadline_ns){
+      break;
+    }
+    heap[i] = heap[parent];
+  }
+  heap[i] = e;
+  return;
+}
+
+static struct station_t *heap_pop(void){
+  int i, child;
+  struct sched_entry_t last;
+  struct station_t *station;
+
+  station = heap[0].station;
+  last = heap[--heap_num];
+  for (i=0; (child = 2 * i + 1) < heap_num; i=child){
+    if (child + 1 < heap_num &&
+        heap[child + 1].deadline_ns < heap[child].deadline_ns){
+      child++;
+    }
+    if (last.deadline_ns <= heap[child].deadline_ns){
+      break;
+    }
+    heap[i] = heap[child];
+  }
+  heap[i] = last;
+  return station;
+}
+
+// start pacing station from now
+
+void sched_add(struct station_t *station){
+  pacer_resume(&station->pacer);
+  pthread_mutex_lock(&sched_lock);
+  heap_push(station);
+  pthread_cond_signal(&sched_cond);
+  pthread_mutex_unlock(&sched_lock);
+  return;
+}
+
+// sleep until the earliest deadline, take every station due within
+// SCHED_WINDOW_NS of it, and send all of their chunks together
+
+static void *sched_loop(void *arg){
+  int i, n, m, num_fo, num_dests, s_udp;
+  int failed[SCHED_MAX_BATCH], batch_failed[SCHED_MAX_BATCH];
+  int batch_of[SCHED_MAX_BATCH];
+  int64_t now_ns, batch_ns;
+  int64_t send_ns[SCHED_MAX_BATCH];
+  struct timespec now, deadline, start, sent, end;
+  struct station_t *due[SCHED_MAX_BATCH];
+  struct fanout_t *fo[SCHED_MAX_BATCH], *batch[SCHED_MAX_BATCH];
+  struct netio_t *io;
+  struct thread_stats_t *stats;
+
+  s_udp = station_udp_socket();
+  io = netio_create(s_udp);
+  if (io == NULL){
+    fprintf(stderr, "can't set up the %s I/O backend\n", netio_backend());
+    exit(-1);
+  }
+  stats = stats_register_thread("sched", (int)(intptr_t)arg);
+
+  pthread_mutex_lock(&sched_lock);
+  while (1){
+    if (heap_num == 0){
+      pthread_cond_wait(&sched_cond, &sched_lock);
+      continue;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    now_ns = ts_to_ns(&now);
+    if (heap[0].deadline_ns > now_ns){
+      deadline.tv_sec = heap[0].deadline_ns / NSEC_PER_SEC;
+      deadline.tv_nsec = heap[0].deadline_ns % NSEC_PER_SEC;
+      pthread_cond_timedwait(&sched_cond, &sched_lock, &deadline);
+      continue;
+    }
+
+    n = 0;
+    while (heap_num > 0 && n < SCHED_MAX_BATCH &&
+           heap[0].deadline_ns <= now_ns + SCHED_WINDOW_NS){
+      due[n++] = heap_pop();
+    }
+
+    // whatever is left may already be due too; let another worker look
+
+    if (heap_num > 0){
+      pthread_cond_signal(&sched_cond);
+    }
+    pthread_mutex_unlock(&sched_lock);
+
+    // a removed station is torn down by whichever worker takes it off the
+    // heap, and doesn't go back in
+
+    m = 0;
+    for (i=0; i<n; i++){
+      if (station_stopping(due[i])){
+        station_stop(due[i]);
+      }
+      else {
+        due[m++] = due[i];
+      }
+    }
+    n = m;
+
+    for (i=0; i<n; i++){
+      fo[i] = station_tick_start(due[i], &now);
+    }
+
+    // a hot station's tick is split across the shard threads, and timed
+    // on its own; the rest share this worker's sends
+
+    num_fo = 0;
+    num_dests = 0;
+    for (i=0; i<n; i++){
+      if (shard_wanted(fo[i])){
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        failed[i] = shard_send(io, fo[i]);
+        clock_gettime(CLOCK_MONOTONIC, &sent);
+        send_ns[i] = ts_to_ns(&sent) - ts_to_ns(&start);
+        stats_add(&due[i]->stats.sharded_ticks, 1);
+      }
+      else {
+        batch_of[num_fo] = i;
+        batch[num_fo++] = fo[i];
+        num_dests += fo[i]->num;
+      }
+    }
+
+    // the shared sends' time is split by each station's share of their
+    // destinations
+
+    if (num_fo > 0){
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      (void) netio_send(io, batch, num_fo, batch_failed);
+      clock_gettime(CLOCK_MONOTONIC, &sent);
+      batch_ns = ts_to_ns(&sent) - ts_to_ns(&start);
+      for (i=0; i<num_fo; i++){
+        failed[batch_of[i]] = batch_failed[i];
+        send_ns[batch_of[i]] = num_dests > 0 ?
+                               batch_ns * batch[i]->num / num_dests :
+                               batch_ns / num_fo;
+      }
+    }
+
+    // a station left without listeners parks, and stays out of the heap
+    // until a join wakes it
+
+    m = 0;
+    for (i=0; i<n; i++){
+      stats_hist_add(&due[i]->stats.fanout, send_ns[i]);
+      if (station_tick_end(due[i], failed[i] > 0, io, s_udp)){
+        due[m++] = due[i];
+      }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats_add(&stats->wakeups, 1);
+    stats_add(&stats->items, n);
+    __atomic_store_n(&stats->syscalls, netio_syscalls(io), __ATOMIC_RELAXED);
+    stats_hist_add(&stats->busy, ts_to_ns(&end) - now_ns);
+
+    pthread_mutex_lock(&sched_lock);
+    for (i=0; i<m; i++){
+      heap_push(due[i]);
+    }
+  }
+
+  return NULL;
+}
+
+void create_sched_workers(int n){
+  int i, ret;
+  pthread_t t_sched;
+  pthread_condattr_t attr;
+
+  // deadlines are CLOCK_MONOTONIC, so the timed waits must be too
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&sched_cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  for (i=0; i<n; i++){
+    ret = pthread_create(&t_sched, NULL, sched_loop, (void *)(intptr_t)i);
+    if (ret != 0){
+      perror("pthread_create()");
+      exit(-1);
+    }
+    pthread_detach(t_sched);
+  }
+  return;
+}
@@ -0,0 +1,23 @@
+#ifndef _SCHEDULER_H
+#define _SCHEDULER_H
+
+#include <stdint.h>
+
+#define SCHED_INITIAL_SIZE 16
+#define SCHED_WINDOW_NS 1000000L // stations due this close together tick together
+#define SCHED_MAX_BATCH 256      // stations one worker ticks at once
+
+struct station_t;
+
+// a station waiting for its next tick; keyed by its pacer deadline so the
+// heap never has to chase station pointers
+
+struct sched_entry_t {
+  int64_t deadline_ns;
+  struct station_t *station;
+};
+
+void sched_add(struct station_t *);
+void create_sched_workers(int);
+
+#endif
@@ -0,0 +1,160 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "shard.h"
+#include "pacer.h"
+#include "station.h"
+#include "stats.h"
+
+// one fan-out job runs at a time: the dispatching worker posts it by
+// bumping job_gen, the shards it needs send their slices, and the last one
+// to finish wakes the dispatcher. A shard can't miss a job it is part of,
+// since the next one is only posted after every part of this one is done.
+
+struct shard_t {
+  struct netio_t *io;
+  struct fanout_t slice;  // this shard's part of the current job
+  int failed;             // sends that failed in it
+  struct thread_stats_t *stats;
+};
+
+static struct shard_t *shards;
+static int num_shards;
+static int threshold;
+
+static pthread_mutex_t dispatch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t job_gen;
+static int job_shards;    // shards taking part in the current job
+static int remaining;     // of them still sending
+
+static void *shard_loop(void *arg){
+  int i;
+  uint64_t seen, calls;
+  struct shard_t *shard;
+  struct fanout_t *slice;
+  struct timespec start, end;
+
+  i = (int)(intptr_t)arg;
+  shard = &shards[i];
+  shard->stats = stats_register_thread("shard", i);
+  slice = &shard->slice;
+  seen = 0;
+
+  pthread_mutex_lock(&job_lock);
+  while (1){
+    while (job_gen == seen){
+      pthread_cond_wait(&job_cond, &job_lock);
+    }
+    seen = job_gen;
+    if (i >= job_shards){
+      continue;
+    }
+    pthread_mutex_unlock(&job_lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    calls = netio_syscalls(shard->io);
+    shard->failed = netio_send(shard->io, &slice, 1, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats_add(&shard->stats->wakeups, 1);
+    stats_add(&shard->stats->items, slice->num);
+    stats_add(&shard->stats->syscalls, netio_syscalls(shard->io) - calls);
+    stats_hist_add(&shard->stats->busy, ts_to_ns(&end) - ts_to_ns(&start));
+
+    pthread_mutex_lock(&job_lock);
+    if (--remaining == 0){
+      pthread_cond_signal(&done_cond);
+    }
+  }
+
+  return NULL;
+}
+
+// start n shard threads, splitting ticks to min_dests destinations or more
+
+void create_shards(int n, int min_dests){
+  int i, ret;
+  pthread_t t_shard;
+
+  shards = (struct shard_t *)calloc(n, sizeof(struct shard_t));
+  if (shards == NULL){
+    perror("calloc()");
+    exit(-1);
+  }
+  num_shards = n;
+  threshold = min_dests;
+  for (i=0; i<n; i++){
+    shards[i].io = netio_create(station_udp_socket());
+    if (shards[i].io == NULL){
+      fprintf(stderr, "can't set up the %s I/O backend\n", netio_backend());
+      exit(-1);
+    }
+  }
+  for (i=0; i<n; i++){
+    ret = pthread_create(&t_shard, NULL, shard_loop, (void *)(intptr_t)i);
+    if (ret != 0){
+      perror("pthread_create()");
+      exit(-1);
+    }
+    pthread_detach(t_shard);
+  }
+  return;
+}
+
+// whether fo is worth splitting: past the threshold, and with at least one
+// slice for a shard besides the caller's
+
+int shard_wanted(const struct fanout_t *fo){
+  return num_shards > 0 && fo->num >= threshold &&
+         fo->num >= 2 * SHARD_MIN_SLICE;
+}
+
+// send fo's tick split across the shards, the caller sending the first
+// slice through io; returns the number of failed entries, with fo's
+// status[] filled in as netio_send() would
+
+int shard_send(struct netio_t *io, struct fanout_t *fo){
+  int i, parts, off, num, failed;
+  struct fanout_t first;
+  struct fanout_t *slice;
+
+  parts = fo->num / SHARD_MIN_SLICE;
+  if (parts > num_shards + 1){
+    parts = num_shards + 1;
+  }
+
+  // every part gets num / parts entries, the first few one more
+
+  pthread_mutex_lock(&dispatch_lock);
+  off = 0;
+  for (i=0; i<parts; i++){
+    num = fo->num / parts + (i < fo->num % parts ? 1 : 0);
+    fanout_slice(i == 0 ? &first : &shards[i - 1].slice, fo, off, num);
+    off += num;
+  }
+
+  pthread_mutex_lock(&job_lock);
+  job_shards = parts - 1;
+  remaining = parts - 1;
+  job_gen++;
+  pthread_cond_broadcast(&job_cond);
+  pthread_mutex_unlock(&job_lock);
+
+  slice = &first;
+  failed = netio_send(io, &slice, 1, NULL);
+
+  pthread_mutex_lock(&job_lock);
+  while (remaining > 0){
+    pthread_cond_wait(&done_cond, &job_lock);
+  }
+  pthread_mutex_unlock(&job_lock);
+
+  for (i=0; i<parts-1; i++){
+    failed += shards[i].failed;
+  }
+  pthread_mutex_unlock(&dispatch_lock);
+  return failed;
+}
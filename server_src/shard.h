@@ -0,0 +1,21 @@
+#ifndef _SHARD_H
+#define _SHARD_H
+
+#include "fanout.h"
+#include "netio.h"
+
+#define SHARD_DEFAULT_THRESHOLD 4096 // destinations at which a tick is split
+#define SHARD_MIN_SLICE 512          // destinations worth waking a shard for
+
+// fan-out threads for hot stations. A station whose tick goes to at least
+// the threshold number of destinations has its snapshot cut into
+// contiguous slices, one per shard thread plus one for the scheduler
+// worker; each shard sends its slice through its own socket, all at once.
+// Slices are cut from the current snapshot every tick, so they rebalance
+// as listeners come and go.
+
+void create_shards(int, int);
+int shard_wanted(const struct fanout_t *);
+int shard_send(struct netio_t *, struct fanout_t *);
+
+#endif
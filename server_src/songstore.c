@@ -0,0 +1,170 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "log.h"
+#include "songstore.h"
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct song_t *store;
+
+// copy the whole file into anonymous memory, on huge pages if asked to
+
+static void *preload(int fd, size_t size, size_t *map_size, int flags){
+  void *p;
+  size_t total;
+  ssize_t ret;
+
+  p = MAP_FAILED;
+  if (flags & SONG_HUGEPAGES){
+    *map_size = (size + HUGE_PAGE_SIZE - 1) & ~((size_t)HUGE_PAGE_SIZE - 1);
+    p = mmap(NULL, *map_size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+  if (p == MAP_FAILED){
+    *map_size = size;
+    p = mmap(NULL, *map_size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED){
+      log_error("mmap(): %m");
+      return NULL;
+    }
+    if (flags & SONG_HUGEPAGES){
+      (void) madvise(p, *map_size, MADV_HUGEPAGE); // transparent fallback
+    }
+  }
+
+  total = 0;
+  while (total < size){
+    ret = pread(fd, (char *)p + total, size - total, total);
+    if (ret == -1){
+      if (errno == EINTR){
+        continue;
+      }
+      log_error("pread(): %m");
+      munmap(p, *map_size);
+      return NULL;
+    }
+    if (ret == 0){
+      break; // file shrank under us; keep what we got
+    }
+    total += ret;
+  }
+
+  if (mprotect(p, *map_size, PROT_READ) == -1){
+    log_error("mprotect(): %m");
+  }
+  return p;
+}
+
+// return the shared copy of path, loading it on first use
+
+struct song_t *song_open(const char *path, int flags){
+  int fd;
+  struct stat st;
+  struct song_t *song;
+  void *p;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1){
+    log_error("%s: %m", path);
+    return NULL;
+  }
+  if (fstat(fd, &st) == -1){
+    log_error("%s: %m", path);
+    close(fd);
+    return NULL;
+  }
+  if (st.st_size == 0){
+    log_warn("%s: file is empty", path);
+    close(fd);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&store_lock);
+
+  // stations naming the same file (by any path) share one copy
+
+  for (song=store; song!=NULL; song=song->next){
+    if (song->dev == st.st_dev && song->ino == st.st_ino){
+      song->refs++;
+      pthread_mutex_unlock(&store_lock);
+      close(fd);
+      return song;
+    }
+  }
+
+  song = (struct song_t *)malloc(sizeof(struct song_t));
+  if (song == NULL){
+    log_error("malloc(): %m");
+    goto fail;
+  }
+  song->path = strdup(path);
+  song->dev = st.st_dev;
+  song->ino = st.st_ino;
+  song->size = st.st_size;
+  song->refs = 1;
+
+  if (flags & (SONG_PRELOAD | SONG_HUGEPAGES)){
+    p = preload(fd, song->size, &song->map_size, flags);
+    if (p == NULL){
+      goto fail_free;
+    }
+  }
+  else {
+    song->map_size = song->size;
+    p = mmap(NULL, song->map_size, PROT_READ,
+             MAP_SHARED | (flags & SONG_POPULATE ? MAP_POPULATE : 0), fd, 0);
+    if (p == MAP_FAILED){
+      log_error("%s: mmap(): %m", path);
+      goto fail_free;
+    }
+    (void) madvise(p, song->map_size, MADV_SEQUENTIAL);
+  }
+  song->data = p;
+  song->timing = mp3_scan((const unsigned char *)song->data, song->size);
+
+  song->next = store;
+  store = song;
+  pthread_mutex_unlock(&store_lock);
+  close(fd);
+  return song;
+
+fail_free:
+  free(song->path);
+  free(song);
+fail:
+  pthread_mutex_unlock(&store_lock);
+  close(fd);
+  return NULL;
+}
+
+void song_close(struct song_t *song){
+  struct song_t **pp;
+
+  pthread_mutex_lock(&store_lock);
+  if (--song->refs > 0){
+    pthread_mutex_unlock(&store_lock);
+    return;
+  }
+  for (pp=&store; *pp!=NULL; pp=&(*pp)->next){
+    if (*pp == song){
+      *pp = song->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&store_lock);
+
+  mp3_free(song->timing);
+  munmap((void *)song->data, song->map_size);
+  free(song->path);
+  free(song);
+  return;
+}
@@ -0,0 +1,29 @@
+#ifndef _SONGSTORE_H
+#define _SONGSTORE_H
+
+#include <sys/types.h>
+#include "mp3.h"
+
+#define SONG_POPULATE 1  // prefault the mapping (MAP_POPULATE)
+#define SONG_PRELOAD 2   // copy into anonymous memory instead of mapping
+#define SONG_HUGEPAGES 4 // back preloaded songs with huge pages if possible
+
+// one distinct file, mapped or preloaded once and shared read-only by every
+// station playing it
+
+struct song_t {
+  char *path;
+  dev_t dev;
+  ino_t ino;
+  const char *data;
+  size_t size;
+  size_t map_size; // length passed to munmap()
+  struct mp3_timing_t *timing; // NULL unless the file is MP3
+  int refs;
+  struct song_t *next;
+};
+
+struct song_t *song_open(const char *, int);
+void song_close(struct song_t *);
+
+#endif
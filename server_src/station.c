@@ -1,160 +1,1160 @@
-#include <fcntl.h>
+#include <errno.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include "station.h"
 #include "connection.h"
+#include "scheduler.h"
+#include "shard.h"
 #include "misc.h"
+#include "playlist.h"
+#include "log.h"
 
 extern struct ses_t ses;
 
-void *station_loop(int station_no){
-  int bytes_read, i, fd, ret, s_udp, announce_new_song;
-  char buf[DATAGRAM_SIZE];
-  struct sockaddr_in client_addr;
-  struct reply_t announce;
-  client_addr.sin_family = AF_INET;
-  memset(client_addr.sin_zero, '\0', sizeof(client_addr.sin_zero));
+// take the station lock, accounting for how long we waited for it
+
+void station_lock(struct station_t *station){
+  int ret;
+  int64_t wait_ns;
+  struct timespec start;
+  struct lock_stats_t *stats;
+
+  stats = &station->lock_stats;
+  ret = pthread_mutex_trylock(&station->lock);
+  if (ret == EBUSY){
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ret = pthread_mutex_lock(&station->lock);
+    if (ret != 0){
+      perror("pthread_mutex_lock()");
+      exit(-1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stats->acquired);
+    wait_ns = ts_to_ns(&stats->acquired) - ts_to_ns(&start);
+    stats_add(&stats->contended, 1);
+    __atomic_fetch_add(&stats->wait_ns, wait_ns, __ATOMIC_RELAXED);
+    if (wait_ns > stats->max_wait_ns){
+      __atomic_store_n(&stats->max_wait_ns, wait_ns, __ATOMIC_RELAXED);
+    }
+    stats_hist_add(&station->stats.lock_wait, wait_ns);
+  }
+  else if (ret == 0){
+    clock_gettime(CLOCK_MONOTONIC, &stats->acquired);
+    stats_hist_add(&station->stats.lock_wait, 0);
+  }
+  else {
+    perror("pthread_mutex_trylock()");
+    exit(-1);
+  }
+  stats_add(&stats->acquires, 1);
+  return;
+}
 
-  fd = open(ses.station[station_no].song, O_RDONLY);
-  if (fd == -1){
-    perror("open()");
+void station_unlock(struct station_t *station){
+  int ret;
+  int64_t hold_ns;
+  struct timespec now;
+  struct lock_stats_t *stats;
+
+  stats = &station->lock_stats;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  hold_ns = ts_to_ns(&now) - ts_to_ns(&stats->acquired);
+  __atomic_fetch_add(&stats->hold_ns, hold_ns, __ATOMIC_RELAXED);
+  if (hold_ns > stats->max_hold_ns){
+    __atomic_store_n(&stats->max_hold_ns, hold_ns, __ATOMIC_RELAXED);
+  }
+  stats_hist_add(&station->stats.lock_hold, hold_ns);
+  ret = pthread_mutex_unlock(&station->lock);
+  if (ret != 0){
+    perror("pthread_mutex_unlock()");
     exit(-1);
   }
+  return;
+}
+
+// playback time of len bytes of the station's song starting at offset
+
+static int64_t chunk_ns(const struct station_t *station, size_t offset,
+                        size_t len){
+  if (station->timing != NULL){
+    return mp3_time_ns(station->timing, offset + len) -
+           mp3_time_ns(station->timing, offset);
+  }
+  return pacer_bytes_ns(len, station->byte_rate);
+}
+
+// playback time of all of song, as station paces it
+
+int64_t station_song_ns(const struct station_t *station,
+                        const struct song_t *song){
+  if (!station->fixed_rate && song->timing != NULL){
+    return mp3_time_ns(song->timing, song->size);
+  }
+  return pacer_bytes_ns(song->size, station->byte_rate);
+}
+
+// encode the ANNOUNCE of the station's current track; joining clients copy
+// it under the station lock
+
+static void set_announce(struct station_t *station){
+  size_t len;
+  struct reply_t announce;
+  char buf[sizeof(struct reply_t)];
+
+  announce.type = TYPE_REPLY_ANNOUNCE;
+  announce.announce.filename_size = strlen(station->song) > UINT8_MAX ?
+                                    UINT8_MAX : strlen(station->song);
+  memcpy(announce.announce.filename, station->song,
+         announce.announce.filename_size);
+  len = encode_reply(&announce, buf);
+
+  station_lock(station);
+  memcpy(station->announce, buf, len);
+  station->announce_len = len;
+  station_unlock(station);
+  return;
+}
+
+// start playing song, track number track of the playlist, from the top
+
+static void start_track(struct station_t *station, struct song_t *song,
+                        int track){
+  int64_t song_ns;
+  size_t lead;
+
+  station->media = song;
+  station->timing = station->fixed_rate ? NULL : song->timing;
+  __atomic_store_n(&station->track, track, __ATOMIC_RELAXED);
+  __atomic_store_n(&station->song, station->tracks[track], __ATOMIC_RELEASE);
+  set_announce(station);
+
+  // ask for the next track PLAYLIST_LEAD_NS before this one ends
+
+  song_ns = station_song_ns(station, song);
+  lead = song->size;
+  if (song_ns > PLAYLIST_LEAD_NS){
+    lead = (double)song->size * PLAYLIST_LEAD_NS / song_ns;
+  }
+  station->prefetch_at = song->size - lead;
+  station->prefetch_asked = 0;
+  station->offset = 0;
+  return;
+}
+
+// close the retired tracks that ended by tick; the caller holds the
+// station lock, so no join is reading history out of them
+
+static void close_retired(struct station_t *station, uint64_t tick){
+  int i, n;
+
+  for (n=0; n<station->num_retired; n++){
+    if (station->retired[n].end_tick > tick){
+      break;
+    }
+    song_close(station->retired[n].song);
+  }
+  for (i=n; i<station->num_retired; i++){
+    station->retired[i - n] = station->retired[i];
+  }
+  station->num_retired -= n;
+  return;
+}
+
+// keep the track that just ended open until the history ring has moved
+// past it, however short the tracks after it are. With no room left, the
+// oldest kept one is closed now, and the history still pointing into it
+// forgotten first.
+
+static void retire_song(struct station_t *station, struct song_t *song){
+  uint64_t end_tick;
+
+  if (station->num_retired == STATION_MAX_RETIRED){
+    end_tick = station->retired[0].end_tick;
+    station_lock(station);
+    history_forget(&station->history, end_tick);
+    close_retired(station, end_tick);
+    station_unlock(station);
+  }
+  station->retired[station->num_retired].song = song;
+  station->retired[station->num_retired].end_tick =
+    history_head(&station->history);
+  station->num_retired++;
+  return;
+}
+
+// at the end of a track, go on to the next one. The prefetch thread has
+// normally opened it already; if not, the track plays again from the top
+// meanwhile and this is tried again every tick, rather than holding up
+// every station this worker has due. The track just played stays open
+// until the history ring has moved past its chunks.
+
+static void next_track(struct station_t *station){
+  int track;
+  struct song_t *song;
+
+  if (station->num_tracks == 1){
+    station->offset = 0;
+    station->announce_new_song = 1;
+    station->track_started = 1;
+    stats_add(&station->stats.transitions, 1);
+    return;
+  }
+
+  if (!playlist_poll(station, &song, &track)){
+    if (!station->track_due){
+      log_warn("station %d: next track not open yet; playing %s on",
+               station->id, station->song);
+      station->track_due = 1;
+    }
+    if (station->offset >= station->media->size){
+      station->offset = 0;
+    }
+    return;
+  }
+  station->track_due = 0;
+  station->offset = 0;
+  station->announce_new_song = 1;
+  station->track_started = 1;
+  stats_add(&station->stats.transitions, 1);
+  if (song == NULL){
+    log_warn("station %d: no track will open; replaying %s",
+             station->id, station->song);
+    station->prefetch_asked = 0;
+    return;
+  }
+
+  retire_song(station, station->media);
+  start_track(station, song, track);
+  log_info("station %d: now playing %s",
+           station->id, station->song);
+  return;
+}
+
+// admin changes to the station set are made one at a time, under
+// admin_lock. Readers that look at a station's tracks without its lock
+// (the stats socket, the terminal) hold stations_lock for reading, and
+// whoever frees a station's tracks holds it for writing.
+
+static pthread_mutex_t admin_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t stations_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct station_t *chunks[STATION_MAX_CHUNKS];
+
+static void free_source(struct station_source_t *src){
+  if (src->song != NULL){
+    song_close(src->song);
+  }
+  playlist_free(src->tracks, src->num_tracks);
+  return;
+}
+
+// let go of the prefetch of the station's next track, if one was asked
+// for
+
+static void drop_prefetch(struct station_t *station){
+  if (station->prefetch_asked || station->track_due){
+    playlist_cancel(station, 0);
+    station->prefetch_asked = 0;
+    station->track_due = 0;
+  }
+  return;
+}
+
+// make src's tracks the station's and free the old ones, keeping song
+// good for readers throughout; its track is still to be started
+
+static void install_source(struct station_t *station,
+                           struct station_source_t *src){
+  int num_tracks;
+  char **tracks;
+
+  pthread_rwlock_wrlock(&stations_lock);
+  tracks = station->tracks;
+  num_tracks = station->num_tracks;
+  station->tracks = src->tracks;
+  station->num_tracks = src->num_tracks;
+  station->byte_rate = src->byte_rate;
+  station->fixed_rate = src->fixed_rate;
+  __atomic_store_n(&station->track, src->track, __ATOMIC_RELAXED);
+  __atomic_store_n(&station->song, station->tracks[src->track],
+                   __ATOMIC_RELEASE);
+  pthread_rwlock_unlock(&stations_lock);
+
+  playlist_free(tracks, num_tracks);
+  return;
+}
+
+// switch to the source station_replace() handed over, as if the current
+// track had ended; run by the worker ticking the station
+
+static void switch_source(struct station_t *station){
+  struct station_source_t *src;
+
+  src = __atomic_exchange_n(&station->swap, NULL, __ATOMIC_ACQUIRE);
+  drop_prefetch(station);
+
+  retire_song(station, station->media);
+  install_source(station, src);
+  start_track(station, src->song, src->track);
+  free(src);
+
+  station->announce_new_song = 1;
+  station->track_started = 1;
+  stats_add(&station->stats.transitions, 1);
+  log_info("station %d: replaced; now playing %s", station->id,
+           station->song);
+  return;
+}
+
+// take a station nobody listens to off the air: its tracks are let go and
+// its history forgotten until a join has it resumed. Returns 0, leaving it
+// on, if someone joined meanwhile or it is being removed.
+
+static int park(struct station_t *station){
+  struct timespec now;
+
+  drop_prefetch(station);
+  station_lock(station);
+  if (station->clients.num > 0 || station->state != STATION_LIVE){
+    station_unlock(station);
+    return 0;
+  }
+
+  // a join can wake the station as soon as the lock is let go, so it
+  // has to be all packed up by then
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  station->parked = STATION_PARKED;
+  station->parked_ns = ts_to_ns(&now);
+  station->parked_pos_ns = chunk_ns(station, 0, station->offset);
+  (void) registry_publish(&station->clients); // no tick will
+  history_reset(&station->history);
+  song_close(station->media);
+  station->media = NULL;
+  station->timing = NULL;
+  close_retired(station, UINT64_MAX);
+  station_unlock(station);
+
+  stats_add(&station->stats.parks, 1);
+  log_info("station %d: no listeners; parked", station->id);
+  return 1;
+}
+
+// socket for a scheduler worker to send stations' chunks through
+
+int station_udp_socket(void){
+  int s_udp, ret;
+  unsigned char loop;
+  struct in_addr mcast_if;
 
   s_udp = socket(AF_INET, SOCK_DGRAM, 0);
   if (s_udp == -1){
     perror("socket()");
     exit(-1);
   }
+  if (ses.mcast_group == 0){
+    return s_udp;
+  }
 
-  // repeat song forever
+  // group traffic stays on the LAN (the default TTL of 1) and reaches
+  // listeners on this host too
 
-  while (1){
+  if (ses.mcast_if != 0){
+    mcast_if.s_addr = htonl(ses.mcast_if);
+    ret = setsockopt(s_udp, IPPROTO_IP, IP_MULTICAST_IF, &mcast_if,
+                     sizeof(mcast_if));
+    if (ret == -1){
+      perror("setsockopt()");
+      exit(-1);
+    }
+  }
+  loop = 1;
+  ret = setsockopt(s_udp, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+  if (ret == -1){
+    perror("setsockopt()");
+    exit(-1);
+  }
+  return s_udp;
+}
 
-    announce_new_song = 1;
+// first half of a tick, run by a scheduler worker at now: point the
+// current subscriber snapshot's fan-out at this tick's chunk. The worker
+// sends it, together with other stations due at the same time.
 
-    // while song hasn't ended
+struct fanout_t *station_tick_start(struct station_t *station,
+                                    const struct timespec *now){
+  struct fanout_t *fo;
 
-    while ((bytes_read = read(fd, buf, sizeof(buf))) != 0){
-      if (bytes_read == -1){
-        perror("read()");
-        pthread_exit(0); // XXX
-      }
+  pacer_tick(&station->pacer, now);
+  stats_hist_add(&station->stats.lateness, station->pacer.lateness_ns);
 
-      // TODO fancier rate control
-      usleep(62500);
+  // the gap at a track boundary is however much longer than the last
+  // chunk's playback time the first chunk of the next one took
 
-      ret = pthread_mutex_lock(&ses.station[station_no].lock);
-      if (ret != 0){
-        perror("pthread_mutex_lock()");
-        exit(-1);
+  if (station->track_started){
+    stats_hist_add(&station->stats.track_gap, ts_to_ns(now) -
+                   station->last_tick_ns - station->last_chunk_ns);
+    station->track_started = 0;
+  }
+  station->last_tick_ns = ts_to_ns(now);
+
+  station->chunk_len = station->media->size - station->offset;
+  if (station->chunk_len > DATAGRAM_SIZE){
+    station->chunk_len = DATAGRAM_SIZE;
+  }
+
+  // the snapshot is used without the lock until station_tick_end()
+
+  // framed subscribers get the chunk's tick number, which it keeps in the
+  // history, as its sequence number
+
+  frame_encode(station->frame, station->id, 0,
+               history_head(&station->history), frame_now_us());
+
+  // joins and leaves since the last tick go into one new snapshot; without
+  // the memory for it, the old one serves until a later tick manages
+
+  if (__atomic_load_n(&station->clients.dirty, __ATOMIC_ACQUIRE)){
+    station_lock(station);
+    if (registry_publish(&station->clients) == -1){
+      log_error("station %d: no memory to publish listener changes",
+                station->id);
+    }
+    station_unlock(station);
+  }
+
+  station->snap = snapshot_acquire(&station->clients);
+  fo = &station->snap->fanout;
+  fo->iov[FANOUT_IOV_HEADER].iov_base = station->frame;
+  fo->iov[FANOUT_IOV_HEADER].iov_len = FRAME_HEADER_SIZE;
+  fo->iov[FANOUT_IOV_CHUNK].iov_base = (void *)(station->media->data +
+                                                station->offset);
+  fo->iov[FANOUT_IOV_CHUNK].iov_len = station->chunk_len;
+  return fo;
+}
+
+// make room in pending for num connections; returns -1, keeping the array
+// as it was, if there is no memory for that
+
+static int grow_pending(struct station_t *station, int num){
+  void *p;
+
+  if (num <= station->pending_size){
+    return 0;
+  }
+  p = realloc(station->pending, num * sizeof(*station->pending));
+  if (p == NULL){
+    return -1;
+  }
+  station->pending = p;
+  station->pending_size = num;
+  return 0;
+}
+
+// a catching-up client's next few history chunks, read out under the lock
+// and sent after it is let go
+
+struct burst_t {
+  uint32_t ip;
+  uint16_t udp_port;
+  int framed;
+  struct history_burst_t chunks;
+};
+
+// give every client still catching up its next few history chunks, and
+// move those that reached the live edge over to the live snapshot. They
+// are read out STATION_BURST_BATCH clients at a time, and sent with the
+// lock let go, so joins and leaves don't wait on the sends.
+
+static void send_bursts(struct station_t *station, int s_udp){
+  int i, j, n;
+  struct registry_t *reg;
+  struct subscriber_t *sub;
+  struct burst_t batch[STATION_BURST_BATCH];
+
+  reg = &station->clients;
+  station_lock(station);
+  i = reg->num_burst;
+  while (i > 0){
+
+    // backwards, since ending a burst moves the last entry into its place
+
+    n = 0;
+    while (i > 0 && n < STATION_BURST_BATCH){
+      i--;
+      sub = registry_get(reg, reg->burst[i]);
+      if (history_read(&station->history, &sub->burst_next,
+                       ses.burst_chunks, &batch[n].chunks) > 0){
+        batch[n].ip = sub->ip;
+        batch[n].udp_port = sub->udp_port;
+        batch[n].framed = sub->mode & SUB_FRAMED;
+        n++;
       }
+      if (sub->burst_next >= history_head(&station->history)){
+        registry_end_burst(reg, sub->handle);
+      }
+    }
+    station_unlock(station);
 
-      // send DATAGRAM_SIZE bytes of song to all clients
-
-      for (i=0; i<MAX_CLIENTS_PER_STATION; i++){
-        if (ses.station[station_no].client[i].flags & CLIENT_ACTIVE){
-          client_addr.sin_addr.s_addr = htonl(ses.station[station_no].
-                                              client[i].ip);
-          client_addr.sin_port = htons(ses.station[station_no].client[i].
-                                       udp_port);
-          ret = sendto(s_udp, buf, bytes_read, 0,
-                       (struct sockaddr *)&client_addr, sizeof(client_addr));
-          if (ret == -1){
-            perror("sendto()");
-            pthread_exit(0); // XXX
-          }
-        }
+    for (j=0; j<n; j++){
+      if (history_send(&batch[j].chunks, s_udp, batch[j].ip,
+                       batch[j].udp_port, batch[j].framed,
+                       station->id) == -1){
+        log_error("station %d: burst to port %d: %s",
+                  station->id, batch[j].udp_port, strerror(errno));
+        stats_add(&station->stats.send_errors, 1);
       }
+    }
+
+    // leaves meanwhile may have shortened the list
+
+    station_lock(station);
+    if (i > reg->num_burst){
+      i = reg->num_burst;
+    }
+  }
+  station_unlock(station);
+  return;
+}
+
+// send the parity of the group the chunk just sent completed to the FEC
+// listeners in the snapshot, the way the chunk itself went: through the
+// worker's I/O backend, or split across the shards for a hot station
+
+static void send_parity(struct station_t *station, struct netio_t *io){
+  int j, errors;
+  struct fanout_t *fo;
+
+  fo = &station->snap->parity;
+  if (fo->num == 0){
+    return;
+  }
+  errors = 0;
+  for (j=0; j<ses.fec_p; j++){
+    fec_parity(&station->fec, j, fo, station->id,
+               history_head(&station->history));
+    if (shard_wanted(fo)){
+      errors += shard_send(io, fo);
+    }
+    else {
+      errors += netio_send(io, &fo, 1, NULL);
+    }
+  }
+  stats_add(&station->stats.parity, (uint64_t)fo->num * ses.fec_p - errors);
+  stats_add(&station->stats.send_errors, errors);
+  return;
+}
+
+// second half of a tick, once the chunk is sent: report failed sends,
+// send FEC parity through io, record the chunk, queue ANNOUNCEs, send
+// history to joining clients through s_udp, and move on to the next chunk
+// and deadline. Returns 0 if the station parked instead, and is not to be
+// scheduled again.
 
-      // send ANNOUNCE we're at a new song, or if the client just subscribed
-
-      for (i=0; i<MAX_CLIENTS_PER_STATION; i++){
-        if (ses.station[station_no].client[i].flags & CLIENT_ACTIVE){
-          if (announce_new_song ||
-              ses.station[station_no].client[i].flags & CLIENT_NEW){
-            ses.station[station_no].client[i].flags &= ~CLIENT_NEW;
-            announce.type = TYPE_REPLY_ANNOUNCE;
-            announce.announce.filename_size = strlen(ses.station[station_no].
-                                                     song);
-            memcpy(announce.announce.filename, ses.station[station_no].song,
-                   announce.announce.filename_size);
-            ret = send_reply(ses.station[station_no].client[i].s_client, &announce);
-            if (ret == -1){
-              // XXX announce failed, go crazy
-            }
-          }
-        }
+int station_tick_end(struct station_t *station, int failed,
+                     struct netio_t *io, int s_udp){
+  int i, num_pending, errors;
+  struct registry_t *reg;
+  struct fanout_t *fo;
+
+  reg = &station->clients;
+  fo = &station->snap->fanout;
+  errors = 0;
+  if (failed){
+    for (i=0; i<fo->num; i++){
+      if (fo->status[i] != 0){
+        log_error("station %d: sendmmsg() to %s:%d: %s",
+                  station->id, inet_ntoa(fo->addr[i].sin_addr),
+                  ntohs(fo->addr[i].sin_port), strerror(fo->status[i]));
+        errors++;
       }
+    }
+    stats_add(&station->stats.send_errors, errors);
+  }
+  stats_add(&station->stats.datagrams, fo->num - errors);
+  stats_add(&station->stats.bytes,
+            (uint64_t)(fo->num - errors) * station->chunk_len);
 
-      announce_new_song = 0;
+  // every chunk goes into its group's parity, whether or not anyone
+  // listening wants it, so a client asking for FEC mid-group still gets it
 
-      ret = pthread_mutex_unlock(&ses.station[station_no].lock);
-      if (ret != 0){
-        perror("pthread_mutex_unlock()");
-        exit(-1);
+  if (ses.fec_k > 0 &&
+      fec_add(&station->fec, history_head(&station->history),
+              station->media->data + station->offset, station->chunk_len)){
+    send_parity(station, io);
+  }
+  snapshot_release(reg, &station->lock);
+  station->snap = NULL;
+
+  // the chunk is now history a joining client can catch up on
+
+  history_push(&station->history, station->media->data + station->offset,
+               station->chunk_len, station->pacer.media_ns);
+  if (station->num_retired > 0 &&
+      history_head(&station->history) >=
+      station->retired[0].end_tick + station->history.size){
+    station_lock(station);
+    close_retired(station, history_head(&station->history) -
+                           station->history.size);
+    station_unlock(station);
+  }
+
+  // only lock when someone needs an ANNOUNCE (we're at a new song), and
+  // queue them after unlocking; without the memory to list them, a later
+  // tick tries again
+
+  num_pending = 0;
+  if (station->announce_new_song){
+    station_lock(station);
+    if (grow_pending(station, reg->num) == 0){
+      for (i=0; i<reg->num; i++){
+        station->pending[num_pending++] = conn_get(reg->sub[i].conn);
       }
+      station->announce_new_song = 0;
+    }
+    station_unlock(station);
+    if (station->announce_new_song){
+      log_error("station %d: no memory to queue ANNOUNCEs", station->id);
     }
+    stats_add(&station->stats.announces, num_pending);
+  }
 
-    // rewind song
+  // a client with a full TCP window only backs up its own queue
 
-    ret = lseek(fd, 0, SEEK_SET);
-    if (ret != 0){
-      perror("lseek()");
-      pthread_exit(0); // XXX
+  for (i=0; i<num_pending; i++){
+    (void) conn_queue(station->pending[i], station->announce,
+                      station->announce_len);
+    conn_put(station->pending[i]);
+  }
+
+  if (__atomic_load_n(&reg->num_burst, __ATOMIC_ACQUIRE) > 0){
+    send_bursts(station, s_udp);
+  }
+
+  station->last_chunk_ns = chunk_ns(station, station->offset,
+                                    station->chunk_len);
+  pacer_advance(&station->pacer, station->last_chunk_ns);
+
+  // play the tracks in order, forever, having the next one opened well
+  // before this one ends
+
+  station->offset += station->chunk_len;
+  if (station->num_tracks > 1 && !station->prefetch_asked &&
+      station->offset >= station->prefetch_at){
+    playlist_prefetch(station);
+    station->prefetch_asked = 1;
+  }
+  if (__atomic_load_n(&station->swap, __ATOMIC_ACQUIRE) != NULL){
+    switch_source(station);
+  }
+  else if (station->offset >= station->media->size || station->track_due){
+    next_track(station);
+  }
+
+  // nobody left to send to; the lock is only taken to make sure
+
+  if (__atomic_load_n(&reg->num, __ATOMIC_RELAXED) == 0 &&
+      __atomic_load_n(&station->swap, __ATOMIC_ACQUIRE) == NULL){
+    return !park(station);
+  }
+  return 1;
+}
+
+// station i, for i < ses.num_stations; the pointer never goes stale, but
+// the station may be removed (state != STATION_LIVE)
+
+struct station_t *station_get(int i){
+  return &chunks[i / STATION_CHUNK][i % STATION_CHUNK];
+}
+
+void stations_read_lock(void){
+  pthread_rwlock_rdlock(&stations_lock);
+  return;
+}
+
+void stations_read_unlock(void){
+  pthread_rwlock_unlock(&stations_lock);
+  return;
+}
+
+static int alloc_chunk(int c){
+  int i;
+  struct station_t *chunk;
+
+  chunk = (struct station_t *)calloc(STATION_CHUNK, sizeof(struct station_t));
+  if (chunk == NULL){
+    perror("calloc()");
+    return -1;
+  }
+  for (i=0; i<STATION_CHUNK; i++){
+    pthread_mutex_init(&chunk[i].lock, NULL);
+    registry_init(&chunk[i].clients);
+    chunk[i].id = c * STATION_CHUNK + i;
+    chunk[i].state = STATION_FREE;
+  }
+  chunks[c] = chunk;
+  return 0;
+}
+
+// "file@rate" streams file (or every track of a playlist) at rate bytes
+// per second; otherwise MP3s follow their own frame timing and anything
+// else gets the default rate. A directory or .m3u is a playlist. With
+// open_first, its first track that opens is opened now; otherwise nothing
+// is until the station is first listened to. Returns -1 if there is
+// nothing to play.
+
+static int load_source(struct station_source_t *src, char *arg, int id,
+                       int open_first){
+  char *rate;
+
+  src->byte_rate = ses.byte_rate;
+  rate = strrchr(arg, '@');
+  if (rate != NULL && rate[1] != '\0' &&
+      strspn(rate + 1, "0123456789") == strlen(rate + 1) &&
+      atol(rate + 1) > 0){
+    src->byte_rate = atol(rate + 1);
+    *rate = '\0';
+  }
+  else {
+    rate = NULL;
+  }
+  src->fixed_rate = rate != NULL;
+
+  src->num_tracks = playlist_load(arg, &src->tracks);
+  if (src->num_tracks <= 0){
+    log_error("station %d: no tracks in %s", id, arg);
+    free(src->tracks);
+    return -1;
+  }
+  src->song = NULL;
+  src->track = 0;
+  for (; open_first && src->track<src->num_tracks; src->track++){
+    src->song = song_open(src->tracks[src->track], ses.song_flags);
+    if (src->song != NULL){
+      break;
     }
-    
   }
+  if (open_first && src->song == NULL){
+    playlist_free(src->tracks, src->num_tracks);
+    return -1;
+  }
+  if (src->num_tracks > 1){
+    log_info("station %d: %s: playlist of %d tracks", id, arg,
+             src->num_tracks);
+  }
+  return 0;
+}
+
+// set up a free slot to play src, parked: nothing is opened, or even
+// checked, until a client first tunes in
 
-  ret = close(fd);
-  if (ret != -1){
-    perror("close()");
-    pthread_exit(0); // XXX
-  } 
+static void station_start(struct station_t *station,
+                          struct station_source_t *src){
+  struct timespec now;
+
+  memset(&station->lock_stats, 0, sizeof(struct lock_stats_t));
+  memset(&station->stats, 0, sizeof(struct station_stats_t));
+  pacer_init(&station->pacer, PACER_MAX_LAG_NS);
+  station->byte_rate = src->byte_rate;
+  station->fixed_rate = src->fixed_rate;
+  station->tracks = src->tracks;
+  station->num_tracks = src->num_tracks;
+  station->track = src->track;
+  __atomic_store_n(&station->song, station->tracks[src->track],
+                   __ATOMIC_RELEASE);
+  set_announce(station);
+  if (ses.mcast_group != 0){
+    registry_set_group(&station->clients, ses.mcast_group + station->id,
+                       ses.mcast_port);
+  }
 
-  return NULL;
+  // no thread of its own: once woken, the station is ticked by whichever
+  // scheduler worker is free when its deadline comes up
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  station->parked = STATION_PARKED;
+  station->parked_ns = ts_to_ns(&now);
+  station->parked_pos_ns = 0;
+  station->media = NULL;
+  station->timing = NULL;
+  station->offset = 0;
+  station->swap = NULL;
+  station->chunk_len = 0;
+  station->announce_new_song = 0;
+  station->snap = NULL;
+  station->num_retired = 0;
+  station->track_started = 0;
+  station->prefetch_asked = 0;
+  station->track_due = 0;
+  playlist_reset(station);
+  return;
 }
 
-void create_stations(int num_stations, char **file_list){
-  int i, j, ret;
-  pthread_t t_station;
-  ses.num_stations = num_stations;
-  ses.station = (struct station_t *)malloc(ses.num_stations *
-                                           sizeof(struct station_t));
-  if (ses.station == NULL){
+// add a station playing arg, under the lowest free station number, parked
+// until someone tunes in; returns the number, or -1
+
+int station_add(char *arg){
+  int id;
+  struct station_t *station;
+  struct station_source_t src;
+
+  pthread_mutex_lock(&admin_lock);
+  for (id=0; id<ses.num_stations; id++){
+    if (__atomic_load_n(&station_get(id)->state, __ATOMIC_ACQUIRE) ==
+        STATION_FREE){
+      break;
+    }
+  }
+  if (id == STATION_MAX){
+    log_error("no room for another station");
+    pthread_mutex_unlock(&admin_lock);
+    return -1;
+  }
+  if (ses.mcast_group != 0 && !IN_MULTICAST(ses.mcast_group + id)){
+    log_error("station %d: %s is not a multicast group", id,
+              inet_ntoa((struct in_addr){ htonl(ses.mcast_group + id) }));
+    pthread_mutex_unlock(&admin_lock);
+    return -1;
+  }
+  if (chunks[id / STATION_CHUNK] == NULL &&
+      alloc_chunk(id / STATION_CHUNK) == -1){
+    pthread_mutex_unlock(&admin_lock);
+    return -1;
+  }
+  station = station_get(id);
+  if (load_source(&src, arg, id, 0) == -1){
+    pthread_mutex_unlock(&admin_lock);
+    return -1;
+  }
+  station_start(station, &src);
+
+  // a new number is published only once its slot is ready
+
+  station_lock(station);
+  station->state = STATION_LIVE;
+  station_unlock(station);
+  if (id == ses.num_stations){
+    __atomic_store_n(&ses.num_stations, id + 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&admin_lock);
+  return id;
+}
+
+// have station id torn down at its next deadline, or now if it is parked;
+// returns -1 if there is no such station
+
+int station_remove(int id){
+  int parked;
+  struct station_t *station;
+
+  pthread_mutex_lock(&admin_lock);
+  if (id < 0 || id >= ses.num_stations){
+    pthread_mutex_unlock(&admin_lock);
+    return -1;
+  }
+  station = station_get(id);
+  if (station->state != STATION_LIVE){
+    pthread_mutex_unlock(&admin_lock);
+    return -1;
+  }
+  station_lock(station);
+  __atomic_store_n(&station->state, STATION_STOPPING, __ATOMIC_RELEASE);
+  parked = station->parked == STATION_PARKED;
+  station_unlock(station);
+
+  // no scheduler worker will come across a parked station
+
+  if (parked){
+    station_stop(station);
+  }
+  pthread_mutex_unlock(&admin_lock);
+  return 0;
+}
+
+// have station id switch to playing arg at its next tick, keeping its
+// listeners (a parked one is woken for that tick); returns -1 if there is
+// no such station, it is still switching, or nothing in arg will play
+
+int station_replace(int id, char *arg){
+  int wake;
+  struct station_t *station;
+  struct station_source_t *src;
+
+  pthread_mutex_lock(&admin_lock);
+  if (id < 0 || id >= ses.num_stations){
+    pthread_mutex_unlock(&admin_lock);
+    return -1;
+  }
+  station = station_get(id);
+  if (station->state != STATION_LIVE ||
+      __atomic_load_n(&station->swap, __ATOMIC_ACQUIRE) != NULL){
+    pthread_mutex_unlock(&admin_lock);
+    return -1;
+  }
+  src = (struct station_source_t *)malloc(sizeof(struct station_source_t));
+  if (src == NULL){
     perror("malloc()");
-    exit(-1);
+    pthread_mutex_unlock(&admin_lock);
+    return -1;
+  }
+  if (load_source(src, arg, id, 1) == -1){
+    free(src);
+    pthread_mutex_unlock(&admin_lock);
+    return -1;
+  }
+  __atomic_store_n(&station->swap, src, __ATOMIC_RELEASE);
+  station_lock(station);
+  wake = station->parked == STATION_PARKED;
+  if (wake){
+    station->parked = STATION_WAKING;
+  }
+  station_unlock(station);
+  if (wake){
+    playlist_resume(station);
   }
-  for (i=0; i<ses.num_stations; i++){
-    pthread_mutex_init(&ses.station[i].lock, NULL);
-    ses.station[i].song = file_list[i];
-    for (j=0; j<MAX_CLIENTS_PER_STATION; j++){
-      ses.station[i].client[j].flags = 0;
+  pthread_mutex_unlock(&admin_lock);
+  return 0;
+}
+
+// empty the registry, disconnecting every listener with INVALID_COMMAND
+// carrying msg; the generation tells their connections the station is no
+// longer theirs to leave. With park, the station is parked in the same
+// breath, unless it is being removed (-1). Returns how many were dropped.
+// The registry's own list of them is taken over to kick them from, so
+// this needs no memory, even for a station with a great many listeners.
+
+static int drop_listeners(struct station_t *station, const char *msg,
+                          int park){
+  int i, num;
+  struct registry_t *reg;
+  struct subscriber_t *subs;
+
+  reg = &station->clients;
+  station_lock(station);
+  if (park){
+    if (station->state != STATION_LIVE){
+      station_unlock(station);
+      return -1;
     }
-    ret = pthread_create(&t_station, NULL, (void *(*)(void *))station_loop,
-                         (void *)i); // XXX create detached
-    if (ret != 0){
-      perror("pthread_create()");
+    station->parked = STATION_PARKED;
+  }
+  subs = registry_clear(reg, &num);
+  for (i=0; i<num; i++){
+    (void) conn_get(subs[i].conn);
+  }
+  station->generation++;
+  station_unlock(station);
+
+  for (i=0; i<num; i++){
+    conn_kick(subs[i].conn, msg);
+    conn_put(subs[i].conn);
+  }
+  free(subs);
+  return num;
+}
+
+// byte offset pos_ns into the station's current track
+
+static size_t track_offset(const struct station_t *station, int64_t pos_ns){
+  size_t offset;
+
+  if (station->timing != NULL){
+    offset = mp3_offset(station->timing, pos_ns);
+  }
+  else {
+    offset = (double)pos_ns * station->byte_rate / NSEC_PER_SEC;
+  }
+  return offset < station->media->size ? offset : 0;
+}
+
+// put a woken station back on the scheduler, playing song (track number
+// track of its playlist) from pos_ns in; run by the prefetch thread, which
+// has the station to itself until then. A replacement handed over while it
+// was parked is started from its top instead. If no track would open,
+// whoever woke it is disconnected and it stays parked.
+
+void station_resume(struct station_t *station, struct song_t *song,
+                    int track, int64_t pos_ns){
+  int changed, num;
+  int64_t chunk_avg_ns;
+  struct station_source_t *src;
+
+  src = __atomic_exchange_n(&station->swap, NULL, __ATOMIC_ACQUIRE);
+  changed = track != station->track;
+  if (src != NULL){
+    if (song != NULL){
+      song_close(song);
+    }
+    install_source(station, src);
+    song = src->song;
+    track = src->track;
+    pos_ns = 0;
+    changed = 1;
+    free(src);
+  }
+  if (song == NULL){
+    num = drop_listeners(station, ERROR_NOTHING_TO_PLAY, 1);
+    if (num == -1){
+      station_stop(station);
+      return;
+    }
+    log_warn("station %d: no track will open; %d listeners "
+             "disconnected", station->id, num);
+    return;
+  }
+
+  start_track(station, song, track);
+  station->offset = track_offset(station, pos_ns);
+  station->announce_new_song = changed;
+  station->track_started = 0;
+
+  // the history ring is sized the first time round: room for history_ms
+  // of average chunks, twice over for VBR
+
+  if (station->history.size == 0){
+    chunk_avg_ns = chunk_ns(station, 0, song->size) /
+                   ((song->size + DATAGRAM_SIZE - 1) / DATAGRAM_SIZE);
+    if (chunk_avg_ns <= 0){
+      chunk_avg_ns = 1;
+    }
+    if (history_init(&station->history,
+                     2 * (ses.history_ms * 1000000LL / chunk_avg_ns) + 16,
+                     ses.history_ms * 1000000LL) == -1){
+      perror("malloc()");
+      exit(-1);
+    }
+    if (ses.fec_k > 0 &&
+        fec_init(&station->fec, ses.fec_k, ses.fec_p, DATAGRAM_SIZE) == -1){
+      perror("malloc()");
       exit(-1);
     }
-    pthread_detach(t_station); // XXX create detached
+    if (station->timing != NULL){
+      log_info("station %d: %s: MP3, %d Hz, %d frames%s, %.1f s%s",
+               station->id, station->song, station->timing->sample_rate,
+               station->timing->num_frames,
+               station->timing->vbr ? " (VBR)" : "",
+               station->timing->time_ns[station->timing->num_frames] / 1e9,
+               station->fixed_rate ? ", paced at the given rate instead" : "");
+    }
   }
+
+  station_lock(station);
+  station->parked = STATION_RUNNING;
+  station_unlock(station);
+  stats_add(&station->stats.resumes, 1);
+  log_info("station %d: resuming %s at %.1f s", station->id,
+           station->song, chunk_ns(station, 0, station->offset) / 1e9);
+  sched_add(station);
   return;
 }
 
-void destroy_stations(){
-  int i, ret;
-  for (i=0; i<ses.num_stations; i++){
-    ret = pthread_mutex_destroy(&ses.station[i].lock);
-    // XXX kill sockets here or elsewhere?
-    if (ret != 0){
-      perror("pthread_mutex_destroy()");
+int station_stopping(const struct station_t *station){
+  return __atomic_load_n(&station->state, __ATOMIC_ACQUIRE) ==
+         STATION_STOPPING;
+}
+
+// tear a removed station down, run by the scheduler worker that took it
+// off the heap (or whoever removed it, if it was parked): its listeners
+// get INVALID_COMMAND and are disconnected, and its number is free for
+// the next station_add() once the prefetch thread is done with it
+
+void station_stop(struct station_t *station){
+  int num;
+  struct station_source_t *src;
+
+  num = drop_listeners(station, ERROR_STATION_REMOVED, 0);
+
+  pthread_rwlock_wrlock(&stations_lock);
+  src = __atomic_exchange_n(&station->swap, NULL, __ATOMIC_ACQUIRE);
+  if (src != NULL){
+    free_source(src);
+    free(src);
+  }
+  history_destroy(&station->history);
+  fec_destroy(&station->fec);
+  if (station->media != NULL){
+    song_close(station->media);
+    station->media = NULL;
+  }
+  close_retired(station, UINT64_MAX);
+  playlist_free(station->tracks, station->num_tracks);
+  station->tracks = NULL;
+  station->num_tracks = 0;
+  __atomic_store_n(&station->song, NULL, __ATOMIC_RELAXED);
+  pthread_rwlock_unlock(&stations_lock);
+
+  log_info("station %d: removed; %d listeners disconnected",
+           station->id, num);
+
+  // a prefetch cancelled when the station parked may still be in flight
+  // though it asked for none since, so the prefetch is always let go of;
+  // a track it is still opening finds no tracks left to open
+
+  station->prefetch_asked = 0;
+  station->track_due = 0;
+  playlist_cancel(station, 1);
+  return;
+}
+
+// give up a stopped station's slot; by station_stop(), or by the prefetch
+// thread once it is done with the station
+
+void station_free(struct station_t *station){
+  pthread_rwlock_wrlock(&stations_lock);
+  __atomic_store_n(&station->state, STATION_FREE, __ATOMIC_RELEASE);
+  pthread_rwlock_unlock(&stations_lock);
+  return;
+}
+
+void create_stations(int num_stations, char **file_list){
+  int i;
+
+  ses.num_stations = 0;
+  for (i=0; i<num_stations; i++){
+    if (station_add(file_list[i]) == -1){
       exit(-1);
     }
   }
-  free(ses.station);
+  return;
+}
+
+void destroy_stations(){
+  int c, i, ret;
+  struct station_t *station;
+
+  for (c=0; c<STATION_MAX_CHUNKS && chunks[c] != NULL; c++){
+    for (i=0; i<STATION_CHUNK; i++){
+      station = &chunks[c][i];
+      ret = pthread_mutex_destroy(&station->lock);
+      // XXX kill sockets here or elsewhere?
+      if (ret != 0){
+        perror("pthread_mutex_destroy()");
+        exit(-1);
+      }
+      registry_destroy(&station->clients);
+      free(station->pending);
+      if (station->state == STATION_FREE){
+        continue;
+      }
+      history_destroy(&station->history);
+      fec_destroy(&station->fec);
+      if (station->media != NULL){
+        song_close(station->media);
+      }
+      close_retired(station, UINT64_MAX);
+      if (station->next_media != NULL){
+        song_close(station->next_media);
+      }
+      if (station->swap != NULL){
+        free_source(station->swap);
+        free(station->swap);
+      }
+      playlist_free(station->tracks, station->num_tracks);
+    }
+    free(chunks[c]);
+    chunks[c] = NULL;
+  }
   return;
 }
@@ -4,16 +4,45 @@
 #include <pthread.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include "connection.h"
+#include "registry.h"
+#include "pacer.h"
+#include "songstore.h"
+#include "history.h"
+#include "frame.h"
+#include "fec.h"
+#include "netio.h"
+#include "stats.h"
 
 #define COMM_SUCCESS 0
 #define COMM_ERORR -1
 #define COMM_CLOSED -2
 
-#define MAX_CLIENTS_PER_STATION 256
 #define DATAGRAM_SIZE 1024
+#define DEFAULT_MCAST_PORT 5004
 
-#define CLIENT_ACTIVE 1         // is there a client at all in this slot?
-#define CLIENT_NEW 2            // has the client been sent his first announce?
+// stations live in chunks that are never moved or freed while the server
+// runs, so a station pointer stays good however many are added
+
+#define STATION_CHUNK 64
+#define STATION_MAX UINT16_MAX // a WELCOME's station count is 16 bits
+#define STATION_MAX_CHUNKS ((STATION_MAX + STATION_CHUNK - 1) / STATION_CHUNK)
+
+#define STATION_FREE 0      // never used, or removed and torn down
+#define STATION_LIVE 1
+#define STATION_STOPPING 2  // removed; torn down at its next deadline
+
+// a station nobody listens to is parked: off the scheduler, with no track
+// open, until a SET_STATION wakes it
+
+#define STATION_RUNNING 0
+#define STATION_PARKED 1
+#define STATION_WAKING 2    // its track is being opened to resume
+
+#define STATION_MAX_RETIRED 8 // ended tracks kept for history at once
+#define STATION_BURST_BATCH 16 // catching-up clients read out per lock hold
+
+#define CLIENT_ACTIVE 1         // is the subscription live?
 //#define CLIENT_NEEDS_ANNOUNCE 4 // does the client need an announce?
 
 #define ERROR_NO_HELLO "server did not receive a valid HELLO command"
@@ -21,19 +50,111 @@
 #define ERROR_NO_SET_STATION "server was expecting a SET_STATION command, but received a HELLO command"
 #define ERROR_SS_OUT_OF_ORDER "server received SET_STATION command before replying to previous one"
 #define ERROR_INVALID_COMMAND "server received an invalid command"
+#define ERROR_STATION_REMOVED "the station you were listening to was removed from the server"
+#define ERROR_NOTHING_TO_PLAY "none of the station's tracks could be opened"
 #define ERROR_NOT_IMPLEMENTED "unimplemented functionality; please contact the TAs for questions"
 
+// how the station lock is used; updated only while holding it, with
+// relaxed atomics, since the stats and the terminal read it without
+
+struct lock_stats_t {
+  uint64_t acquires;
+  uint64_t contended;        // acquires that had to wait
+  int64_t wait_ns;           // total
+  int64_t max_wait_ns;
+  int64_t hold_ns;           // total
+  int64_t max_hold_ns;
+  struct timespec acquired;  // when the current holder got it
+};
+
+// what a station plays: its tracks, how they're paced, and the first one
+// that opened
+
+struct station_source_t {
+  char **tracks;
+  int num_tracks;
+  long byte_rate;
+  int fixed_rate;
+  struct song_t *song;
+  int track;
+};
+
+// a track that ended while history entries may still point into it
+
+struct retired_song_t {
+  struct song_t *song;
+  uint64_t end_tick;         // history head when it ended
+};
+
 struct station_t {
-  pthread_mutex_t lock;
-  char *song;
-  struct {
-    int flags;
-    int s_client;
-    uint32_t ip;       // host order
-    uint16_t udp_port; // host order
-  } client[MAX_CLIENTS_PER_STATION];
+  pthread_mutex_t lock;      // guards clients; take with station_lock()
+  int id;                    // station number
+  int state;                 // STATION_*; only LIVE under the lock takes joins
+  int generation;            // bumped when the station is torn down
+  struct station_source_t *swap; // to switch to at the next tick, or NULL
+  int parked;                // STATION_RUNNING, _PARKED or _WAKING; locked
+  int64_t parked_ns;         // when it was parked
+  int64_t parked_pos_ns;     // and how far into its track it was
+  struct lock_stats_t lock_stats;
+  struct station_stats_t stats;
+  char *song;           // track playing now; swapped atomically
+  struct song_t *media; // shared, read-only contents of song; NULL parked
+  long byte_rate;       // stream rate, bytes per second, unless timing
+  const struct mp3_timing_t *timing; // MP3 frame timing to pace by, or NULL
+  int fixed_rate;       // byte_rate overrides every track's MP3 timing
+  char **tracks;        // the playlist; a single file is a list of one
+  int num_tracks;
+  struct pacer_t pacer;
+  struct registry_t clients;
+  struct history_t history;  // recent chunks, for clients that just joined
+  char announce[sizeof(struct reply_t)]; // encoded ANNOUNCE of song
+  size_t announce_len;
+
+  // where the stream is; touched only by the worker running the tick
+  size_t offset;             // of the next chunk in media
+  size_t chunk_len;          // of the chunk being sent
+  int announce_new_song;     // everyone gets an ANNOUNCE next tick
+  struct snapshot_t *snap;   // held between tick start and end
+  unsigned char frame[FRAME_HEADER_SIZE]; // of the chunk being sent
+  struct conn_t **pending;   // scratch for queueing ANNOUNCEs
+  int pending_size;
+  int track;                 // index of song in tracks
+  size_t prefetch_at;        // offset at which to open the next track
+  int prefetch_asked;
+  int track_due;             // the track ended before the next was open
+  struct retired_song_t retired[STATION_MAX_RETIRED]; // oldest first
+  int num_retired;
+  int track_started;         // the next chunk is a new track's first
+  int64_t last_tick_ns;      // when the latest chunk went out
+  int64_t last_chunk_ns;     // and its playback time
+  struct fec_t fec;          // parity of the group being sent, if FEC is on
+
+  // handed over by the prefetch thread under its lock; see playlist.c
+  int prefetch_state;        // PREFETCH_*
+  int prefetch_cancel;       // close what it opens instead
+  int prefetch_stop;         // and then station_free() it
+  struct song_t *next_media;
+  int next_track;
+  struct station_t *prefetch_next; // in the prefetch queue
 };
 
+void station_lock(struct station_t *);
+void station_unlock(struct station_t *);
+int64_t station_song_ns(const struct station_t *, const struct song_t *);
+int station_udp_socket(void);
+struct fanout_t *station_tick_start(struct station_t *,
+                                    const struct timespec *);
+int station_tick_end(struct station_t *, int, struct netio_t *, int);
+void station_resume(struct station_t *, struct song_t *, int, int64_t);
+struct station_t *station_get(int);
+void stations_read_lock(void);
+void stations_read_unlock(void);
+int station_add(char *);
+int station_remove(int);
+int station_replace(int, char *);
+int station_stopping(const struct station_t *);
+void station_stop(struct station_t *);
+void station_free(struct station_t *);
 void create_stations(int, char **);
 void destroy_stations(void);
 
@@ -0,0 +1,301 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "misc.h"
+#include "log.h"
+#include "netio.h"
+#include "stats.h"
+#include "station.h"
+
+extern struct ses_t ses;
+
+// registered threads; entries are filled in before num_threads covers
+// them, so a reader never sees a half-named one
+
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_stats_t threads[STATS_MAX_THREADS];
+static struct thread_stats_t overflow; // counted, but not reported
+static int num_threads;
+
+void stats_hist_add(struct stats_hist_t *h, int64_t ns){
+  int i;
+
+  if (ns < 0){
+    ns = 0;
+  }
+  i = ns > 1 ? 63 - __builtin_clzll(ns) : 0;
+  if (i >= STATS_HIST_BUCKETS){
+    i = STATS_HIST_BUCKETS - 1;
+  }
+  stats_add(&h->bucket[i], 1);
+  stats_add(&h->sum_ns, ns);
+  stats_add(&h->count, 1);
+  return;
+}
+
+// counters for the calling thread, reported as "kind i"
+
+struct thread_stats_t *stats_register_thread(const char *kind, int i){
+  struct thread_stats_t *t;
+
+  pthread_mutex_lock(&threads_lock);
+  if (num_threads == STATS_MAX_THREADS){
+    pthread_mutex_unlock(&threads_lock);
+    return &overflow;
+  }
+  t = &threads[num_threads];
+  snprintf(t->name, sizeof(t->name), "%s %d", kind, i);
+  __atomic_store_n(&num_threads, num_threads + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&threads_lock);
+  return t;
+}
+
+static uint64_t load(const uint64_t *counter){
+  return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void write_string(FILE *f, const char *s){
+  fputc('"', f);
+  for (; *s != '\0'; s++){
+    if (*s == '"' || *s == '\\'){
+      fprintf(f, "\\%c", *s);
+    }
+    else if ((unsigned char)*s < 0x20){
+      fprintf(f, "\\u%04x", *s);
+    }
+    else {
+      fputc(*s, f);
+    }
+  }
+  fputc('"', f);
+  return;
+}
+
+// {"count": n, "sum_ns": n, "log2_ns": [bucket 0, ...]}, trailing empty
+// buckets left out
+
+static void write_hist(FILE *f, const char *name, const struct stats_hist_t *h){
+  int i, last;
+
+  last = -1;
+  for (i=0; i<STATS_HIST_BUCKETS; i++){
+    if (load(&h->bucket[i]) != 0){
+      last = i;
+    }
+  }
+  fprintf(f, "\"%s\": {\"count\": %llu, \"sum_ns\": %llu, \"log2_ns\": [",
+          name, (unsigned long long)load(&h->count),
+          (unsigned long long)load(&h->sum_ns));
+  for (i=0; i<=last; i++){
+    fprintf(f, "%s%llu", i > 0 ? ", " : "",
+            (unsigned long long)load(&h->bucket[i]));
+  }
+  fprintf(f, "]}");
+  return;
+}
+
+static void write_station(FILE *f, int i){
+  struct station_t *station;
+  struct station_stats_t *s;
+  struct pacer_t *pacer;
+  struct lock_stats_t *lock_stats;
+
+  station = station_get(i);
+  s = &station->stats;
+  pacer = &station->pacer;
+  lock_stats = &station->lock_stats;
+
+  fprintf(f, "{\"station\": %d, \"song\": ", i);
+  write_string(f, __atomic_load_n(&station->song, __ATOMIC_RELAXED));
+  fprintf(f, ", \"parked\": %s, \"parks\": %llu, \"resumes\": %llu",
+          __atomic_load_n(&station->parked, __ATOMIC_RELAXED) !=
+          STATION_RUNNING ? "true" : "false",
+          (unsigned long long)load(&s->parks),
+          (unsigned long long)load(&s->resumes));
+  fprintf(f, ", \"track\": %d, \"tracks\": %d, \"transitions\": %llu, ",
+          __atomic_load_n(&station->track, __ATOMIC_RELAXED),
+          station->num_tracks,
+          (unsigned long long)load(&s->transitions));
+  write_hist(f, "track_gap", &s->track_gap);
+  fprintf(f, ", \"listeners\": %d, \"datagrams\": %llu, \"bytes\": %llu, "
+          "\"send_errors\": %llu, \"announces\": %llu, \"joins\": %llu, "
+          "\"leaves\": %llu, \"sharded_ticks\": %llu, "
+          "\"parity\": %llu, ",
+          __atomic_load_n(&station->clients.num, __ATOMIC_RELAXED),
+          (unsigned long long)load(&s->datagrams),
+          (unsigned long long)load(&s->bytes),
+          (unsigned long long)load(&s->send_errors),
+          (unsigned long long)load(&s->announces),
+          (unsigned long long)load(&s->joins),
+          (unsigned long long)load(&s->leaves),
+          (unsigned long long)load(&s->sharded_ticks),
+          (unsigned long long)load(&s->parity));
+  fprintf(f, "\"ticks\": %llu, \"late_ticks\": %llu, \"resyncs\": %llu, "
+          "\"max_lateness_ns\": %lld, \"drift_ns\": %lld, ",
+          (unsigned long long)load(&pacer->ticks),
+          (unsigned long long)load(&pacer->late_ticks),
+          (unsigned long long)load(&pacer->resyncs),
+          (long long)__atomic_load_n(&pacer->max_lateness_ns,
+                                     __ATOMIC_RELAXED),
+          (long long)__atomic_load_n(&pacer->drift_ns, __ATOMIC_RELAXED));
+  write_hist(f, "lateness", &s->lateness);
+  fprintf(f, ", ");
+  write_hist(f, "fanout", &s->fanout);
+  fprintf(f, ", \"lock\": {\"acquires\": %llu, \"contended\": %llu, ",
+          (unsigned long long)load(&lock_stats->acquires),
+          (unsigned long long)load(&lock_stats->contended));
+  write_hist(f, "wait", &s->lock_wait);
+  fprintf(f, ", ");
+  write_hist(f, "hold", &s->lock_hold);
+  fprintf(f, "}}");
+  return;
+}
+
+static void write_thread(FILE *f, const struct thread_stats_t *t){
+  fprintf(f, "{\"name\": ");
+  write_string(f, t->name);
+  fprintf(f, ", \"wakeups\": %llu, \"items\": %llu, \"syscalls\": %llu, ",
+          (unsigned long long)load(&t->wakeups),
+          (unsigned long long)load(&t->items),
+          (unsigned long long)load(&t->syscalls));
+  write_hist(f, "busy", &t->busy);
+  fprintf(f, "}");
+  return;
+}
+
+// one JSON object with every live station's and thread's counters; takes
+// no station lock, but holds the station set's read lock while writing to
+// f, so callers write it into memory and send it on from there
+
+void stats_write(FILE *f){
+  int i, n, first;
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  fprintf(f, "{\"monotonic_ns\": %lld, \"backend\": \"%s\", ",
+          (long long)ts_to_ns(&now), netio_backend());
+  fprintf(f, "\"log\": {\"written\": %llu, \"dropped\": %llu, "
+          "\"suppressed\": %llu},\n \"stations\": [",
+          (unsigned long long)load(&log_stats.written),
+          (unsigned long long)load(&log_stats.dropped),
+          (unsigned long long)load(&log_stats.suppressed));
+  first = 1;
+  stations_read_lock();
+  n = __atomic_load_n(&ses.num_stations, __ATOMIC_ACQUIRE);
+  for (i=0; i<n; i++){
+    if (__atomic_load_n(&station_get(i)->state, __ATOMIC_ACQUIRE) !=
+        STATION_LIVE){
+      continue;
+    }
+    fprintf(f, "%s\n  ", first ? "" : ",");
+    write_station(f, i);
+    first = 0;
+  }
+  stations_read_unlock();
+  fprintf(f, "],\n \"threads\": [");
+  n = __atomic_load_n(&num_threads, __ATOMIC_ACQUIRE);
+  for (i=0; i<n; i++){
+    fprintf(f, "%s\n  ", i > 0 ? "," : "");
+    write_thread(f, &threads[i]);
+  }
+  fprintf(f, "]}\n");
+  return;
+}
+
+// hand every connection to the socket a fresh snapshot, then close it. The
+// snapshot is built in memory first, and a reader that stops reading only
+// holds up this thread, for at most STATS_SEND_TIMEOUT_MS.
+
+#define STATS_SEND_TIMEOUT_MS 1000
+
+static void *stats_loop(void *arg){
+  int s_listen, s, ret;
+  size_t len, off;
+  char *buf;
+  FILE *f;
+  struct timeval timeout;
+
+  s_listen = (int)(intptr_t)arg;
+  timeout.tv_sec = STATS_SEND_TIMEOUT_MS / 1000;
+  timeout.tv_usec = STATS_SEND_TIMEOUT_MS % 1000 * 1000;
+  while (1){
+    s = accept4(s_listen, NULL, NULL, SOCK_CLOEXEC);
+    if (s == -1){
+      if (errno == EINTR || errno == ECONNABORTED){
+        continue;
+      }
+      log_error("stats socket: accept(): %m");
+      return NULL;
+    }
+    (void) setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    f = open_memstream(&buf, &len);
+    if (f == NULL){
+      log_error("open_memstream(): %m");
+      close(s);
+      continue;
+    }
+    stats_write(f);
+    fclose(f);
+
+    for (off=0; off<len; off+=ret){
+      ret = send(s, buf + off, len - off, MSG_NOSIGNAL);
+      if (ret == -1){
+        break;
+      }
+    }
+    free(buf);
+    close(s);
+  }
+  return NULL;
+}
+
+// serve snapshots on a unix stream socket at path, replacing any stale one
+
+int stats_listen(const char *path){
+  int ret, s_listen;
+  struct sockaddr_un addr;
+  pthread_t t_stats;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)){
+    fprintf(stderr, "stats socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  s_listen = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (s_listen == -1){
+    perror("socket()");
+    return -1;
+  }
+  (void) unlink(path);
+  ret = bind(s_listen, (struct sockaddr *)&addr, sizeof(addr));
+  if (ret == -1){
+    perror("bind()");
+    close(s_listen);
+    return -1;
+  }
+  ret = listen(s_listen, SOMAXCONN);
+  if (ret == -1){
+    perror("listen()");
+    close(s_listen);
+    return -1;
+  }
+  ret = pthread_create(&t_stats, NULL, stats_loop, (void *)(intptr_t)s_listen);
+  if (ret != 0){
+    perror("pthread_create()");
+    close(s_listen);
+    return -1;
+  }
+  pthread_detach(t_stats);
+  return 0;
+}
@@ -0,0 +1,68 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define STATS_HIST_BUCKETS 32  // the last starts at 2^31 ns, about 2 s
+#define STATS_MAX_THREADS 256
+#define STATS_NAME_SIZE 16
+
+// counters only ever grow, and are updated and read with relaxed atomics:
+// writers never wait on a reader, and a snapshot is best-effort (two
+// fields may be from slightly different moments)
+
+// log2 histogram of durations: bucket i counts values in [2^i, 2^(i+1))
+// ns, bucket 0 also counts 0, and the last one everything above it
+
+struct stats_hist_t {
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t bucket[STATS_HIST_BUCKETS];
+};
+
+// what one station did; part of station_t
+
+struct station_stats_t {
+  uint64_t datagrams;          // live unicast and group datagrams sent
+  uint64_t bytes;              // of song data in them, headers not counted
+  uint64_t send_errors;        // failed sends, history bursts included
+  uint64_t announces;          // ANNOUNCEs queued
+  uint64_t joins;
+  uint64_t leaves;
+  uint64_t sharded_ticks;      // sent through the shard threads
+  uint64_t parity;             // FEC parity datagrams sent
+  uint64_t transitions;        // to the next track, or back to the start
+  uint64_t parks;              // times it went idle with no listeners
+  uint64_t resumes;            // and was woken up again by a join
+  struct stats_hist_t lateness;  // of each tick past its deadline
+  struct stats_hist_t fanout;    // of the send each tick's chunk went out in
+  struct stats_hist_t lock_wait; // per acquire of the station lock
+  struct stats_hist_t lock_hold;
+  struct stats_hist_t track_gap; // at each transition, the time between
+                                 // the two tracks' chunks beyond the
+                                 // last one's playback time
+};
+
+// what one scheduler, shard or connection worker did
+
+struct thread_stats_t {
+  char name[STATS_NAME_SIZE];
+  uint64_t wakeups;          // with something to do
+  uint64_t items;            // station ticks, datagrams (shards) or
+                             // connection events handled
+  uint64_t syscalls;         // datagram send calls made
+  struct stats_hist_t busy;  // per wakeup; a shard's slice send time
+};
+
+static inline void stats_add(uint64_t *counter, uint64_t n){
+  __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+  return;
+}
+
+void stats_hist_add(struct stats_hist_t *, int64_t);
+struct thread_stats_t *stats_register_thread(const char *, int);
+void stats_write(FILE *);
+int stats_listen(const char *);
+
+#endif
@@ -1,47 +1,218 @@
+#include <ctype.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <netinet/in.h>
 #include "misc.h"
 #include "station.h"
+#include "stats.h"
 #include "user_io.h"
 
-struct ses_t ses;
+extern struct ses_t ses;
 
-void *io_loop(void *_){
-  char c;
-  int i, j, ret;
-  struct in_addr in_addr_tmp;
-  while ((c = getchar()) != 'q'){
-    if (c == 'p'){
-      for (i=0; i<ses.num_stations; i++){
+#define USER_LINE_SIZE 4096
+
+// with the station set held still, as print_pacing() and stats_write()
+// also hold it
+
+static void print_listeners(FILE *f){
+  int i, j, n;
+  struct station_t *station;
+  struct registry_t *reg;
+
+  stations_read_lock();
+  n = __atomic_load_n(&ses.num_stations, __ATOMIC_ACQUIRE);
+  for (i=0; i<n; i++){
+    station = station_get(i);
+    if (__atomic_load_n(&station->state, __ATOMIC_ACQUIRE) != STATION_LIVE){
+      continue;
+    }
+
+    fprintf(f, "Station %d %s \"%s\", listening: ", i,
+            __atomic_load_n(&station->parked, __ATOMIC_RELAXED) ==
+            STATION_RUNNING ? "playing" : "parked at",
+            __atomic_load_n(&station->song, __ATOMIC_ACQUIRE));
+
+    // every listener, from the registry: the fan-out snapshot has a
+    // multicast group's listeners as the one group entry, and leaves out
+    // those still catching up. This only prints into memory, so the lock
+    // isn't held for long.
+
+    reg = &station->clients;
+    station_lock(station);
+    for (j=0; j<reg->num; j++){
+      fprintf(f, "%s:%d%s ",
+              inet_ntoa((struct in_addr){ htonl(reg->sub[j].ip) }),
+              reg->sub[j].udp_port,
+              reg->sub[j].mode & SUB_MULTICAST ? " (multicast)" :
+              reg->sub[j].mode & SUB_BURSTING ? " (catching up)" : "");
+    }
+    station_unlock(station);
+
+    fprintf(f, "\n");
+
+  }
+  stations_read_unlock();
+  return;
+}
+
+static void print_pacing(FILE *f){
+  int i, n;
+  struct station_t *station;
+  struct pacer_t *pacer;
+  struct lock_stats_t *lock_stats;
+
+  // pacing and lock counters are each written by one thread at a time,
+  // so this is a lock-free, best-effort view
+
+  stations_read_lock();
+  n = __atomic_load_n(&ses.num_stations, __ATOMIC_ACQUIRE);
+  for (i=0; i<n; i++){
+    station = station_get(i);
+    if (__atomic_load_n(&station->state, __ATOMIC_ACQUIRE) != STATION_LIVE){
+      continue;
+    }
+    pacer = &station->pacer;
+    if (station->timing != NULL){
+      fprintf(f, "Station %d: MP3 frame timing, ", i);
+    }
+    else {
+      fprintf(f, "Station %d: %ld B/s, ", i, station->byte_rate);
+    }
+    fprintf(f, "%llu ticks, %llu late, %llu resyncs, "
+            "lateness %.3f ms (max %.3f ms), drift %.3f ms\n",
+            (unsigned long long)pacer->ticks,
+            (unsigned long long)pacer->late_ticks,
+            (unsigned long long)pacer->resyncs,
+            pacer->lateness_ns / 1e6, pacer->max_lateness_ns / 1e6,
+            pacer->drift_ns / 1e6);
+    lock_stats = &station->lock_stats;
+    fprintf(f, "  lock: %llu acquires, %llu contended, "
+            "wait %.3f ms total (max %.3f ms), "
+            "hold %.3f ms total (max %.3f ms)\n",
+            (unsigned long long)__atomic_load_n(&lock_stats->acquires,
+                                                __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&lock_stats->contended,
+                                                __ATOMIC_RELAXED),
+            __atomic_load_n(&lock_stats->wait_ns, __ATOMIC_RELAXED) / 1e6,
+            __atomic_load_n(&lock_stats->max_wait_ns, __ATOMIC_RELAXED) / 1e6,
+            __atomic_load_n(&lock_stats->hold_ns, __ATOMIC_RELAXED) / 1e6,
+            __atomic_load_n(&lock_stats->max_hold_ns, __ATOMIC_RELAXED) / 1e6);
+  }
+  stations_read_unlock();
+  return;
+}
+
+// run print into memory, then write out what it printed once it has let
+// go of the station set, so a blocked terminal can't hold up a station
+// being replaced or removed, or the tick doing it
+
+static void print_stations(void (*print)(FILE *)){
+  size_t len;
+  char *buf;
+  FILE *f;
+
+  f = open_memstream(&buf, &len);
+  if (f == NULL){
+    perror("open_memstream()");
+    return;
+  }
+  print(f);
+  fclose(f);
+  fwrite(buf, 1, len, stdout);
+  fflush(stdout);
+  free(buf);
+  return;
+}
+
+// the rest of the command's line, without surrounding whitespace
 
-        printf("Station %d playing \"%s\", listening: ", i,
-               ses.station[i].song);
+static char *read_args(char *buf, size_t size){
+  char *end;
 
-        ret = pthread_mutex_lock(&ses.station[i].lock);
-        if (ret != 0){
-          perror("pthread_mutex_lock()");
-          exit(-1);
-        }
+  if (fgets(buf, size, stdin) == NULL){
+    buf[0] = '\0';
+  }
+  while (isspace((unsigned char)*buf)){
+    buf++;
+  }
+  end = buf + strlen(buf);
+  while (end > buf && isspace((unsigned char)end[-1])){
+    *--end = '\0';
+  }
+  return buf;
+}
 
-        for (j=0; j<MAX_CLIENTS_PER_STATION; j++){
-          if (ses.station[i].client[j].flags & CLIENT_ACTIVE){
-            in_addr_tmp.s_addr = htonl(ses.station[i].client[j].ip);
-            printf("%s:%d ", inet_ntoa(in_addr_tmp),
-                   ses.station[i].client[j].udp_port);
-          }
-        }
+// "n rest": the station number, with *rest pointing past it
 
-        ret = pthread_mutex_unlock(&ses.station[i].lock);
-        if (ret != 0){
-          perror("pthread_mutex_unlock()");
-          exit(-1);
-        }
+static int parse_station(char *args, char **rest){
+  long n;
 
-        printf("\n");
+  n = strtol(args, rest, 10);
+  if (*rest == args || n < 0 || n >= STATION_MAX){
+    return -1;
+  }
+  while (isspace((unsigned char)**rest)){
+    (*rest)++;
+  }
+  return n;
+}
 
+void *io_loop(void *_){
+  int c, id;
+  char line[USER_LINE_SIZE];
+  char *args, *rest;
+  while ((c = getchar()) != 'q' && c != EOF){
+    if (c == 'p'){
+      print_stations(print_listeners);
+    }
+    else if (c == 's'){
+      print_stations(print_pacing);
+    }
+    else if (c == 'j'){
+
+      // the same snapshot the stats socket serves
+
+      print_stations(stats_write);
+    }
+
+    // the station set can change while the server runs: "a file[@rate]"
+    // adds a station, "d n" removes station n, disconnecting its listeners,
+    // and "r n file[@rate]" has station n play something else instead
+
+    else if (c == 'a'){
+      args = read_args(line, sizeof(line));
+      id = args[0] != '\0' ? station_add(args) : -1;
+      if (id == -1){
+        printf("usage: a file[@rate]; no station added\n");
+      }
+      else {
+        printf("Station %d added\n", id);
+      }
+      fflush(stdout);
+    }
+    else if (c == 'd'){
+      args = read_args(line, sizeof(line));
+      id = parse_station(args, &rest);
+      if (id == -1 || rest[0] != '\0' || station_remove(id) == -1){
+        printf("usage: d station; no such station\n");
+      }
+      else {
+        printf("Station %d removed\n", id);
+      }
+      fflush(stdout);
+    }
+    else if (c == 'r'){
+      args = read_args(line, sizeof(line));
+      id = parse_station(args, &rest);
+      if (id == -1 || rest[0] == '\0' || station_replace(id, rest) == -1){
+        printf("usage: r station file[@rate]; station not replaced\n");
+      }
+      else {
+        printf("Station %d replaced\n", id);
       }
+      fflush(stdout);
     }
   }
 